@@ -14,17 +14,105 @@
  * is legally binding.
  */
 #include "checkpoint.hh"
+#include "file.hh"
+#include "lz.hh"
+#include <fcntl.h>
+
+ckstate::ckstate()
+    : vals(new_bufkvout()), count(0), bytes(0), scanned(0), since(0),
+      floor(0), block_count(0), fd(-1), compress(false), zbuf(0), zcap(0),
+      written(0), synced(0), pause_interval(0), pause_at(0), paused(false) {
+}
+
+ckstate::~ckstate() {
+    free_kvout(vals);
+    free(zbuf);
+}
+
+void ckstate::start(int f, bool z) {
+    fd = f;
+    compress = z;
+    written = synced = lseek(fd, 0, SEEK_CUR);
+    always_assert(written >= 0);
+    count = bytes = scanned = block_count = 0;
+    pause_at = pause_interval;
+    paused = false;
+    blocks.clear();
+    kvout_reset(vals);
+}
+
+// Write the entries in vals as a block. The kernel starts writing each
+// block back at once; by the time the next block is written the previous
+// one has usually reached the disk, so we wait for it and drop it from
+// the page cache. A checkpoint then neither accumulates dirty pages nor
+// evicts the pages the server is using.
+void ckstate::write_block() {
+    if (vals->n == 0)
+        return;
+    const char *data = vals->buf;
+    unsigned len = vals->n;
+    if (compress) {
+        if (lz_compress_bound(len) > zcap) {
+            zcap = lz_compress_bound(len);
+            zbuf = (char *) realloc(zbuf, zcap);
+            always_assert(zbuf);
+        }
+        size_t zlen = lz_compress(vals->buf, len, zbuf);
+        if (zlen < len) {
+            data = zbuf;
+            len = zlen;
+        }
+    }
+    blocks.push_back(block{block_count, vals->n, len, block_firstkey});
+    checked_write(fd, data, len);
+    bytes += len;
+#if HAVE_SYNC_FILE_RANGE
+    sync_file_range(fd, written, len, SYNC_FILE_RANGE_WRITE);
+    if (synced < written) {
+        sync_file_range(fd, synced, written - synced,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE
+                        | SYNC_FILE_RANGE_WAIT_AFTER);
+# if HAVE_POSIX_FADVISE
+        posix_fadvise(fd, synced, written - synced, POSIX_FADV_DONTNEED);
+# endif
+        synced = written;
+    }
+#endif
+    written += len;
+    kvout_reset(vals);
+    block_count = 0;
+}
 
 // add one key/value to a checkpoint.
 // called by checkpoint_tree() for each node.
 bool ckstate::visit_value(Str key, const row_type* value, threadinfo&) {
     if (endkey && key >= endkey)
         return false;
-    if (!row_is_marker(value)) {
-        msgpack::unparser<kvout> up(*vals);
-        up.write(key).write_wide(value->timestamp());
-        value->checkpoint_write(up);
-        ++count;
+    if (pause_interval && scanned == pause_at) {
+        resume_key = lcdf::String(key);
+        pause_at += pause_interval;
+        paused = true;
+        return false;
+    }
+    ++scanned;
+    if (since) {
+        if (circular_int<kvtimestamp_t>::less(value->timestamp(), since))
+            return true;
+    } else if (row_is_marker(value)) {
+        if (!floor
+            || circular_int<kvtimestamp_t>::less(value->timestamp(), floor))
+            markers.push_back(std::make_pair(lcdf::String(key),
+                                             value->timestamp()));
+        return true;
     }
+    if (vals->n >= block_size)
+        write_block();
+    if (block_count == 0)
+        block_firstkey = lcdf::String(key);
+    msgpack::unparser<kvout> up(*vals);
+    up.write(key).write_wide(value->timestamp());
+    value->checkpoint_write(up);
+    ++count;
+    ++block_count;
     return true;
 }
@@ -18,24 +18,74 @@
 #include "kvrow.hh"
 #include "kvio.hh"
 #include "msgpack.hh"
+#include <vector>
 
 struct ckstate {
-    kvout *vals; // key, val, timestamp in msgpack
+    kvout *vals; // key, val, timestamp in msgpack: the block being filled
     uint64_t count; // total nodes written
-    uint64_t bytes;
+    uint64_t bytes; // bytes written to the file
+    uint64_t scanned; // rows visited, including rows left out
     pthread_cond_t state_cond;
     volatile int state;
     threadinfo *ti;
     Str startkey;
     Str endkey;
 
+    // An incremental checkpoint (since != 0) holds the rows and remove
+    // markers with timestamps >= since. A full one holds every row, and
+    // collects the remove markers older than floor (all of them if floor
+    // is 0), which it makes unnecessary.
+    kvtimestamp_t since;
+    kvtimestamp_t floor;
+    std::vector<std::pair<lcdf::String, kvtimestamp_t> > markers;
+
+    // The checkpoint is written in blocks of about block_size bytes that
+    // hold whole entries, so blocks can be compressed and read separately.
+    // Each block goes to fd as soon as it fills, so a checkpoint thread
+    // holds about one block in memory however large its partition is.
+    enum { block_size = 1 << 20 };
+    struct block {
+        uint64_t count;         // entries in the block
+        unsigned rawlen;        // bytes of entries
+        unsigned len;           // bytes in the file (< rawlen if compressed)
+        lcdf::String firstkey;  // key of the first entry
+    };
+    std::vector<block> blocks;
+    uint64_t block_count;       // entries in vals
+    lcdf::String block_firstkey;
+    int fd;
+    bool compress;
+    char *zbuf;
+    size_t zcap;
+    off_t written;              // file offset after the last block
+    off_t synced;               // written back and dropped from the cache
+
+    // With pause_interval != 0, the scan stops after every pause_interval
+    // rows, with paused set and resume_key holding the next key, so the
+    // caller can leave its RCU section and slow down before scanning on.
+    uint64_t pause_interval;
+    uint64_t pause_at;
+    bool paused;
+    lcdf::String resume_key;
+
+    ckstate();
+    ~ckstate();
+    // Start writing blocks at fd's current offset.
+    void start(int fd, bool compress);
+    void write_block();
+
     template <typename SS, typename K>
     void visit_leaf(const SS&, const K&, threadinfo&) {
     }
     bool visit_value(Str key, const row_type* value, threadinfo& ti);
 
+    // Insert a checkpoint entry unless the tree has a newer version.
     template <typename T>
     static void insert(T& table, msgpack::parser& par, threadinfo& ti);
+    // Remove key if its value is still the remove marker with timestamp ts.
+    template <typename T>
+    static void remove_marker(T& table, Str key, kvtimestamp_t ts,
+                              threadinfo& ti);
 };
 
 template <typename T>
@@ -45,12 +95,35 @@ void ckstate::insert(T& table, msgpack::parser& par, threadinfo& ti) {
     par >> key >> ts;
     row_type* row = row_type::checkpoint_read(par, ts, ti);
 
+    // Files from several generations may be loaded at once; the newest
+    // version of a key wins.
     typename T::cursor_type lp(table, key);
     bool found = lp.find_insert(ti);
-    masstree_invariant(!found); (void) found;
-    ti.observe_phantoms(lp.node());
-    lp.value() = row;
+    if (!found) {
+        ti.observe_phantoms(lp.node());
+        lp.value() = row;
+    } else if (circular_int<kvtimestamp_t>::less(lp.value()->timestamp(), ts)) {
+        // (the server may be running if recovery loads blocks lazily)
+        lp.value()->deallocate_rcu(ti);
+        lp.value() = row;
+    } else
+        row->deallocate(ti);
     lp.finish(1, ti);
 }
 
+template <typename T>
+void ckstate::remove_marker(T& table, Str key, kvtimestamp_t ts,
+                            threadinfo& ti) {
+    typename T::cursor_type lp(table, key);
+    bool found = lp.find_locked(ti);
+    if (found && lp.value()->timestamp() == ts) {
+        kvtimestamp_t& node_ts = lp.node()->phantom_epoch_[0];
+        if (circular_int<kvtimestamp_t>::less_equal(node_ts, ts))
+            node_ts = (ts | 1) + 1;
+        lp.value()->deallocate_rcu(ti);
+        lp.finish(-1, ti);
+    } else
+        lp.finish(0, ti);
+}
+
 #endif
@@ -0,0 +1,70 @@
+/* Masstree
+ * Eddie Kohler, Yandong Mao, Robert Morris
+ * Copyright (c) 2012-2014 President and Fellows of Harvard College
+ * Copyright (c) 2012-2014 Massachusetts Institute of Technology
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, subject to the conditions
+ * listed in the Masstree LICENSE file. These conditions include: you must
+ * preserve this copyright notice, and you cannot mention the copyright
+ * holders in advertising related to the Software without their permission.
+ * The Software is provided WITHOUT ANY WARRANTY, EXPRESS OR IMPLIED. This
+ * notice is a summary of the Masstree LICENSE file; the license in that file
+ * is legally binding.
+ */
+#include "crc32c.hh"
+#include <string.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+namespace {
+struct crc32c_table {
+    uint32_t t[256];
+    crc32c_table() {
+        for (uint32_t i = 0; i != 256; ++i) {
+            uint32_t c = i;
+            for (int j = 0; j != 8; ++j)
+                c = (c >> 1) ^ (c & 1 ? 0x82F63B78 : 0);
+            t[i] = c;
+        }
+    }
+};
+const crc32c_table table;
+
+uint32_t crc32c_sw(const unsigned char* p, size_t len, uint32_t c) {
+    for (; len; --len, ++p)
+        c = table.t[(c ^ *p) & 0xFF] ^ (c >> 8);
+    return c;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t crc32c_hw(const unsigned char* p, size_t len, uint32_t c) {
+    for (; len && (uintptr_t(p) & 7); --len, ++p)
+        c = _mm_crc32_u8(c, *p);
+    uint64_t c64 = c;
+    for (; len >= 8; len -= 8, p += 8) {
+        uint64_t x;
+        memcpy(&x, p, 8);
+        c64 = _mm_crc32_u64(c64, x);
+    }
+    c = c64;
+    for (; len; --len, ++p)
+        c = _mm_crc32_u8(c, *p);
+    return c;
+}
+
+const bool have_sse42 = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+uint32_t crc32c(const void* data, size_t len, uint32_t crc) {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+#if defined(__x86_64__)
+    if (have_sse42)
+        return ~crc32c_hw(p, len, ~crc);
+#endif
+    return ~crc32c_sw(p, len, ~crc);
+}
@@ -0,0 +1,25 @@
+/* Masstree
+ * Eddie Kohler, Yandong Mao, Robert Morris
+ * Copyright (c) 2012-2014 President and Fellows of Harvard College
+ * Copyright (c) 2012-2014 Massachusetts Institute of Technology
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, subject to the conditions
+ * listed in the Masstree LICENSE file. These conditions include: you must
+ * preserve this copyright notice, and you cannot mention the copyright
+ * holders in advertising related to the Software without their permission.
+ * The Software is provided WITHOUT ANY WARRANTY, EXPRESS OR IMPLIED. This
+ * notice is a summary of the Masstree LICENSE file; the license in that file
+ * is legally binding.
+ */
+#ifndef MASSTREE_CRC32C_HH
+#define MASSTREE_CRC32C_HH
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC-32C (Castagnoli) of len bytes at data, continuing from crc. Uses
+// the SSE4.2 crc32 instruction when the CPU has it.
+uint32_t crc32c(const void* data, size_t len, uint32_t crc = 0);
+
+#endif
@@ -26,8 +26,18 @@
 #include <string.h>
 #include <sys/select.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#if HAVE_LINUX_FUTEX_H
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
 #include "kvio.hh"
 
 
@@ -60,6 +70,7 @@ kvout* new_bufkvout() {
 void kvout_reset(kvout* kv) {
     assert(kv->fd < 0);
     kv->n = 0;
+    kv->nrefs = 0;
 }
 
 // API to free a kvout.
@@ -68,11 +79,156 @@ void free_kvout(kvout* kv) {
     if (kv->buf)
         free(kv->buf);
     kv->buf = 0;
+    free(kv->refs);
     free(kv);
 }
 
+// Write all of iov[0, niov), which may be modified.
+static void kvwritev(int fd, struct iovec* iov, int niov) {
+    while (niov) {
+        ssize_t cc = writev(fd, iov, niov);
+        if (cc <= 0) {
+            if (errno == EWOULDBLOCK) {
+                usleep(1);
+                continue;
+            }
+            perror("kvflush writev");
+            return;
+        }
+        for (; niov && size_t(cc) >= iov->iov_len; ++iov, --niov)
+            cc -= iov->iov_len;
+        if (niov) {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + cc;
+            iov->iov_len -= cc;
+        }
+    }
+}
+
+static void ring_wake(kvring* ring, int fd);
+
+// Fill iov with up to max_iov pieces of kv's output, alternating buf
+// and references, starting from *ri and *pos; returns the count. Call
+// again with the updated *ri and *pos for more.
+static int kvout_gather(const kvout* kv, unsigned* ri, unsigned* pos,
+                        struct iovec* iov, int max_iov) {
+    int niov = 0;
+    while (niov != max_iov && *ri <= kv->nrefs) {
+        unsigned end = *ri < kv->nrefs ? kv->refs[*ri].pos : kv->n;
+        if (end != *pos) {
+            iov[niov].iov_base = kv->buf + *pos;
+            iov[niov].iov_len = end - *pos;
+            *pos = end;
+            if (++niov == max_iov)
+                break;
+        }
+        if (*ri < kv->nrefs) {
+            iov[niov].iov_base = const_cast<char*>(kv->refs[*ri].s);
+            iov[niov].iov_len = kv->refs[*ri].len;
+            ++niov;
+        }
+        ++*ri;
+    }
+    return niov;
+}
+
+static void kvflush_references(kvout* kv) {
+    enum { max_iov = 64 };
+    struct iovec iov[max_iov];
+    unsigned ri = 0, pos = 0;
+    while (int niov = kvout_gather(kv, &ri, &pos, iov, max_iov)) {
+        if (kv->ring) {
+            for (int j = 0; j != niov; ++j)
+                kvring_send(kv->ring, kv->fd,
+                            static_cast<const char*>(iov[j].iov_base),
+                            iov[j].iov_len);
+        } else
+            kvwritev(kv->fd, iov, niov);
+    }
+    kv->n = kv->nrefs = 0;
+}
+
+// Send what of iov[0, niov) goes without waiting; returns the byte count.
+static size_t kvsend_nonblocking(kvout* kv, const struct iovec* iov,
+                                 int niov) {
+    if (kv->ring) {
+        size_t sent = 0;
+        for (int j = 0; j != niov; ++j) {
+            size_t w = kv->ring->write(static_cast<const char*>(iov[j].iov_base),
+                                       iov[j].iov_len);
+            sent += w;
+            if (w != iov[j].iov_len)
+                break;
+        }
+        if (sent)
+            ring_wake(kv->ring, kv->fd);
+        return sent;
+    }
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = const_cast<struct iovec*>(iov);
+    msg.msg_iovlen = niov;
+    ssize_t cc = sendmsg(kv->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    return cc > 0 ? cc : 0;
+}
+
+void kvout_unpin(kvout* kv) {
+    if (!kv->nrefs)
+        return;
+    enum { max_iov = 64 };
+    struct iovec iov[max_iov];
+    unsigned ri = 0, pos = 0;
+    size_t sent = 0, total = kv->n;
+    for (unsigned i = 0; i != kv->nrefs; ++i)
+        total += kv->refs[i].len;
+    while (int niov = kvout_gather(kv, &ri, &pos, iov, max_iov)) {
+        size_t want = 0;
+        for (int j = 0; j != niov; ++j)
+            want += iov[j].iov_len;
+        size_t got = kvsend_nonblocking(kv, iov, niov);
+        sent += got;
+        if (got != want)
+            break;
+    }
+
+    // Copy the unsent rest into a fresh buf.
+    unsigned capacity = kv->capacity;
+    while (total - sent > capacity)
+        capacity *= 2;
+    char* buf = (char*) malloc(capacity);
+    assert(buf);
+    char* p = buf;
+    size_t skip = sent;
+    ri = pos = 0;
+    while (int niov = kvout_gather(kv, &ri, &pos, iov, max_iov))
+        for (int j = 0; j != niov; ++j) {
+            size_t len = iov[j].iov_len;
+            if (skip >= len) {
+                skip -= len;
+                continue;
+            }
+            memcpy(p, static_cast<const char*>(iov[j].iov_base) + skip,
+                   len - skip);
+            p += len - skip;
+            skip = 0;
+        }
+    free(kv->buf);
+    kv->buf = buf;
+    kv->capacity = capacity;
+    kv->n = p - buf;
+    kv->nrefs = 0;
+}
+
 void kvflush(kvout* kv) {
     assert(kv->fd >= 0);
+    if (kv->nrefs) {
+        kvflush_references(kv);
+        return;
+    }
+    if (kv->ring) {
+        kvring_send(kv->ring, kv->fd, kv->buf, kv->n);
+        kv->n = 0;
+        return;
+    }
     size_t sent = 0;
     while (kv->n > sent) {
         ssize_t cc = write(kv->fd, kv->buf + sent, kv->n - sent);
@@ -91,10 +247,12 @@ void kvflush(kvout* kv) {
 
 // API
 void kvout::grow(unsigned want) {
-    if (fd >= 0)
+    unsigned extra = want > n ? want - n : 1;
+    if (fd >= 0 && nrefs)
+        kvout_unpin(this);  // don't wait on the peer while pinning rows
+    else if (fd >= 0)
         kvflush(this);
-    if (want == 0)
-        want = capacity + 1;
+    want = n + extra;
     while (want > capacity)
         capacity *= 2;
     buf = (char*) realloc(buf, capacity);
@@ -102,11 +260,156 @@ void kvout::grow(unsigned want) {
 }
 
 int kvwrite(kvout* kv, const void* buf, unsigned n) {
-    if (kv->n + n > kv->capacity && kv->fd >= 0)
-        kvflush(kv);
     if (kv->n + n > kv->capacity)
         kv->grow(kv->n + n);
     memcpy(kv->buf + kv->n, buf, n);
     kv->n += n;
     return n;
 }
+
+void kvout_reference(kvout* kv, const char* s, unsigned n) {
+    if (kv->nrefs == kv->refcap) {
+        kv->refcap = kv->refcap ? kv->refcap * 2 : 16;
+        kv->refs = (kvout_ref*) realloc(kv->refs,
+                                        kv->refcap * sizeof(kvout_ref));
+        assert(kv->refs);
+    }
+    kvout_ref& r = kv->refs[kv->nrefs];
+    r.pos = kv->n;
+    r.len = n;
+    r.s = s;
+    ++kv->nrefs;
+}
+
+void kvwrite(kvout* kv, const kvout* x) {
+    unsigned pos = 0;
+    for (unsigned i = 0; i != x->nrefs; ++i) {
+        kvwrite(kv, x->buf + pos, x->refs[i].pos - pos);
+        kvout_reference(kv, x->refs[i].s, x->refs[i].len);
+        pos = x->refs[i].pos;
+    }
+    kvwrite(kv, x->buf + pos, x->n - pos);
+}
+
+// Shared-memory rings. The futexes live in memory mapped by two
+// processes, so they can't use the private futex operations.
+static void ring_futex_wait(volatile uint32_t* word, uint32_t val) {
+    struct timespec ts = {0, 10000000};
+#if HAVE_LINUX_FUTEX_H
+    syscall(SYS_futex, word, FUTEX_WAIT, val, &ts, 0, 0);
+#else
+    if (*word == val)
+        nanosleep(&ts, 0);
+#endif
+}
+
+static void ring_futex_wake(volatile uint32_t* word) {
+#if HAVE_LINUX_FUTEX_H
+    syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, 0, 0, 0);
+#else
+    (void) word;
+#endif
+}
+
+// Has the other end of a ring connection closed its socket?
+static bool ring_peer_gone(int fd) {
+    char c;
+    ssize_t r = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK
+                      && errno != EINTR);
+}
+
+static void ring_wake(kvring* ring, int fd) {
+    memory_fence();
+    if (uint32_t w = ring->waiting) {
+        ring->waiting = 0;
+        if (w == kvring::wait_socket) {
+            char c = 0;
+            ssize_t r = send(fd, &c, 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+            (void) r;
+        } else
+            ring_futex_wake(&ring->waiting);
+    }
+}
+
+kvring_region* kvring_create(lcdf::String& name) {
+    static int nrings;
+    char buf[64];
+    snprintf(buf, sizeof(buf), "/mtd-ring-%d-%d", (int) getpid(), nrings++);
+    int fd = shm_open(buf, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        perror(buf);
+        return 0;
+    }
+    void* p = MAP_FAILED;
+    if (ftruncate(fd, sizeof(kvring_region)) == 0)
+        p = mmap(0, sizeof(kvring_region), PROT_READ | PROT_WRITE,
+                 MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        perror(buf);
+        shm_unlink(buf);
+        return 0;
+    }
+    kvring_region* r = static_cast<kvring_region*>(p);
+    r->magic = kvring_region::magic_value;
+    name = lcdf::String(buf);
+    return r;
+}
+
+kvring_region* kvring_attach(const char* name) {
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+        return 0;
+    struct stat st;
+    void* p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && size_t(st.st_size) == sizeof(kvring_region))
+        p = mmap(0, sizeof(kvring_region), PROT_READ | PROT_WRITE,
+                 MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return 0;
+    kvring_region* r = static_cast<kvring_region*>(p);
+    if (r->magic != kvring_region::magic_value) {
+        munmap(p, sizeof(kvring_region));
+        return 0;
+    }
+    return r;
+}
+
+void kvring_unlink(const lcdf::String& name) {
+    shm_unlink(name.c_str());
+}
+
+void kvring_free(kvring_region* r) {
+    munmap(r, sizeof(kvring_region));
+}
+
+void kvring_send(kvring* ring, int fd, const char* s, size_t n) {
+    while (n) {
+        size_t w = ring->write(s, n);
+        s += w;
+        n -= w;
+        ring_wake(ring, fd);
+        if (n && !w) {
+            if (ring_peer_gone(fd))
+                return;
+            usleep(1);
+        }
+    }
+}
+
+size_t kvring_receive(kvring* ring, int fd, char* s, size_t n, bool block) {
+    size_t r;
+    while ((r = ring->read(s, n)) == 0 && block) {
+        ring->waiting = kvring::wait_futex;
+        memory_fence();
+        if (ring->readable())
+            ring->waiting = 0;
+        else if (ring_peer_gone(fd))
+            return 0;
+        else
+            ring_futex_wait(&ring->waiting, kvring::wait_futex);
+    }
+    return r;
+}
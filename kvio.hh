@@ -17,15 +17,83 @@
 #define KVIO_H
 #include <string>
 #include <vector>
+#include <algorithm>
 #include <stdlib.h>
+#include <string.h>
 #include "string.hh"
 #include "str.hh"
+#include "compiler.hh"
+
+// A single-producer, single-consumer byte ring in memory shared by mtd
+// and a client on the same host. Messages use the same msgpack framing
+// as sockets. A consumer about to sleep sets waiting, then rechecks; a
+// producer that finds it set clears it and rings the doorbell, either a
+// futex wake or, for a consumer sleeping in epoll, a byte on the
+// connection's socket.
+struct kvring {
+    enum { size = 1 << 20 };
+    enum { wait_futex = 1, wait_socket = 2 };
+    volatile uint64_t head;     // bytes consumed, written by the consumer
+    char padding1[CACHE_LINE_SIZE - sizeof(uint64_t)];
+    volatile uint64_t tail;     // bytes produced, written by the producer
+    char padding2[CACHE_LINE_SIZE - sizeof(uint64_t)];
+    volatile uint32_t waiting;  // consumer is asleep; a futex word
+    char padding3[CACHE_LINE_SIZE - sizeof(uint32_t)];
+    char data[size];
+
+    size_t readable() const {
+        return tail - head;
+    }
+    size_t writable() const {
+        return size - (tail - head);
+    }
+    inline size_t write(const char* s, size_t n);
+    inline size_t read(char* s, size_t n);
+};
+
+// The mapping a ring connection shares: one ring each way.
+struct kvring_region {
+    enum { magic_value = 0x4B565231 }; // "KVR1"
+    uint32_t magic;
+    char padding[CACHE_LINE_SIZE - sizeof(uint32_t)];
+    kvring requests;
+    kvring responses;
+};
+
+// Clients create a region under a fresh shm name, which they pass in
+// the handshake and unlink once mtd has attached it.
+kvring_region* kvring_create(lcdf::String& name);
+kvring_region* kvring_attach(const char* name);
+void kvring_unlink(const lcdf::String& name);
+void kvring_free(kvring_region* r);
+// Copy n bytes into ring, waiting for space, and wake its consumer.
+// fd is the connection's socket, used to notice a vanished peer and as
+// the consumer's doorbell.
+void kvring_send(kvring* ring, int fd, const char* s, size_t n);
+// Copy up to n bytes out of ring. If block, wait until there are some;
+// returns 0 only if the peer has gone.
+size_t kvring_receive(kvring* ring, int fd, char* s, size_t n, bool block);
+
+// Output is normally copied into buf. Long strings that stay put until
+// the next kvflush() or kvout_unpin(), such as row columns under RCU,
+// can instead be added by reference (kvout_reference()); kvflush() then
+// gathers buf and the references with writev.
+struct kvout_ref {
+    unsigned pos;       // goes before buf[pos]
+    unsigned len;
+    const char* s;
+};
 
 struct kvout {
+    enum { reference_min = 1024 }; // shorter strings are cheaper to copy
     int fd;
     char* buf;
     unsigned capacity; // allocated size of buf
     unsigned n;   // # of chars we've written to buf
+    kvring* ring; // if set, kvflush() sends to ring instead of fd
+    kvout_ref* refs;
+    unsigned nrefs;
+    unsigned refcap;
 
     inline void append(char c);
     inline char* reserve(int n);
@@ -39,7 +107,13 @@ kvout* new_bufkvout();
 void kvout_reset(kvout* kv);
 void free_kvout(kvout* kv);
 int kvwrite(kvout* kv, const void* buf, unsigned int n);
+// Append x's contents, including its references, to kv.
+void kvwrite(kvout* kv, const kvout* x);
+void kvout_reference(kvout* kv, const char* s, unsigned n);
 void kvflush(kvout* kv);
+// Send what of kv goes without blocking, then copy any references still
+// unsent into buf, so kv no longer points at memory it doesn't own.
+void kvout_unpin(kvout* kv);
 
 inline void kvout::append(char c) {
     if (n == capacity)
@@ -64,4 +138,25 @@ inline void kvout::set_end(char* x) {
     n = x - buf;
 }
 
+inline size_t kvring::write(const char* s, size_t n) {
+    n = std::min(n, writable());
+    size_t pos = tail & (size - 1), first = std::min(n, size - pos);
+    memcpy(data + pos, s, first);
+    memcpy(data, s + first, n - first);
+    release_fence();
+    tail = tail + n;
+    return n;
+}
+
+inline size_t kvring::read(char* s, size_t n) {
+    n = std::min(n, readable());
+    acquire_fence();
+    size_t pos = head & (size - 1), first = std::min(n, size - pos);
+    memcpy(s, data + pos, first);
+    memcpy(s + first, data, n - first);
+    release_fence();
+    head = head + n;
+    return n;
+}
+
 #endif
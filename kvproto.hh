@@ -26,11 +26,16 @@ enum {
     Cmd_Remove = 10,
     Cmd_Checkpoint = 12,
     Cmd_Handshake = 14,
+    Cmd_Stats = 16,
+    Cmd_MultiGet = 18,
+    Cmd_MultiPut = 20,
     Cmd_Max
 };
 
 enum result_t {
-    NotFound = -2,
+    TooLarge = -4,              // mtd refused an update too large to log
+    Overloaded,                 // mtd shed the request without running it
+    NotFound,
     Retry,
     OutOfDate,
     Inserted,
@@ -45,7 +50,8 @@ enum ckptrav_order_t {
 };
 
 struct row_marker {
-    enum { mt_remove = 1, mt_delta = 2 };
+    enum { mt_remove = 1, mt_delta = 2,
+           mt_delta_columns = 3 /* delta holds a log column list */ };
     int marker_type_;
 };
 
@@ -19,6 +19,8 @@
 #include "kvproto.hh"
 #include "log.hh"
 #include "json.hh"
+#include "msgpack.hh"
+#include "kvio.hh"
 #include <algorithm>
 
 #if MASSTREE_ROW_TYPE_ARRAY
@@ -43,6 +45,7 @@ struct query_helper {
 };
 
 template <typename R> class query_json_scanner;
+template <typename R, typename U> class query_unparse_scanner;
 
 template <typename R>
 class query {
@@ -59,8 +62,10 @@ class query {
                      const Json* firstreq, const Json* lastreq, threadinfo& ti);
     template <typename T>
     result_t run_replace(T& table, Str key, Str value, threadinfo& ti);
+    // With tombstone, leave a remove marker in place of the row (as log
+    // replay does) so incremental checkpoints can record the removal.
     template <typename T>
-    bool run_remove(T& table, Str key, threadinfo& ti);
+    bool run_remove(T& table, Str key, threadinfo& ti, bool tombstone = false);
 
     template <typename T>
     void run_scan(T& table, Json& request, threadinfo& ti);
@@ -69,19 +74,73 @@ class query {
     template <typename T>
     void run_rscan(T& table, Json& request, threadinfo& ti);
 
+    // Versions of run_get and run_scan for callers that encode responses
+    // themselves. They append the fields (all of them if firstf == lastf)
+    // to out; run_get returns how many, or -1 if key is not found, and
+    // run_scan returns how many key/value pairs it appended. If the scan
+    // stops after count pairs, run_scan sets *lastkey to the last key.
+    // A kvout may be left referring to row memory; see unparse_col.
+    template <typename T, typename U>
+    int run_get(T& table, Str key, const int* firstf, const int* lastf,
+                msgpack::unparser<U>& out, threadinfo& ti);
+    template <typename T, typename U>
+    int run_scan(T& table, Str firstkey, int count,
+                 const int* firstf, const int* lastf,
+                 msgpack::unparser<U>& out, threadinfo& ti,
+                 lcdf::String* lastkey = nullptr);
+
+    // Batched Get and Replace. run_get_batch appends each key's value
+    // (as Scan returns values), or null, to results. run_replace_batch
+    // takes alternating keys and values, appends each result to results,
+    // and leaves the query times in batch_times() for logging.
+    template <typename T>
+    void run_get_batch(T& table, const Json* firstkey, const Json* lastkey,
+                       const Json* firstf, const Json* lastf,
+                       Json& results, threadinfo& ti);
+    template <typename T>
+    void run_replace_batch(T& table, const Json* firstreq,
+                           const Json* lastreq, Json& results,
+                           threadinfo& ti);
+
     const loginfo::query_times& query_times() const {
         return qtimes_;
     }
+    const std::vector<loginfo::query_times>& batch_times() const {
+        return batch_times_;
+    }
 
   private:
     std::vector<typename R::index_type> f_;
     loginfo::query_times qtimes_;
+    std::vector<loginfo::query_times> batch_times_;
     query_helper<R> helper_;
     lcdf::String scankey_;
     int scankeypos_;
 
     void emit_fields(const R* value, Json& req, threadinfo& ti);
     void emit_fields1(const R* value, Json& req, threadinfo& ti);
+    template <typename U>
+    void unparse_fields1(const R* value, msgpack::unparser<U>& out,
+                         threadinfo& ti);
+    // A missing column is null, as in the Json responses. If inplace,
+    // col lies in the row itself (not a snapshot copy), and a long one
+    // is added to a kvout by reference, so the caller must flush the
+    // kvout before rcu_stop().
+    template <typename U>
+    static void unparse_col(msgpack::unparser<U>& out, Str col, bool) {
+        if (col.s)
+            out << col;
+        else
+            out.null();
+    }
+    static void unparse_col(msgpack::unparser<kvout>& out, Str col,
+                            bool inplace) {
+        if (inplace && col.s && col.len >= (int) kvout::reference_min) {
+            out.write_string_header(col.len);
+            kvout_reference(&out.base(), col.s, col.len);
+        } else
+            unparse_col<kvout>(out, col, false);
+    }
     void assign_timestamp(threadinfo& ti);
     void assign_timestamp(threadinfo& ti, kvtimestamp_t t);
     inline bool apply_put(R*& value, bool found, const Json* firstreq,
@@ -89,8 +148,10 @@ class query {
     inline bool apply_replace(R*& value, bool found, Str new_value,
                               threadinfo& ti);
     inline void apply_remove(R*& value, kvtimestamp_t& node_ts, threadinfo& ti);
+    inline void apply_tombstone(R*& value, threadinfo& ti);
 
     template <typename RR> friend class query_json_scanner;
+    template <typename RR, typename U> friend class query_unparse_scanner;
 };
 
 
@@ -120,6 +181,24 @@ void query<R>::emit_fields1(const R* value, Json& req, threadinfo& ti) {
     }
 }
 
+template <typename R> template <typename U>
+void query<R>::unparse_fields1(const R* value, msgpack::unparser<U>& out,
+                               threadinfo& ti) {
+    const R* snapshot = helper_.snapshot(value, f_, ti);
+    bool inplace = snapshot == value;
+    if ((f_.empty() && snapshot->ncol() == 1) || f_.size() == 1)
+        unparse_col(out, snapshot->col(f_.empty() ? 0 : f_[0]), inplace);
+    else if (f_.empty()) {
+        out.write_array_header(snapshot->ncol());
+        for (int i = 0; i != snapshot->ncol(); ++i)
+            unparse_col(out, snapshot->col(i), inplace);
+    } else {
+        out.write_array_header(f_.size());
+        for (int i = 0; i != (int) f_.size(); ++i)
+            unparse_col(out, snapshot->col(f_[i]), inplace);
+    }
+}
+
 
 template <typename R> template <typename T>
 void query<R>::run_get(T& table, Json& req, threadinfo& ti) {
@@ -137,6 +216,39 @@ void query<R>::run_get(T& table, Json& req, threadinfo& ti) {
     }
 }
 
+template <typename R> template <typename T, typename U>
+int query<R>::run_get(T& table, Str key, const int* firstf, const int* lastf,
+                      msgpack::unparser<U>& out, threadinfo& ti) {
+    typename T::unlocked_cursor_type lp(table, key);
+    bool found = lp.find_unlocked(ti);
+    if (!found || row_is_marker(lp.value()))
+        return -1;
+    f_.assign(firstf, lastf);
+    const R* snapshot = helper_.snapshot(lp.value(), f_, ti);
+    bool inplace = snapshot == lp.value();
+    int n = f_.empty() ? snapshot->ncol() : (int) f_.size();
+    for (int i = 0; i != n; ++i)
+        unparse_col(out, snapshot->col(f_.empty() ? i : f_[i]), inplace);
+    return n;
+}
+
+template <typename R> template <typename T>
+void query<R>::run_get_batch(T& table, const Json* firstkey,
+                             const Json* lastkey, const Json* firstf,
+                             const Json* lastf, Json& results,
+                             threadinfo& ti) {
+    f_.clear();
+    for (; firstf != lastf; ++firstf)
+        f_.push_back(firstf->as_i());
+    for (; firstkey != lastkey; ++firstkey) {
+        typename T::unlocked_cursor_type lp(table, firstkey->as_s());
+        bool found = lp.find_unlocked(ti);
+        results.push_back(Json());
+        if (found && !row_is_marker(lp.value()))
+            emit_fields1(lp.value(), results.back(), ti);
+    }
+}
+
 template <typename R> template <typename T>
 bool query<R>::run_get1(T& table, Str key, int col, Str& value, threadinfo& ti) {
     typename T::unlocked_cursor_type lp(table, key);
@@ -179,10 +291,8 @@ result_t query<R>::run_put(T& table, Str key,
 template <typename R>
 inline bool query<R>::apply_put(R*& value, bool found, const Json* firstreq,
                                 const Json* lastreq, threadinfo& ti) {
-    if (loginfo* log = ti.logger()) {
-        log->acquire();
-        qtimes_.epoch = global_log_epoch;
-    }
+    if (logbuffer* log = ti.logger())
+        qtimes_.epoch = log->start_update();
 
     if (!found) {
     insert:
@@ -218,13 +328,23 @@ result_t query<R>::run_replace(T& table, Str key, Str value, threadinfo& ti) {
     return inserted ? Inserted : Updated;
 }
 
+template <typename R> template <typename T>
+void query<R>::run_replace_batch(T& table, const Json* firstreq,
+                                 const Json* lastreq, Json& results,
+                                 threadinfo& ti) {
+    batch_times_.clear();
+    for (; firstreq != lastreq; firstreq += 2) {
+        results.push_back(run_replace(table, firstreq[0].as_s(),
+                                      firstreq[1].as_s(), ti));
+        batch_times_.push_back(qtimes_);
+    }
+}
+
 template <typename R>
 inline bool query<R>::apply_replace(R*& value, bool found, Str new_value,
                                     threadinfo& ti) {
-    if (loginfo* log = ti.logger()) {
-        log->acquire();
-        qtimes_.epoch = global_log_epoch;
-    }
+    if (logbuffer* log = ti.logger())
+        qtimes_.epoch = log->start_update();
 
     bool inserted = !found || row_is_marker(value);
     if (!found) {
@@ -239,9 +359,16 @@ inline bool query<R>::apply_replace(R*& value, bool found, Str new_value,
 }
 
 template <typename R> template <typename T>
-bool query<R>::run_remove(T& table, Str key, threadinfo& ti) {
+bool query<R>::run_remove(T& table, Str key, threadinfo& ti, bool tombstone) {
     typename T::cursor_type lp(table, key);
     bool found = lp.find_locked(ti);
+    if (found && tombstone) {
+        found = !row_is_marker(lp.value());
+        if (found)
+            apply_tombstone(lp.value(), ti);
+        lp.finish(1, ti);
+        return found;
+    }
     if (found)
         apply_remove(lp.value(), lp.node()->phantom_epoch_[0], ti);
     lp.finish(-1, ti);
@@ -251,10 +378,8 @@ bool query<R>::run_remove(T& table, Str key, threadinfo& ti) {
 template <typename R>
 inline void query<R>::apply_remove(R*& value, kvtimestamp_t& node_ts,
                                    threadinfo& ti) {
-    if (loginfo* log = ti.logger()) {
-        log->acquire();
-        qtimes_.epoch = global_log_epoch;
-    }
+    if (logbuffer* log = ti.logger())
+        qtimes_.epoch = log->start_update();
 
     R* old_value = value;
     assign_timestamp(ti, old_value->timestamp());
@@ -264,6 +389,19 @@ inline void query<R>::apply_remove(R*& value, kvtimestamp_t& node_ts,
     old_value->deallocate_rcu(ti);
 }
 
+template <typename R>
+inline void query<R>::apply_tombstone(R*& value, threadinfo& ti) {
+    if (logbuffer* log = ti.logger())
+        qtimes_.epoch = log->start_update();
+
+    R* old_value = value;
+    assign_timestamp(ti, old_value->timestamp());
+    row_marker m;
+    m.marker_type_ = row_marker::mt_remove;
+    value = R::create1(Str((const char*) &m, sizeof(m)), qtimes_.ts | 1, ti);
+    old_value->deallocate_rcu(ti);
+}
+
 
 template <typename R>
 class query_json_scanner {
@@ -311,6 +449,39 @@ class query_json_scanner {
     std::vector<uint64_t>* scan_versions_;
 };
 
+template <typename R, typename U>
+class query_unparse_scanner {
+  public:
+    query_unparse_scanner(query<R>& q, int count, msgpack::unparser<U>& out,
+                          lcdf::String* lastkey)
+        : q_(q), nleft_(count), npairs_(0), out_(out), lastkey_(lastkey) {
+    }
+    int npairs() const {
+        return npairs_;
+    }
+    template <typename SS, typename K>
+    void visit_leaf(const SS&, const K&, threadinfo&) {
+    }
+    bool visit_value(Str key, R* value, threadinfo& ti) {
+        if (row_is_marker(value))
+            return true;
+        out_ << key;
+        q_.unparse_fields1(value, out_, ti);
+        ++npairs_;
+        if (--nleft_ != 0)
+            return true;
+        if (lastkey_)
+            *lastkey_ = lcdf::String(key.data(), key.length());
+        return false;
+    }
+  private:
+    query<R>& q_;
+    int nleft_;
+    int npairs_;
+    msgpack::unparser<U>& out_;
+    lcdf::String* lastkey_;
+};
+
 template <typename R> template <typename T>
 void query<R>::run_scan(T& table, Json& request, threadinfo& ti) {
     assert(request[3].as_i() > 0);
@@ -322,6 +493,18 @@ void query<R>::run_scan(T& table, Json& request, threadinfo& ti) {
     table.scan(scanf.firstkey(), true, scanf, ti);
 }
 
+template <typename R> template <typename T, typename U>
+int query<R>::run_scan(T& table, Str firstkey, int count,
+                       const int* firstf, const int* lastf,
+                       msgpack::unparser<U>& out, threadinfo& ti,
+                       lcdf::String* lastkey) {
+    assert(count > 0);
+    f_.assign(firstf, lastf);
+    query_unparse_scanner<R, U> scanf(*this, count, out, lastkey);
+    table.scan(firstkey, true, scanf, ti);
+    return scanf.npairs();
+}
+
 template <typename R> template <typename T>
 void query<R>::run_scan_versions(T& table, Json& request,
                                  std::vector<uint64_t>& scan_versions,
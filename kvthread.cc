@@ -25,6 +25,8 @@
 #endif
 
 threadinfo *threadinfo::allthreads;
+volatile kvtimestamp_t threadinfo::timestamp_floor;
+volatile bool threadinfo::counters_enabled_;
 #if ENABLE_ASSERTIONS
 int threadinfo::no_pool_value;
 #endif
@@ -39,23 +41,37 @@ inline threadinfo::threadinfo(int purpose, int index) {
     for (size_t i = 0; i != sizeof(pool_) / sizeof(pool_[0]); ++i) {
         pool_[i] = nullptr;
     }
+    for (int i = 0; i != nmemtag_types; ++i) {
+        mem_bytes_[i] = 0;
+    }
+    for (size_t i = 0; i != sizeof(counters_) / sizeof(counters_[0]); ++i) {
+        counters_[i] = 0;
+    }
 
     void *limbo_space = allocate(sizeof(limbo_group), memtag_limbo);
-    mark(tc_limbo_slots, limbo_group::capacity);
+    account(tc_limbo_slots, limbo_group::capacity);
     limbo_head_ = limbo_tail_ = new(limbo_space) limbo_group;
+    limbo_count_ = 0;
     ts_ = 2;
-
-    for (size_t i = 0; i != sizeof(counters_) / sizeof(counters_[0]); ++i) {
-        counters_[i] = 0;
-    }
 }
 
+const char* const threadcounter_names[(int) tc_max] = {
+    "alloc_value", "alloc_other", "gc", "limbo_slots",
+    "replay_create_delta", "replay_remove_delta",
+    "root_retry", "internode_retry", "leaf_retry", "leaf_walk",
+    "stable_internode_insert", "stable_internode_split",
+    "stable_leaf_insert", "stable_leaf_split",
+    "internode_lock_retry", "leaf_lock_retry"
+};
+
 threadinfo *threadinfo::make(int purpose, int index) {
     static int threads_initialized;
+    static_assert(sizeof(threadinfo) <= 8192, "threadinfo too large");
 
     threadinfo* ti = new(malloc(8192)) threadinfo(purpose, index);
-    ti->next_ = allthreads;
-    allthreads = ti;
+    do {
+        ti->next_ = allthreads;
+    } while (!bool_cmpxchg(&allthreads, ti->next_, ti));
 
     if (!threads_initialized) {
 #if ENABLE_ASSERTIONS
@@ -71,7 +87,7 @@ threadinfo *threadinfo::make(int purpose, int index) {
 void threadinfo::refill_rcu() {
     if (!limbo_tail_->next_) {
         void *limbo_space = allocate(sizeof(limbo_group), memtag_limbo);
-        mark(tc_limbo_slots, limbo_group::capacity);
+        account(tc_limbo_slots, limbo_group::capacity);
         limbo_tail_->next_ = new(limbo_space) limbo_group;
     }
     limbo_tail_ = limbo_tail_->next_;
@@ -168,6 +184,18 @@ void threadinfo::report_rcu_all(void *ptr)
         ti->report_rcu(ptr);
 }
 
+kvtimestamp_t threadinfo::raise_timestamp_floor()
+{
+    kvtimestamp_t x = timestamp_floor;
+    for (threadinfo *ti = allthreads; ti; ti = ti->next())
+        if (circular_int<kvtimestamp_t>::less(x, ti->ts_))
+            x = ti->ts_;
+    // keep timestamps even; odd ones mark removed rows
+    timestamp_floor = (x | 1) + 1;
+    memory_fence();
+    return timestamp_floor;
+}
+
 
 #if HAVE_SUPERPAGE && !NOSUPERPAGE
 static size_t read_superpage_size() {
@@ -26,7 +26,7 @@
 #include <stdlib.h>
 
 class threadinfo;
-class loginfo;
+class logbuffer;
 
 typedef uint64_t mrcu_epoch_type;
 typedef int64_t mrcu_signed_epoch_type;
@@ -94,7 +94,7 @@ struct mrcu_callback {
 class threadinfo {
   public:
     enum {
-        TI_MAIN, TI_PROCESS, TI_LOG, TI_CHECKPOINT
+        TI_MAIN, TI_PROCESS, TI_LOG, TI_CHECKPOINT, TI_REPLAY, TI_FOLLOW
     };
 
     static threadinfo* allthreads;
@@ -113,10 +113,10 @@ class threadinfo {
     int index() const {
         return index_;
     }
-    loginfo* logger() const {
+    logbuffer* logger() const {
         return logger_;
     }
-    void set_logger(loginfo* logger) {
+    void set_logger(logbuffer* logger) {
         assert(!logger_ && logger);
         logger_ = logger;
     }
@@ -126,25 +126,44 @@ class threadinfo {
         return timestamp();
     }
     kvtimestamp_t update_timestamp() const {
+        if (circular_int<kvtimestamp_t>::less(ts_, timestamp_floor))
+            ts_ = timestamp_floor;
         return ts_;
     }
     kvtimestamp_t update_timestamp(kvtimestamp_t x) const {
+        update_timestamp();
         if (circular_int<kvtimestamp_t>::less_equal(ts_, x))
             // x might be a marker timestamp; ensure result is not
             ts_ = (x | 1) + 1;
         return ts_;
     }
+    // Make every update timestamp issued from now on at least as large as
+    // any issued so far, and return that floor. Incremental checkpoints
+    // use floors to find the rows changed since a checkpoint began.
+    static kvtimestamp_t raise_timestamp_floor();
+    static void set_timestamp_floor(kvtimestamp_t floor) {
+        timestamp_floor = floor;
+    }
     template <typename N> void observe_phantoms(N* n) {
         if (circular_int<kvtimestamp_t>::less(ts_, n->phantom_epoch_[0]))
             ts_ = n->phantom_epoch_[0];
     }
 
     // event counters
+    // Counters are compiled in only with --enable-counters (ENABLE_COUNTERS).
+    // Event counters (mark()) are collected only while counters_enabled()
+    // is true. The accounting counters tc_alloc_value, tc_alloc_other and
+    // tc_limbo_slots (account()) pair each allocation with its free, so
+    // they are always kept when compiled in.
     void mark(threadcounter ci) {
-        if (has_threadcounter<int(ncounters)>::test(ci))
+        if (has_threadcounter<int(ncounters)>::test(ci) && counters_enabled_)
             ++counters_[ci];
     }
     void mark(threadcounter ci, int64_t delta) {
+        if (has_threadcounter<int(ncounters)>::test(ci) && counters_enabled_)
+            counters_[ci] += delta;
+    }
+    void account(threadcounter ci, int64_t delta) {
         if (has_threadcounter<int(ncounters)>::test(ci))
             counters_[ci] += delta;
     }
@@ -158,6 +177,17 @@ class threadinfo {
     uint64_t counter(threadcounter ci) const {
         return has_threadcounter<int(ncounters)>::test(ci) ? counters_[ci] : 0;
     }
+    static inline uint64_t counter_sum(threadcounter ci);
+
+    static bool has_counters() {
+        return ncounters != 0;
+    }
+    static bool counters_enabled() {
+        return counters_enabled_;
+    }
+    static void set_counters_enabled(bool enabled) {
+        counters_enabled_ = enabled && has_counters();
+    }
 
     struct accounting_relax_fence_function {
         threadinfo* ti_;
@@ -201,12 +231,31 @@ class threadinfo {
         return accounting_relax_fence_function(this, ci);
     }
 
+    // memory accounting
+    // Bytes allocated less bytes freed by this thread, by memtag type.
+    // Memory is often freed by a thread other than the one that
+    // allocated it, so only the sum over all threads is meaningful.
+    enum { nmemtag_types = 0x20 };
+    static int memtag_type(memtag tag) {
+        return (tag >> 8) & (nmemtag_types - 1);
+    }
+    int64_t memory_in_use(memtag tag) const {
+        return mem_bytes_[memtag_type(tag)];
+    }
+    static inline int64_t memory_in_use_sum(memtag tag);
+    // Number of objects waiting in limbo for RCU to free them.
+    uint64_t limbo_count() const {
+        return limbo_count_;
+    }
+
     // memory allocation
     void* allocate(size_t sz, memtag tag) {
         void* p = malloc(sz + memdebug_size);
         p = memdebug::make(p, sz, tag);
-        if (p)
-            mark(threadcounter(tc_alloc + (tag > memtag_value)), sz);
+        if (p) {
+            account(threadcounter(tc_alloc + (tag > memtag_value)), sz);
+            mem_bytes_[memtag_type(tag)] += sz;
+        }
         return p;
     }
     void deallocate(void* p, size_t sz, memtag tag) {
@@ -214,13 +263,15 @@ class threadinfo {
         assert(p);
         p = memdebug::check_free(p, sz, tag);
         free(p);
-        mark(threadcounter(tc_alloc + (tag > memtag_value)), -sz);
+        account(threadcounter(tc_alloc + (tag > memtag_value)), -sz);
+        mem_bytes_[memtag_type(tag)] -= sz;
     }
     void deallocate_rcu(void* p, size_t sz, memtag tag) {
         assert(p);
         memdebug::check_rcu(p, sz, tag);
         record_rcu(p, tag);
-        mark(threadcounter(tc_alloc + (tag > memtag_value)), -sz);
+        account(threadcounter(tc_alloc + (tag > memtag_value)), -sz);
+        mem_bytes_[memtag_type(tag)] -= sz;
     }
 
     void* pool_allocate(size_t sz, memtag tag) {
@@ -232,8 +283,9 @@ class threadinfo {
         if (p) {
             pool_[nl - 1] = *reinterpret_cast<void **>(p);
             p = memdebug::make(p, sz, memtag(tag + nl));
-            mark(threadcounter(tc_alloc + (tag > memtag_value)),
-                 nl * CACHE_LINE_SIZE);
+            account(threadcounter(tc_alloc + (tag > memtag_value)),
+                    nl * CACHE_LINE_SIZE);
+            mem_bytes_[memtag_type(tag)] += nl * CACHE_LINE_SIZE;
         }
         return p;
     }
@@ -246,16 +298,18 @@ class threadinfo {
             pool_[nl - 1] = p;
         } else
             free(p);
-        mark(threadcounter(tc_alloc + (tag > memtag_value)),
-             -nl * CACHE_LINE_SIZE);
+        account(threadcounter(tc_alloc + (tag > memtag_value)),
+                -nl * CACHE_LINE_SIZE);
+        mem_bytes_[memtag_type(tag)] -= nl * CACHE_LINE_SIZE;
     }
     void pool_deallocate_rcu(void* p, size_t sz, memtag tag) {
         int nl = (sz + memdebug_size + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE;
         assert(p && nl <= pool_max_nlines);
         memdebug::check_rcu(p, sz, memtag(tag + nl));
         record_rcu(p, memtag(tag + nl));
-        mark(threadcounter(tc_alloc + (tag > memtag_value)),
-             -nl * CACHE_LINE_SIZE);
+        account(threadcounter(tc_alloc + (tag > memtag_value)),
+                -nl * CACHE_LINE_SIZE);
+        mem_bytes_[memtag_type(tag)] -= nl * CACHE_LINE_SIZE;
     }
 
     // RCU
@@ -296,7 +350,7 @@ class threadinfo {
         struct {
             mrcu_epoch_type gc_epoch_;
             mrcu_epoch_type perform_gc_epoch_;
-            loginfo *logger_;
+            logbuffer *logger_;
 
             threadinfo *next_;
             int purpose_;
@@ -313,16 +367,24 @@ class threadinfo {
 
     limbo_group* limbo_head_;
     limbo_group* limbo_tail_;
+    uint64_t limbo_count_;
+    int64_t mem_bytes_[nmemtag_types];
     mutable kvtimestamp_t ts_;
+    static volatile kvtimestamp_t timestamp_floor;
 
-    //enum { ncounters = (int) tc_max };
+#if ENABLE_COUNTERS
+    enum { ncounters = (int) tc_max };
+#else
     enum { ncounters = 0 };
+#endif
     uint64_t counters_[ncounters];
+    static volatile bool counters_enabled_;
 
     void refill_pool(int nl);
     void refill_rcu();
 
     void free_rcu(void *p, memtag tag) {
+        --limbo_count_;
         if ((tag & memtag_pool_mask) == 0) {
             p = memdebug::check_free_after_rcu(p, tag);
             ::free(p);
@@ -341,6 +403,7 @@ class threadinfo {
             refill_rcu();
         uint64_t epoch = globalepoch;
         limbo_tail_->push_back(ptr, tag, epoch);
+        ++limbo_count_;
     }
 
 #if ENABLE_ASSERTIONS
@@ -364,6 +427,20 @@ class threadinfo {
     friend struct limbo_group;
 };
 
+inline uint64_t threadinfo::counter_sum(threadcounter ci) {
+    uint64_t x = 0;
+    for (threadinfo* ti = allthreads; ti; ti = ti->next())
+        x += ti->counter(ci);
+    return x;
+}
+
+inline int64_t threadinfo::memory_in_use_sum(memtag tag) {
+    int64_t x = 0;
+    for (threadinfo* ti = allthreads; ti; ti = ti->next())
+        x += ti->memory_in_use(tag);
+    return x;
+}
+
 inline mrcu_epoch_type threadinfo::min_active_epoch() {
     mrcu_epoch_type ae = globalepoch;
     for (threadinfo* ti = allthreads; ti; ti = ti->next()) {
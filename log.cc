@@ -14,6 +14,9 @@
  * is legally binding.
  */
 #include "log.hh"
+#include "logwriter.hh"
+#include "crc32c.hh"
+#include "lz.hh"
 #include "kvthread.hh"
 #include "kvrow.hh"
 #include "file.hh"
@@ -25,14 +28,28 @@
 #include "msgpack.hh"
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#if HAVE_LINUX_FUTEX_H
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
 using lcdf::String;
 
 kvepoch_t global_log_epoch;
 kvepoch_t global_wake_epoch;
 struct timeval log_epoch_interval;
+struct timeval log_flush_interval = { 0, 1000 };
+int log_buffers = 3;
+int log_replay_threads = 1;
+uint64_t log_segment_size = 256 << 20;
+unsigned log_segment_epochs = 0;
+void (*logreplay_fault_in)(Str key, threadinfo& ti);
+bool log_compress = false;
 static struct timeval log_epoch_time;
 extern Masstree::default_table* tree;
 extern volatile bool recovering;
@@ -100,18 +117,24 @@ struct logrec_kv {
     static size_t size(uint32_t keylen, uint32_t vallen) {
         return sizeof(logrec_kv) + keylen + vallen;
     }
-    static size_t store(char *buf, uint32_t command,
-                        Str key, Str val,
-                        kvtimestamp_t ts) {
+    // Store all but the value; return where the value goes.
+    static char *prepare(char *buf, uint32_t command,
+                         Str key, uint32_t vallen,
+                         kvtimestamp_t ts) {
         // XXX check alignment on some architectures
         logrec_kv *lr = reinterpret_cast<logrec_kv *>(buf);
         lr->command_ = command;
-        lr->size_ = sizeof(*lr) + key.len + val.len;
+        lr->size_ = sizeof(*lr) + key.len + vallen;
         lr->ts_ = ts;
         lr->keylen_ = key.len;
         memcpy(lr->buf_, key.s, key.len);
-        memcpy(lr->buf_ + key.len, val.s, val.len);
-        return sizeof(*lr) + key.len + val.len;
+        return lr->buf_ + key.len;
+    }
+    static size_t store(char *buf, uint32_t command,
+                        Str key, Str val,
+                        kvtimestamp_t ts) {
+        memcpy(prepare(buf, command, key, val.len, ts), val.s, val.len);
+        return sizeof(logrec_kv) + key.len + val.len;
     }
     static bool check(const char *buf) {
         const logrec_kv *lr = reinterpret_cast<const logrec_kv *>(buf);
@@ -131,19 +154,24 @@ struct logrec_kvdelta {
     static size_t size(uint32_t keylen, uint32_t vallen) {
         return sizeof(logrec_kvdelta) + keylen + vallen;
     }
-    static size_t store(char *buf, uint32_t command,
-                        Str key, Str val,
-                        kvtimestamp_t prev_ts, kvtimestamp_t ts) {
+    static char *prepare(char *buf, uint32_t command,
+                         Str key, uint32_t vallen,
+                         kvtimestamp_t prev_ts, kvtimestamp_t ts) {
         // XXX check alignment on some architectures
         logrec_kvdelta *lr = reinterpret_cast<logrec_kvdelta *>(buf);
         lr->command_ = command;
-        lr->size_ = sizeof(*lr) + key.len + val.len;
+        lr->size_ = sizeof(*lr) + key.len + vallen;
         lr->ts_ = ts;
         lr->prev_ts_ = prev_ts;
         lr->keylen_ = key.len;
         memcpy(lr->buf_, key.s, key.len);
-        memcpy(lr->buf_ + key.len, val.s, val.len);
-        return sizeof(*lr) + key.len + val.len;
+        return lr->buf_ + key.len;
+    }
+    static size_t store(char *buf, uint32_t command,
+                        Str key, Str val,
+                        kvtimestamp_t prev_ts, kvtimestamp_t ts) {
+        memcpy(prepare(buf, command, key, val.len, prev_ts, ts), val.s, val.len);
+        return sizeof(logrec_kvdelta) + key.len + val.len;
     }
     static bool check(const char *buf) {
         const logrec_kvdelta *lr = reinterpret_cast<const logrec_kvdelta *>(buf);
@@ -152,6 +180,132 @@ struct logrec_kvdelta {
     }
 };
 
+// The value of a logcmd_put_columns or logcmd_modify_columns record lists
+// the changed columns: for each, its index and length as varints, then
+// its bytes.
+static inline size_t varint_size(uint64_t x) {
+    size_t n = 1;
+    for (; x >= 0x80; x >>= 7)
+        ++n;
+    return n;
+}
+
+static inline char *varint_store(char *p, uint64_t x) {
+    for (; x >= 0x80; x >>= 7)
+        *p++ = char(x | 0x80);
+    *p++ = char(x);
+    return p;
+}
+
+static inline const char *varint_parse(const char *p, const char *end,
+                                       uint64_t &x) {
+    x = 0;
+    for (int shift = 0; p != end && shift < 64; shift += 7) {
+        unsigned char c = *p++;
+        x |= uint64_t(c & 0x7F) << shift;
+        if (!(c & 0x80))
+            return p;
+    }
+    return 0;
+}
+
+static size_t columns_size(const lcdf::Json* req, const lcdf::Json* end_req) {
+    size_t n = 0;
+    for (; req + 1 < end_req; req += 2) {
+        int len = req[1].as_s().length();
+        n += varint_size(unsigned(req[0].as_i())) + varint_size(len) + len;
+    }
+    return n;
+}
+
+static char *columns_store(char *p, const lcdf::Json* req,
+                           const lcdf::Json* end_req) {
+    for (; req + 1 < end_req; req += 2) {
+        const String& v = req[1].as_s();
+        p = varint_store(p, unsigned(req[0].as_i()));
+        p = varint_store(p, v.length());
+        memcpy(p, v.data(), v.length());
+        p += v.length();
+    }
+    return p;
+}
+
+// Ends each batch written to disk. Covers the length_ bytes that precede
+// it, back to the end of the previous batch.
+struct logrec_checksum {
+    uint32_t command_;
+    uint32_t size_;
+    uint32_t length_;
+    uint32_t crc_;
+
+    static size_t size() {
+        return sizeof(logrec_checksum);
+    }
+    static size_t store(char *buf, const char *batch, uint32_t length) {
+        logrec_checksum *lr = reinterpret_cast<logrec_checksum *>(buf);
+        lr->command_ = logcmd_checksum;
+        lr->size_ = sizeof(*lr);
+        lr->length_ = length;
+        lr->crc_ = crc32c(batch, length);
+        return sizeof(*lr);
+    }
+};
+
+// Holds the compressed records of a batch; the batch's checksum follows.
+struct logrec_compressed {
+    uint32_t command_;
+    uint32_t size_;
+    uint32_t rawlen_;
+    char buf_[0];
+
+    static size_t store(char *buf, const char *z, uint32_t zlen,
+                        uint32_t rawlen) {
+        logrec_compressed *lr = reinterpret_cast<logrec_compressed *>(buf);
+        lr->command_ = logcmd_compressed;
+        lr->size_ = sizeof(*lr) + zlen;
+        lr->rawlen_ = rawlen;
+        memcpy(lr->buf_, z, zlen);
+        return sizeof(*lr) + zlen;
+    }
+};
+
+// Replace the len bytes of records at buf with one compressed record, if
+// that is smaller. zbuf holds lz_compress_bound(len) bytes. Returns the
+// new length.
+static uint32_t compress_batch(char *buf, uint32_t len, char *zbuf) {
+    size_t zlen = lz_compress(buf, len, zbuf);
+    if (sizeof(logrec_compressed) + zlen >= len)
+        return len;
+    return logrec_compressed::store(buf, zbuf, zlen, len);
+}
+
+
+// Sleep until *word != val, a futex_wake on word, or the timeout expires.
+// Without futexes, just nap for the timeout. Unlike nanosleep, a raw
+// futex syscall is not a cancellation point, so test for cancellation
+// by hand: mtd cancels logger and worker threads on shutdown.
+static void futex_wait(uint32_t* word, uint32_t val,
+                       const struct timeval& timeout) {
+    struct timespec ts;
+    ts.tv_sec = timeout.tv_sec;
+    ts.tv_nsec = timeout.tv_usec * 1000;
+#if HAVE_LINUX_FUTEX_H
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, val, &ts, 0, 0);
+#else
+    if (*(volatile uint32_t*) word == val)
+        nanosleep(&ts, 0);
+#endif
+    pthread_testcancel();
+}
+
+static void futex_wake(uint32_t* word) {
+#if HAVE_LINUX_FUTEX_H
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, 0, 0, 0);
+#else
+    (void) word;
+#endif
+}
+
 
 logset* logset::make(int size) {
     static_assert(sizeof(loginfo) == 2 * CACHE_LINE_SIZE, "unexpected sizeof(loginfo)");
@@ -177,8 +331,18 @@ void logset::free(logset* ls) {
 
 
 loginfo::loginfo(logset* ls, int logindex) {
-    f_.lock_ = 0;
-    f_.waiting_ = 0;
+    f_.flusher_seq_ = 0;
+    f_.flusher_state_ = flusher_awake;
+    f_.writer_seq_ = 0;
+    f_.stalled_ = 0;
+    f_.buffers_ = 0;
+    f_.writer_ = 0;
+    f_.side_ = new side_state;
+    f_.side_->trim_epoch = 0;
+    pthread_mutex_init(&f_.side_->follower_mu, 0);
+    f_.side_->follower_pending = false;
+    f_.side_->nfollowers = 0;
+    f_.side_->shipped = 0;
     f_.filename_ = String().internal_rep();
     f_.filename_.ref();
 
@@ -200,6 +364,8 @@ loginfo::loginfo(logset* ls, int logindex) {
 
 loginfo::~loginfo() {
     f_.filename_.deref();
+    delete f_.writer_;
+    delete f_.side_;
     free(buf_);
 }
 
@@ -221,6 +387,15 @@ void loginfo::initialize(const String& logfile) {
     always_assert(r == 0);
 }
 
+// Buffers are never freed.
+logbuffer* loginfo::make_buffer() {
+    logbuffer* b = new logbuffer(this);
+    do {
+        b->w_.next_ = f_.buffers_;
+    } while (!bool_cmpxchg(&f_.buffers_, b->w_.next_, b));
+    return b;
+}
+
 // one logger thread per logs[].
 static void check_epoch() {
     struct timeval tv;
@@ -232,31 +407,387 @@ static void check_epoch() {
     }
 }
 
-void* loginfo::run() {
-    {
-        logreplay replayer(f_.filename_);
-        replayer.replay(ti_->index(), ti_);
+static String segment_name(const String& base, uint64_t seq) {
+    if (!seq)
+        return base;
+    lcdf::StringAccum sa;
+    sa << base << '.' << seq;
+    return sa.take_string();
+}
+
+// Find the segments of the log named base, oldest first.
+static void list_segments(const String& base, std::deque<logsegment>& segs) {
+    int slash = base.find_right('/');
+    String dir = slash >= 0 ? base.substr(0, slash + 1) : String(".");
+    String prefix = base.substr(slash + 1);
+    std::vector<logsegment> found;
+    if (DIR* d = opendir(dir.c_str())) {
+        while (struct dirent* de = readdir(d)) {
+            Str name(de->d_name);
+            if (name == prefix)
+                found.push_back(logsegment{base, 0, 0});
+            else if (name.length() > prefix.length() + 1
+                     && name.starts_with(prefix)
+                     && name[prefix.length()] == '.') {
+                char* end;
+                const char* s = de->d_name + prefix.length() + 1;
+                uint64_t seq = strtoull(s, &end, 10);
+                if (seq && !*end && isdigit((unsigned char) *s))
+                    found.push_back(logsegment{segment_name(base, seq), seq, 0});
+            }
+        }
+        closedir(d);
     }
+    std::sort(found.begin(), found.end(),
+              [](const logsegment& a, const logsegment& b) {
+                  return a.seq < b.seq;
+              });
+    segs.assign(found.begin(), found.end());
+}
 
-    int fd = open(String(f_.filename_).c_str(),
-                  O_WRONLY | O_APPEND | O_CREAT, 0666);
+// Open (creating) a segment, making sure its name is durable.
+static int open_segment(const String& filename) {
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT, 0666);
     always_assert(fd >= 0);
-    char *x_buf = (char *) malloc(len_);
-    always_assert(x_buf);
+    int slash = filename.find_right('/');
+    String dir = slash >= 0 ? filename.substr(0, slash + 1) : String(".");
+    int dfd = open(dir.c_str(), O_RDONLY);
+    if (dfd >= 0) {
+        (void) fsync(dfd);
+        close(dfd);
+    }
+    return fd;
+}
+
+bool loginfo::segment_full() const {
+    const logsegment& seg = f_.side_->segments.back();
+    return f_.writer_->offset() >= off_t(log_segment_size)
+        || (log_segment_epochs && seg.first_epoch && log_epoch_
+            && log_epoch_.value() - seg.first_epoch.value() >= log_segment_epochs);
+}
+
+// Start a new segment once the batches in flight to the current one are
+// durable. The new segment begins with an epoch record.
+void loginfo::rotate() {
+    std::deque<logsegment>& segs = f_.side_->segments;
+    kvepoch_t epoch;
+    while (f_.writer_->busy())
+        if (f_.writer_->reap(true, epoch))
+            flushed_epoch_ = epoch;
+    uint64_t seq = segs.back().seq + 1;
+    segs.push_back(logsegment{segment_name(String(f_.filename_), seq), seq, 0});
+    f_.writer_->reopen(open_segment(segs.back().filename));
+    log_epoch_ = 0;
+}
+
+// Segment i holds no record from an epoch >= min_epoch if segment i + 1
+// starts before min_epoch. Keep the current segment.
+void loginfo::trim_segments(kvepoch_t min_epoch) {
+    std::deque<logsegment>& segs = f_.side_->segments;
+    while (segs.size() >= 2 && segs[1].first_epoch
+           && segs[1].first_epoch < min_epoch) {
+        if (unlink(segs[0].filename.c_str()) != 0 && errno != ENOENT)
+            perror(segs[0].filename.c_str());
+        segs.pop_front();
+    }
+}
+
+// Log shipping frames: a header, then len bytes of the log. Frames split
+// the log anywhere; frames with len == 0 just report the leader's epoch.
+struct logship_frame {
+    uint32_t len;
+    uint32_t nlogs;             // number of logs the leader has
+    uint64_t epoch;             // latest epoch in this log
+};
+
+static bool ship_frame(int fd, const char* data, uint32_t len, int nlogs,
+                       kvepoch_t epoch) {
+    logship_frame h;
+    h.len = len;
+    h.nlogs = nlogs;
+    h.epoch = epoch.value();
+    struct iovec iov[2];
+    iov[0].iov_base = &h;
+    iov[0].iov_len = sizeof(h);
+    iov[1].iov_base = const_cast<char*>(data);
+    iov[1].iov_len = len;
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = iov;
+    mh.msg_iovlen = len ? 2 : 1;
+    while (mh.msg_iovlen) {
+        ssize_t w = sendmsg(fd, &mh, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR)
+            continue;
+        else if (w <= 0)
+            return false;
+        for (; w && size_t(w) >= mh.msg_iov->iov_len; ++mh.msg_iov, --mh.msg_iovlen)
+            w -= mh.msg_iov->iov_len;
+        if (w) {
+            mh.msg_iov->iov_base = (char*) mh.msg_iov->iov_base + w;
+            mh.msg_iov->iov_len -= w;
+        }
+    }
+    return true;
+}
+
+void loginfo::add_follower(int fd) {
+    pthread_mutex_lock(&f_.side_->follower_mu);
+    f_.side_->new_followers.push_back(fd);
+    f_.side_->follower_pending = true;
+    pthread_mutex_unlock(&f_.side_->follower_mu);
+    uint32_t state = f_.flusher_state_;
+    if (state != flusher_awake)
+        wake_flusher(state);
+}
+
+// Send new followers the segments on disk. Batches still in pos_ go out
+// with the next write.
+void loginfo::attach_followers() {
+    side_state* ss = f_.side_;
+    std::vector<int> fds;
+    pthread_mutex_lock(&ss->follower_mu);
+    fds.swap(ss->new_followers);
+    ss->follower_pending = false;
+    pthread_mutex_unlock(&ss->follower_mu);
+
+    kvepoch_t epoch;
+    while (f_.writer_->busy())
+        if (f_.writer_->reap(true, epoch))
+            flushed_epoch_ = epoch;
+
+    int nlogs = f_.logset_->size();
+    const size_t chunk = 1 << 20;
+    char* buf = (char*) malloc(chunk);
+    always_assert(buf);
+    for (int fd : fds) {
+        bool ok = ship_frame(fd, 0, 0, nlogs, log_epoch_);
+        uint64_t n = 0;
+        for (auto& seg : ss->segments) {
+            int sfd = open(seg.filename.c_str(), O_RDONLY);
+            ssize_t r;
+            while (ok && sfd >= 0 && (r = read(sfd, buf, chunk)) > 0) {
+                ok = ship_frame(fd, buf, r, nlogs, log_epoch_);
+                n += r;
+            }
+            if (sfd >= 0)
+                close(sfd);
+        }
+        if (ok) {
+            fprintf(stderr, "log %d: follower attached, %" PRIu64 " bytes\n",
+                    logindex_, n);
+            ss->followers.push_back(fd);
+            ss->shipped += n;
+        } else
+            close(fd);
+    }
+    ss->nfollowers = ss->followers.size();
+    free(buf);
+}
+
+// Send a batch (or, if len == 0, our epoch) to every follower. A follower
+// that can't keep up, or has gone away, is dropped.
+void loginfo::ship(const char* buf, uint32_t len) {
+    side_state* ss = f_.side_;
+    int nlogs = f_.logset_->size();
+    for (size_t i = 0; i != ss->followers.size(); )
+        if (ship_frame(ss->followers[i], buf, len, nlogs, log_epoch_)) {
+            ss->shipped += len;
+            ++i;
+        } else {
+            fprintf(stderr, "log %d: follower dropped\n", logindex_);
+            close(ss->followers[i]);
+            ss->followers.erase(ss->followers.begin() + i);
+            ss->nfollowers = ss->followers.size();
+        }
+}
+
+// Is any worker mid-update or holding unconsumed records?
+bool loginfo::writers_busy() const {
+    for (logbuffer* b = f_.buffers_; b; b = b->w_.next_) {
+        if (b->w_.active_epoch_)
+            return true;
+        acquire_fence();
+        if (b->w_.tail_ != b->l_.head_)
+            return true;
+    }
+    return false;
+}
+
+uint64_t loginfo::max_buffered() const {
+    uint64_t n = 0;
+    for (logbuffer* b = f_.buffers_; b; b = b->w_.next_)
+        n = std::max(n, b->w_.tail_ - b->l_.head_);
+    return n;
+}
+
+// Sleep until a writer calls for a flush or the timeout expires. The
+// recheck after publishing our state pairs with logbuffer::publish.
+void loginfo::wait_for_records(uint32_t state, const struct timeval& timeout) {
+    uint32_t seq = f_.flusher_seq_;
+    f_.flusher_state_ = state;
+    memory_fence();
+    uint64_t n = max_buffered();
+    if (state == flusher_idle ? n == 0 : n < logbuffer::size / 4)
+        futex_wait(&f_.flusher_seq_, seq, timeout);
+    f_.flusher_state_ = flusher_awake;
+}
+
+void loginfo::wake_flusher(uint32_t state) {
+    if (bool_cmpxchg(&f_.flusher_state_, state, uint32_t(flusher_awake))) {
+        fetch_and_add(&f_.flusher_seq_, 1U);
+        futex_wake(&f_.flusher_seq_);
+    }
+}
+
+// Append the epoch and wake records that must precede records from epoch.
+void loginfo::append_epoch(kvepoch_t epoch) {
+    kvepoch_t we = global_wake_epoch;
+
+    // Potentially record a new epoch.
+    if (epoch != log_epoch_) {
+        log_epoch_ = epoch;
+        pos_ += logrec_epoch::store(buf_ + pos_, logcmd_epoch, epoch);
+    }
+
+    if (quiescent_epoch_) {
+        // We're recording a new log record on a log that's been
+        // quiescent for a while. If the quiescence marker has been
+        // flushed, then all epochs less than the query epoch are
+        // effectively on disk.
+        if (flushed_epoch_ == quiescent_epoch_)
+            flushed_epoch_ = epoch;
+        quiescent_epoch_ = 0;
+        while (we < epoch)
+            we = cmpxchg(&global_wake_epoch, we, epoch);
+    }
+
+    // Log epochs should be recorded in monotonically increasing
+    // order, but the wake epoch may be ahead of the query epoch (if
+    // the query took a while). So potentially record an EARLIER
+    // wake_epoch. This will get fixed shortly by the next log
+    // record.
+    if (we != wake_epoch_ && epoch < we)
+        we = epoch;
+    if (we != wake_epoch_) {
+        wake_epoch_ = we;
+        pos_ += logrec_base::store(buf_ + pos_, logcmd_wake);
+    }
+}
+
+// Move records from the worker buffers into buf_, oldest epoch first,
+// leaving records from epochs after bound for later. Workers' epoch
+// records are replaced by our own. Leaves room for the checksum.
+void loginfo::gather(kvepoch_t bound) {
+    const uint32_t markers = logrec_epoch::size() + logrec_base::size();
+    const uint32_t limit = len_ - logrec_checksum::size();
+    for (logbuffer* b = f_.buffers_; b; b = b->w_.next_) {
+        b->l_.scan_ = b->l_.head_;
+        b->l_.scan_end_ = b->w_.tail_;
+        b->l_.scan_epoch_ = b->l_.head_epoch_;
+    }
+    acquire_fence();
+
+    bool full = false;
+    while (!full) {
+        logbuffer* m = 0;
+        for (logbuffer* b = f_.buffers_; b; b = b->w_.next_)
+            if (b->scan_record()
+                && b->l_.scan_epoch_ <= bound
+                && (!m || b->l_.scan_epoch_ < m->l_.scan_epoch_))
+                m = b;
+        if (!m)
+            break;
+
+        kvepoch_t epoch = m->l_.scan_epoch_;
+        bool first = true;
+        const char* p;
+        while ((p = m->scan_record()) && m->l_.scan_epoch_ == epoch) {
+            uint32_t size = reinterpret_cast<const logrec_base*>(p)->size_;
+            if (pos_ + size + (first ? markers : 0) > limit) {
+                full = true;
+                break;
+            }
+            if (first) {
+                append_epoch(epoch);
+                first = false;
+            }
+            memcpy(buf_ + pos_, p, size);
+            pos_ += size;
+            m->l_.scan_ += size;
+        }
+    }
+
+    bool consumed = false;
+    for (logbuffer* b = f_.buffers_; b; b = b->w_.next_)
+        if (b->l_.scan_ != b->l_.head_) {
+            b->l_.head_epoch_ = b->l_.scan_epoch_;
+            release_fence();
+            b->l_.head_ = b->l_.scan_;
+            consumed = true;
+        }
+    // wake stalled writers; pairs with logbuffer::reserve
+    memory_fence();
+    if (consumed && f_.stalled_) {
+        fetch_and_add(&f_.writer_seq_, 1U);
+        futex_wake(&f_.writer_seq_);
+    }
+}
+
+void* loginfo::run() {
+    std::deque<logsegment>& segs = f_.side_->segments;
+    String filename(f_.filename_);
+    list_segments(filename, segs);
+    uint64_t next_seq = segs.empty() ? 0 : segs.back().seq + 1;
+    logreplay::replay(segs, ti_->index(), ti_);
+    if (segs.empty())
+        segs.push_back(logsegment{segment_name(filename, next_seq),
+                                  next_seq, 0});
+
+    // no O_APPEND: the writer issues batches at explicit offsets
+    int fd = open_segment(segs.back().filename);
+    logwriter* writer = f_.writer_ = new logwriter(fd, len_, log_buffers);
+    char* zbuf = 0;
+    if (log_compress) {
+        zbuf = (char*) malloc(lz_compress_bound(len_));
+        always_assert(zbuf);
+    }
 
     while (1) {
         uint32_t nb = 0;
-        acquire();
+        kvepoch_t x_epoch;
+        if (writer->reap(false, x_epoch))
+            flushed_epoch_ = x_epoch;
+        if (uint64_t te = f_.side_->trim_epoch) {
+            trim_segments(kvepoch_t(te));
+            bool_cmpxchg(&f_.side_->trim_epoch, te, uint64_t(0));
+        }
+        if (!recovering && pos_ == 0 && segment_full())
+            rotate();
+        if (f_.side_->follower_pending)
+            attach_followers();
         kvepoch_t ge = global_log_epoch, we = global_wake_epoch;
         if (wake_epoch_ != we) {
             wake_epoch_ = we;
             quiescent_epoch_ = 0;
         }
-        // If the writing threads appear quiescent, and aren't about to write
-        // to the log (f_.waiting_ != 0), then write a quiescence
-        // notification.
+        // Collect records up to the oldest epoch a worker is still
+        // updating. We read ge before the workers' announcements (see
+        // logbuffer::start_update), so no worker can later record an
+        // epoch older than anything we gather.
+        memory_fence();
+        if (!recovering) {
+            kvepoch_t bound = ge;
+            for (logbuffer* b = f_.buffers_; b; b = b->w_.next_)
+                if (kvepoch_t e = b->w_.active_epoch_)
+                    if (e < bound)
+                        bound = e;
+            gather(bound);
+        }
+        // If the writing threads appear quiescent, and aren't about to
+        // write to the log, then write a quiescence notification.
         if (!recovering && pos_ == 0 && !quiescent_epoch_
-            && ge != log_epoch_ && ge != we && !f_.waiting_) {
+            && ge != log_epoch_ && ge != we && !writers_busy()) {
             quiescent_epoch_ = log_epoch_ = ge;
             char *p = buf_;
             p += logrec_epoch::store(p, logcmd_epoch, log_epoch_);
@@ -265,123 +796,249 @@ void* loginfo::run() {
             p += logrec_base::store(p, logcmd_quiesce);
             pos_ = p - buf_;
         }
-        if (!recovering && pos_ > 0) {
+        if (!recovering && pos_ > 0 && !writer->full()) {
             uint32_t x_pos = pos_;
-            std::swap(buf_, x_buf);
+            char* x_buf = buf_;
+            buf_ = writer->take_buffer();
             pos_ = 0;
-            kvepoch_t x_epoch = log_epoch_;
-            release();
-            ssize_t r = write(fd, x_buf, x_pos);
-            always_assert(r == ssize_t(x_pos));
-            fsync(fd);
-            flushed_epoch_ = x_epoch;
+            if (!segs.back().first_epoch
+                && logrec_base::command(x_buf) == logcmd_epoch)
+                segs.back().first_epoch =
+                    reinterpret_cast<const logrec_epoch*>(x_buf)->epoch_;
+            if (zbuf)
+                x_pos = compress_batch(x_buf, x_pos, zbuf);
+            x_pos += logrec_checksum::store(x_buf + x_pos, x_buf, x_pos);
+            writer->write(x_buf, x_pos, log_epoch_);
+            if (!f_.side_->followers.empty())
+                ship(x_buf, x_pos);
             // printf("log %d %d\n", ti_->index(), x_pos);
             nb = x_pos;
-        } else
-            release();
-        if (nb < len_ / 4)
-            napms(200);
+        }
         if (ti_->index() == 0)
             check_epoch();
+        // let followers measure their lag while we're idle
+        if (nb == 0 && !f_.side_->followers.empty())
+            ship(0, 0);
+
+        // Group commit. Records that arrived during the last write are
+        // flushed immediately if they fill a quarter of a buffer;
+        // otherwise wait up to log_flush_interval for more to arrive.
+        // With no records, sleep until a writer shows up, waking every
+        // log_epoch_interval to record quiescence and epochs (or sooner
+        // to reap batches in flight). If every buffer is in flight, wait
+        // for the oldest to finish.
+        if (nb >= len_ / 4)
+            continue;
+        const struct timeval& idle_timeout =
+            writer->busy() ? log_flush_interval : log_epoch_interval;
+        bool idle = recovering || max_buffered() == 0;
+        if ((!recovering && pos_ > 0 && writer->full())
+            || (idle && !timerisset(&idle_timeout))) {
+            if (writer->reap(true, x_epoch))
+                flushed_epoch_ = x_epoch;
+            continue;
+        }
+        if (idle)
+            wait_for_records(flusher_idle, idle_timeout);
+        if (!recovering && timerisset(&log_flush_interval)
+            && max_buffered() != 0)
+            wait_for_records(flusher_batching, log_flush_interval);
     }
 
     return 0;
 }
 
 
+logbuffer::logbuffer(loginfo* log) {
+    w_.tail_ = 0;
+    w_.active_epoch_ = 0;
+    w_.log_epoch_ = 0;
+    w_.buf_ = (char*) malloc(size);
+    always_assert(w_.buf_);
+    w_.log_ = log;
+    w_.next_ = 0;
+    l_.head_ = l_.scan_ = l_.scan_end_ = 0;
+    l_.head_epoch_ = l_.scan_epoch_ = 0;
+    (void) padding1_;
+}
+
+bool logbuffer::fits(Str key, Str value) {
+    return logrec_kvdelta::size(key.len, value.len) + logrec_epoch::size()
+        <= size / 2;
+}
+
+bool logbuffer::fits(Str key, const lcdf::Json* req,
+                     const lcdf::Json* end_req) {
+    return logrec_kvdelta::size(key.len, columns_size(req, end_req))
+        + logrec_epoch::size() <= size / 2;
+}
 
-// log entry format: see log.hh
-void loginfo::record(int command, const query_times& qtimes,
-                     Str key, Str value) {
-    assert(!recovering);
-    size_t n = logrec_kvdelta::size(key.len, value.len)
-        + logrec_epoch::size() + logrec_base::size();
-    waitlist wait = { &wait };
+// Return the position of n contiguous free bytes, padding to the end
+// of the buffer if necessary. Waits for the logger if the buffer is full.
+uint64_t logbuffer::reserve(size_t n) {
+    always_assert(n <= size / 2);
     int stalls = 0;
     while (1) {
-        if (len_ - pos_ >= n
-            && (wait.next == &wait || f_.waiting_ == &wait)) {
-            kvepoch_t we = global_wake_epoch;
-
-            // Potentially record a new epoch.
-            if (qtimes.epoch != log_epoch_) {
-                log_epoch_ = qtimes.epoch;
-                pos_ += logrec_epoch::store(buf_ + pos_, logcmd_epoch, qtimes.epoch);
+        uint64_t t = w_.tail_, left = size - t % size;
+        uint64_t need = left < n ? left + n : n;
+        if (size - (t - l_.head_) >= need) {
+            acquire_fence();
+            if (left < n) {
+                if (left >= logrec_base::size())
+                    logrec_base::store(w_.buf_ + t % size, logcmd_none);
+                t += left;
             }
+            return t;
+        }
 
-            if (quiescent_epoch_) {
-                // We're recording a new log record on a log that's been
-                // quiescent for a while. If the quiescence marker has been
-                // flushed, then all epochs less than the query epoch are
-                // effectively on disk.
-                if (flushed_epoch_ == quiescent_epoch_)
-                    flushed_epoch_ = qtimes.epoch;
-                quiescent_epoch_ = 0;
-                while (we < qtimes.epoch)
-                    we = cmpxchg(&global_wake_epoch, we, qtimes.epoch);
-            }
+        // Otherwise wait for the logger to drain the buffer
+        loginfo* log = w_.log_;
+        uint32_t seq = log->f_.writer_seq_;
+        fetch_and_add(&log->f_.stalled_, 1U);
+        memory_fence();
+        if (size - (w_.tail_ - l_.head_) < need) {
+            uint32_t state = log->f_.flusher_state_;
+            if (state != loginfo::flusher_awake)
+                log->wake_flusher(state);
+            if (stalls == 0)
+                printf("stall\n");
+            else if (stalls % 25 == 0)
+                printf("stall %d\n", stalls);
+            ++stalls;
+            futex_wait(&log->f_.writer_seq_, seq, log_epoch_interval);
+        }
+        fetch_and_add(&log->f_.stalled_, -1U);
+    }
+}
 
-            // Log epochs should be recorded in monotonically increasing
-            // order, but the wake epoch may be ahead of the query epoch (if
-            // the query took a while). So potentially record an EARLIER
-            // wake_epoch. This will get fixed shortly by the next log
-            // record.
-            if (we != wake_epoch_ && qtimes.epoch < we)
-                we = qtimes.epoch;
-            if (we != wake_epoch_) {
-                wake_epoch_ = we;
-                pos_ += logrec_base::store(buf_ + pos_, logcmd_wake);
-            }
+// Publish records up to tail and, if done, end the update started by
+// start_update(). The recheck pairs with loginfo::wait_for_records.
+void logbuffer::publish(uint64_t tail, bool done) {
+    release_fence();
+    w_.tail_ = tail;
+    if (!done)
+        return;
+    release_fence();
+    w_.active_epoch_ = 0;
+    memory_fence();
+    uint32_t state = w_.log_->f_.flusher_state_;
+    if (state == loginfo::flusher_idle
+        || (state == loginfo::flusher_batching
+            && tail - l_.head_ >= size / 4))
+        w_.log_->wake_flusher(state);
+}
 
-            if (command == logcmd_put && qtimes.prev_ts
-                && !(qtimes.prev_ts & 1))
-                pos_ += logrec_kvdelta::store(buf_ + pos_,
-                                              logcmd_modify, key, value,
-                                              qtimes.prev_ts, qtimes.ts);
-            else
-                pos_ += logrec_kv::store(buf_ + pos_,
-                                         command, key, value, qtimes.ts);
-
-            if (f_.waiting_ == &wait)
-                f_.waiting_ = wait.next;
-            release();
-            return;
+// Called by the logger. Skip padding and epoch records at l_.scan_, then
+// return the data record there, or null if none remain.
+const char* logbuffer::scan_record() {
+    while (l_.scan_ != l_.scan_end_) {
+        uint64_t left = size - l_.scan_ % size;
+        const char* p = w_.buf_ + l_.scan_ % size;
+        if (left < logrec_base::size()
+            || logrec_base::command(p) == logcmd_none)
+            l_.scan_ += left;
+        else if (logrec_base::command(p) == logcmd_epoch) {
+            l_.scan_epoch_ = reinterpret_cast<const logrec_epoch*>(p)->epoch_;
+            l_.scan_ += logrec_epoch::size();
+        } else
+            return p;
+    }
+    return 0;
+}
+
+// log entry format: see log.hh
+void logbuffer::record(int command, const loginfo::query_times& qtimes,
+                       Str key, Str value) {
+    assert(!recovering);
+    size_t n = logrec_kvdelta::size(key.len, value.len) + logrec_epoch::size();
+    uint64_t t = reserve(n);
+    char* p = w_.buf_ + t % size;
+    char* start = p;
+
+    if (qtimes.epoch != w_.log_epoch_) {
+        w_.log_epoch_ = qtimes.epoch;
+        p += logrec_epoch::store(p, logcmd_epoch, qtimes.epoch);
+    }
+
+    if (command == logcmd_put && qtimes.prev_ts
+        && !(qtimes.prev_ts & 1))
+        p += logrec_kvdelta::store(p, logcmd_modify, key, value,
+                                   qtimes.prev_ts, qtimes.ts);
+    else
+        p += logrec_kv::store(p, command, key, value, qtimes.ts);
+
+    publish(t + (p - start));
+}
+
+// Each reservation holds at least one pair; later pairs join it while
+// it stays under a quarter of the buffer.
+void logbuffer::record_batch(int command, const loginfo::query_times* qt,
+                             const lcdf::Json* req, const lcdf::Json* end_req) {
+    assert(!recovering && command == logcmd_replace);
+    while (req != end_req) {
+        size_t n = 0;
+        const lcdf::Json* r = req;
+        for (; r != end_req; r += 2) {
+            size_t rn = logrec_kv::size(r[0].as_s().length(),
+                                        r[1].as_s().length())
+                + logrec_epoch::size();
+            if (n && n + rn > size / 4)
+                break;
+            n += rn;
         }
 
-        // Otherwise must spin
-        if (wait.next == &wait) {
-            waitlist** p = &f_.waiting_;
-            while (*p)
-                p = &(*p)->next;
-            *p = &wait;
-            wait.next = 0;
+        uint64_t t = reserve(n);
+        char* p = w_.buf_ + t % size;
+        char* start = p;
+        for (; req != r; req += 2, ++qt) {
+            if (qt->epoch != w_.log_epoch_) {
+                w_.log_epoch_ = qt->epoch;
+                p += logrec_epoch::store(p, logcmd_epoch, qt->epoch);
+            }
+            p += logrec_kv::store(p, command, req[0].as_s(), req[1].as_s(),
+                                  qt->ts);
         }
-        release();
-        if (stalls == 0)
-            printf("stall\n");
-        else if (stalls % 25 == 0)
-            printf("stall %d\n", stalls);
-        ++stalls;
-        napms(50);
-        acquire();
+        publish(t + (p - start), req == end_req);
     }
 }
 
-void loginfo::record(int command, const query_times& qtimes, Str key,
-                     const lcdf::Json* req, const lcdf::Json* end_req) {
-    lcdf::StringAccum sa(128);
-    msgpack::unparser<lcdf::StringAccum> cu(sa);
-    cu.write_array_header(end_req - req);
-    for (; req != end_req; ++req)
-        cu << *req;
-    record(command, qtimes, key, Str(sa.data(), sa.length()));
+// Record the changed columns directly in the buffer.
+void logbuffer::record(int command, const loginfo::query_times& qtimes, Str key,
+                       const lcdf::Json* req, const lcdf::Json* end_req) {
+    assert(!recovering && command == logcmd_put);
+    (void) command;
+    size_t vallen = columns_size(req, end_req);
+    size_t n = logrec_kvdelta::size(key.len, vallen) + logrec_epoch::size();
+    uint64_t t = reserve(n);
+    char* p = w_.buf_ + t % size;
+    char* start = p;
+
+    if (qtimes.epoch != w_.log_epoch_) {
+        w_.log_epoch_ = qtimes.epoch;
+        p += logrec_epoch::store(p, logcmd_epoch, qtimes.epoch);
+    }
+
+    // NB record sizes include any tail padding after the value
+    if (qtimes.prev_ts && !(qtimes.prev_ts & 1)) {
+        columns_store(logrec_kvdelta::prepare(p, logcmd_modify_columns, key,
+                                              vallen, qtimes.prev_ts,
+                                              qtimes.ts), req, end_req);
+        p += logrec_kvdelta::size(key.len, vallen);
+    } else {
+        columns_store(logrec_kv::prepare(p, logcmd_put_columns, key, vallen,
+                                         qtimes.ts), req, end_req);
+        p += logrec_kv::size(key.len, vallen);
+    }
+
+    publish(t + (p - start));
 }
 
 
 // replay
 
 logreplay::logreplay(const String &filename)
-    : filename_(filename), errno_(0), buf_()
+    : filename_(filename), errno_(0), size_(0), buf_(), end_(),
+      inflated_(false)
 {
     int fd = open(filename_.c_str(), O_RDONLY);
     if (fd == -1) {
@@ -409,6 +1066,8 @@ logreplay::logreplay(const String &filename)
     }
 
     (void) close(fd);
+    end_ = check();
+    inflate();
 }
 
 logreplay::~logreplay()
@@ -420,16 +1079,121 @@ int
 logreplay::unmap()
 {
     int r = 0;
-    if (buf_) {
+    if (buf_ && inflated_)
+        free(buf_);
+    else if (buf_)
         r = munmap(buf_, size_);
-        buf_ = 0;
-    }
+    buf_ = 0;
     return r;
 }
 
+struct logreplay::inflate_part {
+    const logreplay *log;
+    std::vector<std::pair<const logrec_compressed *, char *> > *batches;
+    unsigned part;
+    unsigned nparts;
+};
+
+void *
+logreplay::inflate_trampoline(void *x)
+{
+    inflate_part *ip = reinterpret_cast<inflate_part *>(x);
+    for (size_t i = ip->part; i < ip->batches->size(); i += ip->nparts) {
+        const logrec_compressed *lc = (*ip->batches)[i].first;
+        if (!lz_decompress(lc->buf_, lc->size_ - sizeof(*lc),
+                           (*ip->batches)[i].second, lc->rawlen_)) {
+            fprintf(stderr, "replay %s: bad compressed batch @%zu\n",
+                    ip->log->filename_.c_str(),
+                    reinterpret_cast<const char *>(lc) - ip->log->buf_);
+            abort();
+        }
+    }
+    return 0;
+}
+
+// Expand compressed batches into a private copy of the intact log, so the
+// rest of recovery sees plain records. Batches decompress independently,
+// on up to log_replay_threads threads. Checksums are recomputed to cover
+// the expanded batches.
+void
+logreplay::inflate()
+{
+    size_t len = 0;
+    std::vector<std::pair<const logrec_compressed *, char *> > batches;
+    for (const char *p = buf_; p < end_; ) {
+        const logrec_base *lr = reinterpret_cast<const logrec_base *>(p);
+        if (lr->command_ == logcmd_compressed) {
+            const logrec_compressed *lc =
+                reinterpret_cast<const logrec_compressed *>(p);
+            always_assert(lc->size_ >= sizeof(*lc));
+            batches.push_back(std::make_pair(lc, (char *) 0));
+            len += lc->rawlen_;
+        } else
+            len += lr->size_;
+        p += lr->size_;
+    }
+    if (batches.empty())
+        return;
+
+    char *image = (char *) malloc(len);
+    always_assert(image);
+    char *out = image;
+    size_t bi = 0;
+    for (const char *p = buf_; p < end_; ) {
+        const logrec_base *lr = reinterpret_cast<const logrec_base *>(p);
+        if (lr->command_ == logcmd_compressed) {
+            batches[bi++].second = out;
+            out += reinterpret_cast<const logrec_compressed *>(p)->rawlen_;
+        } else {
+            memcpy(out, p, lr->size_);
+            out += lr->size_;
+        }
+        p += lr->size_;
+    }
+
+    unsigned nparts = std::min(size_t(std::max(log_replay_threads, 1)),
+                               batches.size());
+    std::vector<inflate_part> parts(nparts);
+    std::vector<pthread_t> threads(nparts);
+    for (unsigned i = 0; i != nparts; ++i) {
+        parts[i].log = this;
+        parts[i].batches = &batches;
+        parts[i].part = i;
+        parts[i].nparts = nparts;
+        if (i) {
+            int r = pthread_create(&threads[i], 0, inflate_trampoline, &parts[i]);
+            always_assert(r == 0);
+        }
+    }
+    inflate_trampoline(&parts[0]);
+    for (unsigned i = 1; i != nparts; ++i) {
+        int r = pthread_join(threads[i], 0);
+        always_assert(r == 0);
+    }
+
+    const char *batch = image;
+    for (char *p = image; p < image + len; ) {
+        const logrec_base *lr = reinterpret_cast<const logrec_base *>(p);
+        if (lr->command_ == logcmd_checksum) {
+            logrec_checksum::store(p, batch, p - batch);
+            batch = p + lr->size_;
+        }
+        p += lr->size_;
+    }
+
+    fprintf(stderr, "replay %s: %zu compressed batches, %zu to %zu bytes\n",
+            filename_.c_str(), batches.size(), size_t(end_ - buf_), len);
+    unmap();
+    buf_ = image;
+    end_ = image + len;
+    size_ = len;
+    inflated_ = true;
+}
+
 
 struct logrecord {
     uint32_t command;
+    bool columns;               // val is a column list, not msgpack
     Str key;
     Str val;
     kvtimestamp_t ts;
@@ -460,6 +1224,12 @@ logrecord::extract(const char *buf, const char *end)
     }
 
     command = lr->command_;
+    columns = command == logcmd_put_columns
+        || command == logcmd_modify_columns;
+    if (command == logcmd_put_columns)
+        command = logcmd_put;
+    else if (command == logcmd_modify_columns)
+        command = logcmd_modify;
     if (command == logcmd_put || command == logcmd_replace
         || command == logcmd_remove) {
         const logrec_kv *lk = reinterpret_cast<const logrec_kv *>(buf);
@@ -498,6 +1268,8 @@ void logrecord::run(T& table, std::vector<lcdf::Json>& jrepo, threadinfo& ti) {
         val = Str((const char*) &m, sizeof(m));
     }
 
+    if (logreplay_fault_in)
+        logreplay_fault_in(key, ti);
     typename T::cursor_type lp(table, key);
     bool found = lp.find_insert(ti);
     if (!found)
@@ -506,8 +1278,26 @@ void logrecord::run(T& table, std::vector<lcdf::Json>& jrepo, threadinfo& ti) {
     lp.finish(1, ti);
 }
 
-static lcdf::Json* parse_changeset(Str changeset,
+static lcdf::Json* parse_changeset(Str changeset, bool columns,
                                    std::vector<lcdf::Json>& jrepo) {
+    if (columns) {
+        const char *p = changeset.begin(), *end = changeset.end();
+        uint64_t index, len;
+        size_t pos = 0;
+        while (p != end
+               && (p = varint_parse(p, end, index))
+               && (p = varint_parse(p, end, len))
+               && len <= uint64_t(end - p)) {
+            if (pos == jrepo.size())
+                jrepo.resize(pos + 2);
+            jrepo[pos] = unsigned(index);
+            jrepo[pos + 1] = String::make_stable(Str(p, len));
+            p += len;
+            pos += 2;
+        }
+        return jrepo.data() + pos;
+    }
+
     msgpack::parser mp(changeset.udata());
     unsigned index = 0;
     Str value;
@@ -523,6 +1313,24 @@ static lcdf::Json* parse_changeset(Str changeset,
     return jrepo.data() + pos;
 }
 
+// Outside recovery, a follower applies records while clients read the
+// tree, so old rows must wait out RCU.
+static inline void free_row(row_type* row, threadinfo& ti) {
+    if (recovering)
+        row->deallocate(ti);
+    else
+        row->deallocate_rcu(ti);
+}
+
+static inline void free_row_after_update(row_type* row, const lcdf::Json* first,
+                                         const lcdf::Json* last,
+                                         threadinfo& ti) {
+    if (recovering)
+        row->deallocate(ti);
+    else
+        row->deallocate_rcu_after_update(first, last, ti);
+}
+
 inline void logrecord::apply(row_type*& value, bool found,
                              std::vector<lcdf::Json>& jrepo, threadinfo& ti) {
     row_type** cur_value = &value;
@@ -546,22 +1354,22 @@ inline void logrecord::apply(row_type*& value, bool found,
                 *cur_value = row_get_delta_marker(old_value)->prev_;
             } else
                 *cur_value = 0;
-            old_value->deallocate(ti);
+            free_row(old_value, ti);
         }
 
-    // actually apply change
-    if (command == logcmd_replace)
+    // actually apply change (a remove leaves a remove marker)
+    if (command == logcmd_replace || command == logcmd_remove)
         *cur_value = row_type::create1(val, ts, ti);
     else if (command != logcmd_modify
              || (*cur_value && (*cur_value)->timestamp() == prev_ts)) {
-        lcdf::Json* end_req = parse_changeset(val, jrepo);
+        lcdf::Json* end_req = parse_changeset(val, columns, jrepo);
         if (command != logcmd_modify)
             *cur_value = row_type::create(jrepo.data(), end_req, ts, ti);
         else {
             row_type* old_value = *cur_value;
             *cur_value = old_value->update(jrepo.data(), end_req, ts, ti);
             if (*cur_value != old_value)
-                old_value->deallocate(ti);
+                free_row_after_update(old_value, jrepo.data(), end_req, ti);
         }
     } else {
         // XXX assume that memory exists before saved request -- it does
@@ -570,7 +1378,8 @@ inline void logrecord::apply(row_type*& value, bool found,
         val.len += sizeof(row_delta_marker<row_type>);
         row_type* new_value = row_type::create1(val, ts | 1, ti);
         row_delta_marker<row_type>* dm = row_get_delta_marker(new_value, true);
-        dm->marker_type_ = row_marker::mt_delta;
+        dm->marker_type_ = columns ? row_marker::mt_delta_columns
+            : row_marker::mt_delta;
         dm->prev_ts_ = prev_ts;
         dm->prev_ = *cur_value;
         *cur_value = new_value;
@@ -590,11 +1399,13 @@ inline void logrecord::apply(row_type*& value, bool found,
             Str req = old_prev->col(0);
             req.s += sizeof(row_delta_marker<row_type>);
             req.len -= sizeof(row_delta_marker<row_type>);
-            const lcdf::Json* end_req = parse_changeset(req, jrepo);
+            bool columns = row_get_delta_marker(*prev)->marker_type_
+                == row_marker::mt_delta_columns;
+            const lcdf::Json* end_req = parse_changeset(req, columns, jrepo);
             *prev = (*trav)->update(jrepo.data(), end_req, old_prev->timestamp() - 1, ti);
             if (*prev != *trav)
-                (*trav)->deallocate(ti);
-            old_prev->deallocate(ti);
+                free_row_after_update(*trav, jrepo.data(), end_req, ti);
+            free_row(old_prev, ti);
             ti.mark(tc_replay_remove_delta);
         } else
             break;
@@ -609,7 +1420,7 @@ logreplay::info() const
     x.first_epoch = x.last_epoch = x.wake_epoch = x.min_post_quiescent_wake_epoch = 0;
     x.quiescent = true;
 
-    const char *buf = buf_, *end = buf_ + size_;
+    const char *buf = buf_, *end = end_;
     off_t nr = 0;
     bool log_corrupt = false;
     while (buf + sizeof(logrec_base) <= end) {
@@ -619,7 +1430,8 @@ logreplay::info() const
             break;
         } else if (unlikely(buf + lr->size_ > end))
             break;
-        x.quiescent = lr->command_ == logcmd_quiesce;
+        if (lr->command_ != logcmd_checksum)
+            x.quiescent = lr->command_ == logcmd_quiesce;
         if (lr->command_ == logcmd_epoch) {
             const logrec_epoch *lre =
                 reinterpret_cast<const logrec_epoch *>(buf);
@@ -638,8 +1450,11 @@ logreplay::info() const
         else if (lr->command_ != logcmd_put
                  && lr->command_ != logcmd_replace
                  && lr->command_ != logcmd_modify
+                 && lr->command_ != logcmd_put_columns
+                 && lr->command_ != logcmd_modify_columns
                  && lr->command_ != logcmd_remove
-                 && lr->command_ != logcmd_quiesce) {
+                 && lr->command_ != logcmd_quiesce
+                 && lr->command_ != logcmd_checksum) {
             log_corrupt = true;
             break;
         }
@@ -660,7 +1475,7 @@ kvepoch_t
 logreplay::min_post_quiescent_wake_epoch(kvepoch_t quiescent_epoch) const
 {
     kvepoch_t e = 0;
-    const char *buf = buf_, *end = buf_ + size_;
+    const char *buf = buf_, *end = end_;
     bool log_corrupt = false;
     while (buf + sizeof(logrec_base) <= end) {
         const logrec_base *lr = reinterpret_cast<const logrec_base *>(buf);
@@ -687,68 +1502,223 @@ logreplay::min_post_quiescent_wake_epoch(kvepoch_t quiescent_epoch) const
     return 0;
 }
 
+// Return the end of the intact log. Each batch the logger writes ends
+// with a checksum record. Once we have seen one, a batch that fails its
+// checksum is a torn write and ends the log, along with everything after
+// it. Logs without checksums are checked only structurally.
+const char *
+logreplay::check() const
+{
+    const char *buf = buf_, *end = buf_ + size_, *batch = buf_;
+    bool checksummed = false;
+    while (buf + sizeof(logrec_base) <= end) {
+        const logrec_base *lr = reinterpret_cast<const logrec_base *>(buf);
+        if (lr->size_ < sizeof(logrec_base) || buf + lr->size_ > end
+            || lr->command_ == logcmd_none)
+            break;
+        if (lr->command_ == logcmd_checksum) {
+            const logrec_checksum *lc =
+                reinterpret_cast<const logrec_checksum *>(buf);
+            if (lc->size_ < sizeof(*lc)
+                || lc->length_ != size_t(buf - batch)
+                || lc->crc_ != crc32c(batch, lc->length_))
+                break;
+            checksummed = true;
+            batch = buf + lc->size_;
+        }
+        buf += lr->size_;
+    }
+    if (!checksummed)
+        batch = buf;
+    if (batch != end)
+        fprintf(stderr, "replay %s: ignoring %zu bytes after intact log @%zu\n",
+                filename_.c_str(), size_t(end - batch), size_t(batch - buf_));
+    return batch;
+}
+
+struct logreplay::replay_part {
+    const logreplay *log;
+    const char *first;
+    const char *last;
+    kvepoch_t min_epoch;
+    unsigned part;
+    unsigned nparts;
+    threadinfo *ti;
+    uint64_t nr;
+};
+
+// Recovery helper threads share a pool of TI_REPLAY threadinfos, so
+// recovery makes only as many as run at once.
+static pthread_mutex_t replay_helpers_mu = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<threadinfo*> replay_helpers;
+static int replay_helpers_made;
+
+threadinfo* replay_helper_get() {
+    pthread_mutex_lock(&replay_helpers_mu);
+    threadinfo* ti;
+    if (replay_helpers.empty())
+        ti = threadinfo::make(threadinfo::TI_REPLAY, replay_helpers_made++);
+    else {
+        ti = replay_helpers.back();
+        replay_helpers.pop_back();
+    }
+    pthread_mutex_unlock(&replay_helpers_mu);
+    return ti;
+}
+
+void replay_helper_put(threadinfo* ti) {
+    pthread_mutex_lock(&replay_helpers_mu);
+    replay_helpers.push_back(ti);
+    pthread_mutex_unlock(&replay_helpers_mu);
+}
+
+// Free what ti left in RCU limbo. Rather than wait for the epoch timer,
+// advance the epoch and wait for active threads to pass it; give up
+// after a second, leaving the rest for ti's next use.
+void replay_helper_finish(threadinfo* ti) {
+    if (!ti->limbo_count())
+        return;
+    mrcu_epoch_type e = fetch_and_add(const_cast<uint64_t*>(&globalepoch),
+                                      uint64_t(2));
+    for (int waits = 0;
+         mrcu_signed_epoch_type(threadinfo::min_active_epoch() - e) <= 0;
+         ++waits) {
+        if (waits == 1000)
+            return;
+        usleep(1000);
+    }
+    active_epoch = threadinfo::min_active_epoch();
+    while (ti->limbo_count()) {
+        uint64_t n = ti->limbo_count();
+        ti->rcu_stop();
+        if (ti->limbo_count() == n)
+            break;
+    }
+}
+
+void *
+logreplay::replay_trampoline(void *x)
+{
+    replay_part *rp = reinterpret_cast<replay_part *>(x);
+    rp->ti->pthread() = pthread_self();
+    rp->nr = rp->log->replay_range(rp->first, rp->last, rp->min_epoch,
+                                   rp->part, rp->nparts, rp->ti);
+    replay_helper_finish(rp->ti);
+    return 0;
+}
+
+// Replay the updates in [first, last) from epochs >= min_epoch whose keys
+// hash to part. All updates to a key go to the same part, in log order;
+// logrecord::apply orders them against other logs by timestamp. Quiesces
+// every replay_quiesce_interval records so replaced rows can be freed.
 uint64_t
-logreplay::replayandclean1(kvepoch_t min_epoch, kvepoch_t max_epoch,
-                           threadinfo *ti)
+logreplay::replay_range(const char *first, const char *last,
+                        kvepoch_t min_epoch, unsigned part, unsigned nparts,
+                        threadinfo *ti) const
 {
     uint64_t nr = 0;
-    const char *pos = buf_, *end = buf_ + size_;
-    const char *repbegin = 0, *repend = 0;
+    kvepoch_t epoch = 0;
     logrecord lr;
     std::vector<lcdf::Json> jrepo;
+    enum { replay_quiesce_interval = 1024 };
+
+    ti->rcu_start();
+    while (first < last) {
+        const char *next = lr.extract(first, last);
+        if (lr.command == logcmd_epoch)
+            epoch = lr.epoch;
+        else if ((lr.command == logcmd_put
+                  || lr.command == logcmd_replace
+                  || lr.command == logcmd_modify
+                  || lr.command == logcmd_remove)
+                 && epoch && !(min_epoch && epoch < min_epoch)
+                 && lr.key.len // skip empty entry
+                 && (nparts == 1
+                     || unsigned(lr.key.hashcode()) % nparts == part)) {
+            lr.run(tree->table(), jrepo, *ti);
+            ++nr;
+            if (nr % 100000 == 0)
+                fprintf(stderr,
+                        "replay %s: %" PRIu64 " entries replayed\n",
+                        filename_.c_str(), nr * nparts);
+            if (nr % replay_quiesce_interval == 0)
+                ti->rcu_quiesce();
+        }
+        first = next;
+    }
+    ti->rcu_stop();
+    return nr;
+}
+
+uint64_t
+logreplay::replayandclean1(kvepoch_t min_epoch, kvepoch_t max_epoch,
+                           bool &started, bool &finished, threadinfo *ti)
+{
+    const char *pos = buf_, *end = end_, *batch = buf_;
+    const char *repbegin = started ? buf_ : 0, *repend = buf_;
+    logrecord lr;
 
-    // XXX
+    // Find the part of the log to replay and keep: from the batch holding
+    // the last epoch before min_epoch through the first epoch record at or
+    // after max_epoch. If started, an earlier segment held the beginning.
     while (pos < end) {
         const char *nextpos = lr.extract(pos, end);
         if (lr.command == logcmd_none) {
-            fprintf(stderr, "replay %s: %" PRIu64 " entries replayed, CORRUPT @%zu\n",
-                    filename_.c_str(), nr, pos - buf_);
+            fprintf(stderr, "replay %s: CORRUPT @%zu\n",
+                    filename_.c_str(), pos - buf_);
             break;
         }
         if (lr.command == logcmd_epoch) {
             if ((min_epoch && lr.epoch < min_epoch)
                 || (!min_epoch && !repbegin))
-                repbegin = pos;
+                repbegin = batch;
             if (lr.epoch >= max_epoch) {
                 always_assert(repbegin);
                 repend = nextpos;
+                finished = true;
                 break;
             }
+        } else if (lr.command == logcmd_checksum)
+            batch = nextpos;
+        if (repbegin)
+            repend = nextpos;
+        pos = nextpos;
+    }
+
+    // Replay it, split by key hash across log_replay_threads threads.
+    uint64_t nr = 0;
+    if (repbegin) {
+        unsigned nparts = std::max(log_replay_threads, 1);
+        std::vector<replay_part> parts(nparts);
+        for (unsigned i = 0; i != nparts; ++i) {
+            replay_part &rp = parts[i];
+            rp.log = this;
+            rp.first = repbegin;
+            rp.last = repend;
+            rp.min_epoch = min_epoch;
+            rp.part = i;
+            rp.nparts = nparts;
+            rp.ti = i ? replay_helper_get() : ti;
+            rp.nr = 0;
+            if (i) {
+                int r = pthread_create(&rp.ti->pthread(), 0,
+                                       replay_trampoline, &rp);
+                always_assert(r == 0);
+            }
         }
-        if (!lr.epoch || (min_epoch && lr.epoch < min_epoch)) {
-            pos = nextpos;
-            if (repbegin)
-                repend = nextpos;
-            continue;
-        }
-        // replay only part of log after checkpoint
-        // could replay everything, the if() here tests
-        // correctness of checkpoint scheme.
-        assert(repbegin);
-        repend = nextpos;
-        if (lr.key.len) { // skip empty entry
-            if (lr.command == logcmd_put
-                || lr.command == logcmd_replace
-                || lr.command == logcmd_modify
-                || lr.command == logcmd_remove)
-                lr.run(tree->table(), jrepo, *ti);
-            ++nr;
-            if (nr % 100000 == 0)
-                fprintf(stderr,
-                        "replay %s: %" PRIu64 " entries replayed\n",
-                        filename_.c_str(), nr);
+        nr = replay_range(repbegin, repend, min_epoch, 0, nparts, ti);
+        for (unsigned i = 1; i != nparts; ++i) {
+            int r = pthread_join(parts[i].ti->pthread(), 0);
+            always_assert(r == 0);
+            nr += parts[i].nr;
+            replay_helper_put(parts[i].ti);
         }
-        // XXX RCU
-        pos = nextpos;
     }
 
     // rewrite portion of log
+    started = repbegin != 0;
     if (!repbegin)
-        repbegin = repend = buf_;
-    else if (!repend) {
-        fprintf(stderr, "replay %s: surprise repend\n", filename_.c_str());
-        repend = pos;
-    }
+        repbegin = repend = batch = buf_;
 
     char tmplog[256];
     int r = snprintf(tmplog, sizeof(tmplog), "%s.tmp", filename_.c_str());
@@ -758,13 +1728,21 @@ logreplay::replayandclean1(kvepoch_t min_epoch, kvepoch_t max_epoch,
            filename_.c_str(), size_, repend - repbegin,
            repbegin - buf_, repend - buf_);
 
-    bool need_copy = repbegin != buf_;
+    bool need_copy = repbegin != buf_ || inflated_;
     int fd;
     if (!need_copy)
         fd = replay_truncate(repend - repbegin);
     else
         fd = replay_copy(tmplog, repbegin, repend);
 
+    // checksum the records kept from a batch we cut short
+    if (batch < repend) {
+        char ck[sizeof(logrec_checksum)];
+        size_t n = logrec_checksum::store(ck, batch, repend - batch);
+        ssize_t w = safe_write(fd, ck, n);
+        always_assert(w == ssize_t(n));
+    }
+
     r = fsync(fd);
     always_assert(r == 0);
     r = close(fd);
@@ -835,12 +1813,34 @@ logreplay::replay_copy(const char *tmpname, const char *first, const char *last)
 }
 
 void
-logreplay::replay(int which, threadinfo *ti)
+logreplay::replay(std::deque<logsegment>& segments, int which,
+                  threadinfo *ti)
 {
+    std::vector<logreplay*> lr;
+    for (auto& seg : segments)
+        lr.push_back(new logreplay(seg.filename));
+    bool any = false;
+
     waituntilphase(REC_LOG_TS);
     // find the maximum timestamp of entries in the log
-    if (buf_) {
-        info_type x = info();
+    info_type x;
+    x.first_epoch = x.last_epoch = x.wake_epoch = x.min_post_quiescent_wake_epoch = 0;
+    x.quiescent = true;
+    for (size_t i = 0; i != lr.size(); ++i)
+        if (lr[i]->buf_) {
+            info_type sx = lr[i]->info();
+            segments[i].first_epoch = sx.first_epoch;
+            any = true;
+            if (!sx.first_epoch)
+                continue;
+            if (!x.first_epoch)
+                x.first_epoch = sx.first_epoch;
+            x.last_epoch = sx.last_epoch;
+            x.quiescent = sx.quiescent;
+            if (sx.wake_epoch)
+                x.wake_epoch = sx.wake_epoch;
+        }
+    if (any) {
         pthread_mutex_lock(&rec_mu);
         rec_log_infos[which] = x;
         pthread_mutex_unlock(&rec_mu);
@@ -848,20 +1848,173 @@ logreplay::replay(int which, threadinfo *ti)
     inactive();
 
     waituntilphase(REC_LOG_ANALYZE_WAKE);
-    if (buf_) {
+    if (any) {
         if (rec_replay_min_quiescent_last_epoch
             && rec_replay_min_quiescent_last_epoch <= rec_log_infos[which].wake_epoch)
-            rec_log_infos[which].min_post_quiescent_wake_epoch =
-                min_post_quiescent_wake_epoch(rec_replay_min_quiescent_last_epoch);
+            for (size_t i = 0; i != lr.size(); ++i)
+                if (lr[i]->buf_) {
+                    kvepoch_t e = lr[i]->min_post_quiescent_wake_epoch(rec_replay_min_quiescent_last_epoch);
+                    if (e) {
+                        rec_log_infos[which].min_post_quiescent_wake_epoch = e;
+                        break;
+                    }
+                }
     }
     inactive();
 
     waituntilphase(REC_LOG_REPLAY);
-    if (buf_) {
-        ti->rcu_start();
-        uint64_t nr = replayandclean1(rec_replay_min_epoch, rec_replay_max_epoch, ti);
-        ti->rcu_stop();
-        printf("recovered %" PRIu64 " records from %s\n", nr, filename_.c_str());
+    // Segments before the last one to start below rec_replay_min_epoch,
+    // and after the one holding rec_replay_max_epoch, aren't needed.
+    bool started = false, finished = false;
+    std::deque<logsegment> kept;
+    for (size_t i = 0; i != lr.size(); ++i) {
+        logreplay* r = lr[i];
+        if (finished
+            || (rec_replay_min_epoch && i + 1 != lr.size()
+                && segments[i + 1].first_epoch
+                && segments[i + 1].first_epoch < rec_replay_min_epoch)) {
+            r->unmap();
+            if (unlink(r->filename_.c_str()) == 0)
+                printf("replay %s: deleted\n", r->filename_.c_str());
+            continue;
+        }
+        if (r->buf_) {
+            uint64_t nr = r->replayandclean1(rec_replay_min_epoch, rec_replay_max_epoch,
+                                             started, finished, ti);
+            printf("recovered %" PRIu64 " records from %s\n", nr, r->filename_.c_str());
+        }
+        kept.push_back(segments[i]);
     }
+    segments.swap(kept);
+    for (auto r : lr)
+        delete r;
     inactive();
 }
+
+
+logfollower::logfollower(int fd, int logindex)
+    : fd_(fd), logindex_(logindex), ti_(0), buf_(0), len_(0), cap_(0),
+      applied_epoch_(0), leader_epoch_(0), bytes_(0), nlogs_(0) {
+}
+
+logfollower::~logfollower() {
+    if (fd_ >= 0)
+        close(fd_);
+    free(buf_);
+}
+
+// Read one frame, appending its data to buf_. Returns false at EOF or on
+// error.
+bool logfollower::read_frame() {
+    logship_frame h;
+    if (safe_read(fd_, &h, sizeof(h)) != sizeof(h))
+        return false;
+    if (len_ + h.len > cap_) {
+        cap_ = std::max(len_ + h.len, cap_ * 2);
+        buf_ = (char*) realloc(buf_, cap_);
+        always_assert(buf_);
+    }
+    if (safe_read(fd_, buf_ + len_, h.len) != ssize_t(h.len))
+        return false;
+    len_ += h.len;
+    bytes_ += h.len;
+    nlogs_ = h.nlogs;
+    leader_epoch_ = h.epoch;
+    return true;
+}
+
+int logfollower::handshake() {
+    uint32_t which = logindex_;
+    if (safe_write(fd_, &which, sizeof(which)) != sizeof(which)
+        || !read_frame())
+        return -1;
+    return nlogs_;
+}
+
+void logfollower::start(threadinfo* ti) {
+    ti_ = ti;
+    int r = pthread_create(&ti->pthread(), 0, trampoline, this);
+    always_assert(r == 0);
+}
+
+void logfollower::stop() {
+    shutdown(fd_, SHUT_RDWR);
+    int r = pthread_join(ti_->pthread(), 0);
+    always_assert(r == 0);
+}
+
+void* logfollower::trampoline(void* x) {
+    logfollower* f = reinterpret_cast<logfollower*>(x);
+    f->ti_->pthread() = pthread_self();
+    while (f->read_frame()) {
+        const char* end = f->apply(f->buf_, f->buf_ + f->len_);
+        if (!end)
+            break;
+        f->len_ -= end - f->buf_;
+        memmove(f->buf_, end, f->len_);
+    }
+    fprintf(stderr, "follow log %d: disconnected at epoch %" PRIu64
+            ", leader epoch %" PRIu64 "\n", f->logindex_,
+            f->applied_epoch_.value(), f->leader_epoch_.value());
+    return 0;
+}
+
+// Apply the complete batches in [first, last). Returns the end of the last
+// one, or null if a batch fails its checksum.
+const char* logfollower::apply(const char* first, const char* last) {
+    const char* batch = first;
+    std::vector<lcdf::Json> jrepo;
+    for (const char* p = first; last - p >= ssize_t(sizeof(logrec_base)); ) {
+        const logrec_base* lr = reinterpret_cast<const logrec_base*>(p);
+        if (lr->size_ < sizeof(*lr) || p + lr->size_ > last)
+            break;
+        if (lr->command_ == logcmd_checksum) {
+            const logrec_checksum* lc =
+                reinterpret_cast<const logrec_checksum*>(p);
+            if (lc->size_ < sizeof(*lc)
+                || lc->length_ != size_t(p - batch)
+                || lc->crc_ != crc32c(batch, lc->length_)) {
+                fprintf(stderr, "follow log %d: bad batch checksum\n",
+                        logindex_);
+                return 0;
+            }
+            ti_->rcu_start();
+            apply_batch(batch, p, jrepo);
+            ti_->rcu_stop();
+            batch = p + lc->size_;
+        }
+        p += lr->size_;
+    }
+    return batch;
+}
+
+void logfollower::apply_batch(const char* first, const char* last,
+                              std::vector<lcdf::Json>& jrepo) {
+    std::vector<char> raw;
+    const logrec_compressed* lc =
+        reinterpret_cast<const logrec_compressed*>(first);
+    if (last - first >= ssize_t(sizeof(*lc))
+        && lc->command_ == logcmd_compressed) {
+        raw.resize(lc->rawlen_);
+        always_assert(lz_decompress(lc->buf_, lc->size_ - sizeof(*lc),
+                                    raw.data(), lc->rawlen_));
+        first = raw.data();
+        last = first + raw.size();
+    }
+
+    logrecord lr;
+    kvepoch_t epoch = applied_epoch_;
+    while (first < last) {
+        const char* next = lr.extract(first, last);
+        if (lr.command == logcmd_epoch)
+            epoch = lr.epoch;
+        else if ((lr.command == logcmd_put
+                  || lr.command == logcmd_replace
+                  || lr.command == logcmd_modify
+                  || lr.command == logcmd_remove)
+                 && lr.key.len)
+            lr.run(tree->table(), jrepo, *ti_);
+        first = next;
+    }
+    applied_epoch_ = epoch;
+}
@@ -20,21 +20,44 @@
 #include "kvproto.hh"
 #include "str.hh"
 #include <pthread.h>
+#include <deque>
+#include <vector>
 class logset;
+class logbuffer;
+class logwriter;
 using lcdf::Str;
 namespace lcdf { class Json; }
 
+// One file of a log. A log is a series of segments, oldest first; the
+// first is named for the log, and the rest add ".<seq>". Each segment
+// starts with an epoch record.
+struct logsegment {
+    lcdf::String filename;
+    uint64_t seq;
+    kvepoch_t first_epoch;      // 0 until known
+};
+
 // in-memory log.
-// more than one, to reduce contention on the lock.
+// more than one, to reduce the number of log files; each drains the
+// logbuffers of several workers.
 class loginfo {
   public:
     void initialize(const lcdf::String& logfile);
-
-    inline void acquire();
-    inline void release();
+    logbuffer* make_buffer();
 
     inline kvepoch_t flushed_epoch() const;
     inline bool quiescent() const;
+    inline const logwriter* writer() const;
+
+    // A checkpoint starting at min_epoch is committed: delete segments
+    // that recovery will no longer need.
+    inline void trim(kvepoch_t min_epoch);
+
+    // Send a follower on socket fd the segments on disk, then every
+    // batch this log writes (see logfollower). Takes ownership of fd.
+    void add_follower(int fd);
+    inline unsigned followers() const;
+    inline uint64_t shipped_bytes() const;
 
     // logging
     struct query_times {
@@ -42,20 +65,30 @@ class loginfo {
         kvtimestamp_t ts;
         kvtimestamp_t prev_ts;
     };
-    // NB may block!
-    void record(int command, const query_times& qt, Str key, Str value);
-    void record(int command, const query_times& qt, Str key,
-                const lcdf::Json* req, const lcdf::Json* end_req);
 
   private:
-    struct waitlist {
-        waitlist* next;
+    enum { flusher_awake = 0, flusher_idle = 1, flusher_batching = 2 };
+    // Logger state that other threads touch only occasionally.
+    struct side_state {
+        std::deque<logsegment> segments;
+        uint64_t trim_epoch;    // set by trim()
+        pthread_mutex_t follower_mu;
+        std::vector<int> new_followers; // set by add_follower()
+        volatile bool follower_pending;
+        std::vector<int> followers;
+        unsigned nfollowers;    // followers.size(), for other threads
+        uint64_t shipped;
     };
     struct front {
-        uint32_t lock_;
-        waitlist* waiting_;
+        uint32_t flusher_seq_;  // futex: bumped to wake the flusher
+        uint32_t flusher_state_;
+        uint32_t writer_seq_;   // futex: bumped to wake stalled writers
+        uint32_t stalled_;      // number of stalled writers
+        logbuffer* buffers_;
         lcdf::String::rep_type filename_;
         logset* logset_;
+        logwriter* writer_;
+        side_state* side_;
     };
     struct logset_info {
         int32_t size_;
@@ -83,6 +116,7 @@ class loginfo {
             // When a log wakes up from quiescence, it sets global_wake_epoch;
             // other threads must record a logcmd_wake in their logs.
             // Invariant: log_epoch_ != quiescent_epoch_ (unless both are 0).
+            // Only the logger thread changes these.
 
             threadinfo *ti_;
             int logindex_;
@@ -97,8 +131,76 @@ class loginfo {
     ~loginfo();
     void* run();
     static void* trampoline(void*);
+    bool writers_busy() const;
+    uint64_t max_buffered() const;
+    void gather(kvepoch_t bound);
+    void append_epoch(kvepoch_t epoch);
+    void wait_for_records(uint32_t state, const struct timeval& timeout);
+    void wake_flusher(uint32_t state);
+    bool segment_full() const;
+    void rotate();
+    void trim_segments(kvepoch_t min_epoch);
+    void attach_followers();
+    void ship(const char* buf, uint32_t len);
 
     friend class logset;
+    friend class logbuffer;
+};
+
+// Per-worker log buffer. The owning worker appends records without
+// locking; its loginfo's logger thread drains them in epoch order.
+class logbuffer {
+  public:
+    // Call before applying a logged update. Returns the epoch the update
+    // must be recorded with, and holds back the logger from writing
+    // later epochs until the matching record() call. Several updates
+    // recorded together by record_batch() all get the first's epoch.
+    inline kvepoch_t start_update();
+
+    // Can an update to key, setting value or the columns in [req,
+    // end_req), be recorded? A record may fill at most half the buffer;
+    // callers refuse larger updates before applying them.
+    static bool fits(Str key, Str value);
+    static bool fits(Str key, const lcdf::Json* req, const lcdf::Json* end_req);
+
+    // NB may block!
+    void record(int command, const loginfo::query_times& qt, Str key, Str value);
+    void record(int command, const loginfo::query_times& qt, Str key,
+                const lcdf::Json* req, const lcdf::Json* end_req);
+    // Record the key/value pairs in [req, end_req), pair i with query
+    // times qt[i], in as few reservations as fit. Each pair must fit().
+    void record_batch(int command, const loginfo::query_times* qt,
+                      const lcdf::Json* req, const lcdf::Json* end_req);
+
+  private:
+    enum { size = 8 << 20 };
+    struct worker_part {
+        uint64_t tail_;             // records published up to here
+        kvepoch_t active_epoch_;    // epoch of update in progress, or 0
+        kvepoch_t log_epoch_;       // last epoch recorded in buf_
+        char* buf_;
+        loginfo* log_;
+        logbuffer* next_;
+    };
+    // The logger thread alone changes the rest.
+    struct logger_part {
+        uint64_t head_;             // records consumed up to here
+        kvepoch_t head_epoch_;      // epoch of the record at head_
+        uint64_t scan_;             // gather() state
+        uint64_t scan_end_;
+        kvepoch_t scan_epoch_;
+    };
+
+    worker_part w_;
+    char padding1_[CACHE_LINE_SIZE - sizeof(worker_part)];
+    logger_part l_;
+
+    logbuffer(loginfo* log);
+    uint64_t reserve(size_t n);
+    void publish(uint64_t tail, bool done = true);
+    const char* scan_record();
+
+    friend class loginfo;
 };
 
 class logset {
@@ -117,6 +219,22 @@ class logset {
 extern kvepoch_t global_log_epoch;
 extern kvepoch_t global_wake_epoch;
 extern struct timeval log_epoch_interval;
+extern struct timeval log_flush_interval;
+extern int log_buffers;
+extern int log_replay_threads;
+// Recovery helper threads (log replay and checkpoint loading) borrow
+// TI_REPLAY threadinfos with replay_helper_get(). A helper calls
+// replay_helper_finish() before it exits, to free what it left in RCU
+// limbo; whoever joins it returns the threadinfo with replay_helper_put().
+threadinfo* replay_helper_get();
+void replay_helper_finish(threadinfo* ti);
+void replay_helper_put(threadinfo* ti);
+extern uint64_t log_segment_size;
+extern unsigned log_segment_epochs;
+// If set, called with each record's key before replay applies it, so the
+// key's checkpoint row can be loaded first.
+extern void (*logreplay_fault_in)(Str key, threadinfo& ti);
+extern bool log_compress;
 
 enum logcommand {
     logcmd_none = 0,
@@ -126,7 +244,11 @@ enum logcommand {
     logcmd_remove = 0x4D45526B,         // "kREM"
     logcmd_epoch = 0x4F50456B,          // "kEPO"
     logcmd_quiesce = 0x4955516B,        // "kQUI"
-    logcmd_wake = 0x4B41576B            // "kWAK"
+    logcmd_wake = 0x4B41576B,           // "kWAK"
+    logcmd_checksum = 0x4B48436B,       // "kCHK": CRC32C of the batch it ends
+    logcmd_put_columns = 0x4354506B,    // "kPTC": kPUT, value is a column list
+    logcmd_modify_columns = 0x43444D6B, // "kMDC": kMOD, value is a column list
+    logcmd_compressed = 0x425A4C6B      // "kLZB": the records of a batch, compressed
 };
 
 
@@ -146,20 +268,74 @@ class logreplay {
     info_type info() const;
     kvepoch_t min_post_quiescent_wake_epoch(kvepoch_t quiescent_epoch) const;
 
-    void replay(int i, threadinfo *ti);
+    // Replay the segments of log i, oldest first. Deletes segments that
+    // recovery no longer needs and sets the rest's first_epoch.
+    static void replay(std::deque<logsegment>& segments, int i,
+                       threadinfo *ti);
 
   private:
     lcdf::String filename_;
     int errno_;
     off_t size_;
     char *buf_;
-
+    const char *end_;           // end of intact records
+    bool inflated_;             // buf_ is a malloced copy, not the file
+
+    struct replay_part;
+    struct inflate_part;
+    const char *check() const;
+    void inflate();
+    static void *inflate_trampoline(void *x);
     uint64_t replayandclean1(kvepoch_t min_epoch, kvepoch_t max_epoch,
-                             threadinfo *ti);
+                             bool &started, bool &finished, threadinfo *ti);
+    static void *replay_trampoline(void *x);
+    uint64_t replay_range(const char *first, const char *last,
+                          kvepoch_t min_epoch, unsigned part, unsigned nparts,
+                          threadinfo *ti) const;
     int replay_truncate(size_t len);
     int replay_copy(const char *tmpname, const char *first, const char *last);
 };
 
+// Applies the batches a leader's loginfo ships for one of its logs, on
+// its own thread, while this process serves reads. Updates are applied
+// as recovery applies them, ordered by timestamp, so the followers of
+// different logs need not coordinate.
+class logfollower {
+  public:
+    logfollower(int fd, int logindex);
+    ~logfollower();
+
+    // Ask for our log and wait for the leader's first frame. Returns the
+    // leader's number of logs, or -1 on error.
+    int handshake();
+    void start(threadinfo* ti);
+    // Disconnect, apply the complete batches received, and join.
+    void stop();
+
+    inline int logindex() const;
+    inline kvepoch_t applied_epoch() const;
+    inline kvepoch_t leader_epoch() const;
+    inline uint64_t bytes() const;
+
+  private:
+    int fd_;
+    int logindex_;
+    threadinfo* ti_;
+    char* buf_;                 // received, not yet applied
+    size_t len_;
+    size_t cap_;
+    kvepoch_t applied_epoch_;   // all batches through this epoch applied
+    kvepoch_t leader_epoch_;    // latest epoch the leader has logged
+    uint64_t bytes_;
+    int nlogs_;
+
+    bool read_frame();
+    const char* apply(const char* first, const char* last);
+    void apply_batch(const char* first, const char* last,
+                     std::vector<lcdf::Json>& jrepo);
+    static void* trampoline(void* x);
+};
+
 enum { REC_NONE, REC_CKP, REC_LOG_TS, REC_LOG_ANALYZE_WAKE,
        REC_LOG_REPLAY, REC_DONE };
 extern void recphase(int nactive, int state);
@@ -174,22 +350,67 @@ extern kvepoch_t rec_replay_max_epoch;
 extern kvepoch_t rec_replay_min_quiescent_last_epoch;
 
 
-inline void loginfo::acquire() {
-    test_and_set_acquire(&f_.lock_);
-}
-
-inline void loginfo::release() {
-    test_and_set_release(&f_.lock_);
-}
-
 inline kvepoch_t loginfo::flushed_epoch() const {
     return flushed_epoch_;
 }
 
 inline bool loginfo::quiescent() const {
+    // Check the buffers first: the logger clears quiescent_epoch_ before
+    // consuming buffered records.
+    if (writers_busy())
+        return false;
+    acquire_fence();
     return quiescent_epoch_ && quiescent_epoch_ == flushed_epoch_;
 }
 
+inline const logwriter* loginfo::writer() const {
+    return f_.writer_;
+}
+
+inline void loginfo::trim(kvepoch_t min_epoch) {
+    f_.side_->trim_epoch = min_epoch.value();
+}
+
+inline unsigned loginfo::followers() const {
+    return f_.side_->nfollowers;
+}
+
+inline uint64_t loginfo::shipped_bytes() const {
+    return f_.side_->shipped;
+}
+
+inline int logfollower::logindex() const {
+    return logindex_;
+}
+
+inline kvepoch_t logfollower::applied_epoch() const {
+    return applied_epoch_;
+}
+
+inline kvepoch_t logfollower::leader_epoch() const {
+    return leader_epoch_;
+}
+
+inline uint64_t logfollower::bytes() const {
+    return bytes_;
+}
+
+inline kvepoch_t logbuffer::start_update() {
+    if (w_.active_epoch_)
+        return w_.active_epoch_;
+    // Announce, then recheck. The logger reads global_log_epoch, then
+    // the announcements; either it sees ours, or we see its epoch.
+    kvepoch_t e = global_log_epoch;
+    while (1) {
+        w_.active_epoch_ = e;
+        memory_fence();
+        kvepoch_t ge = global_log_epoch;
+        if (ge == e)
+            return e;
+        e = ge;
+    }
+}
+
 inline int logset::size() const {
     return li_[-1].lsi_.size_;
 }
@@ -217,7 +438,8 @@ inline bool row_is_delta_marker(const R* row) {
     if (row_is_marker(row)) {
         const row_marker* m =
             reinterpret_cast<const row_marker *>(row->col(0).s);
-        return m->marker_type_ == m->mt_delta;
+        return m->marker_type_ == m->mt_delta
+            || m->marker_type_ == m->mt_delta_columns;
     } else
         return false;
 }
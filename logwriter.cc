@@ -0,0 +1,310 @@
+/* Masstree
+ * Eddie Kohler, Yandong Mao, Robert Morris
+ * Copyright (c) 2012-2014 President and Fellows of Harvard College
+ * Copyright (c) 2012-2014 Massachusetts Institute of Technology
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, subject to the conditions
+ * listed in the Masstree LICENSE file. These conditions include: you must
+ * preserve this copyright notice, and you cannot mention the copyright
+ * holders in advertising related to the Software without their permission.
+ * The Software is provided WITHOUT ANY WARRANTY, EXPRESS OR IMPLIED. This
+ * notice is a summary of the Masstree LICENSE file; the license in that file
+ * is legally binding.
+ */
+#include "logwriter.hh"
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#if HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+// preallocate the log file this much at a time
+static const off_t log_allocation_chunk = 64 << 20;
+
+#if HAVE_LINUX_IO_URING_H
+// A minimal io_uring: just enough for linked write/fdatasync pairs.
+struct logwriter::ring {
+    int fd;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    io_uring_cqe* cqes;
+    void* sq_map;
+    size_t sq_map_size;
+    void* cq_map;
+    size_t cq_map_size;
+    size_t sqes_size;
+    unsigned to_submit;
+
+    static ring* make(unsigned entries);
+    ~ring();
+    io_uring_sqe* next_sqe();
+    int enter(unsigned min_complete);
+};
+
+logwriter::ring* logwriter::ring::make(unsigned entries) {
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0)
+        return 0;
+
+    ring* r = new ring;
+    r->fd = fd;
+    r->to_submit = 0;
+    r->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        r->sq_map_size = r->cq_map_size = std::max(r->sq_map_size, r->cq_map_size);
+    r->sq_map = mmap(0, r->sq_map_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        r->cq_map = r->sq_map;
+    else
+        r->cq_map = mmap(0, r->cq_map_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    r->sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+    r->sqes = (io_uring_sqe*) mmap(0, r->sqes_size, PROT_READ | PROT_WRITE,
+                                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (r->sq_map == MAP_FAILED || r->cq_map == MAP_FAILED
+        || r->sqes == MAP_FAILED) {
+        perror("io_uring mmap");
+        abort();
+    }
+
+    char* sq = (char*) r->sq_map;
+    r->sq_head = (unsigned*) (sq + p.sq_off.head);
+    r->sq_tail = (unsigned*) (sq + p.sq_off.tail);
+    r->sq_mask = (unsigned*) (sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*) (sq + p.sq_off.array);
+    char* cq = (char*) r->cq_map;
+    r->cq_head = (unsigned*) (cq + p.cq_off.head);
+    r->cq_tail = (unsigned*) (cq + p.cq_off.tail);
+    r->cq_mask = (unsigned*) (cq + p.cq_off.ring_mask);
+    r->cqes = (io_uring_cqe*) (cq + p.cq_off.cqes);
+    return r;
+}
+
+logwriter::ring::~ring() {
+    munmap(sqes, sqes_size);
+    if (cq_map != sq_map)
+        munmap(cq_map, cq_map_size);
+    munmap(sq_map, sq_map_size);
+    close(fd);
+}
+
+// The caller never has more entries outstanding than the ring holds.
+io_uring_sqe* logwriter::ring::next_sqe() {
+    unsigned tail = *sq_tail;
+    unsigned index = tail & *sq_mask;
+    io_uring_sqe* sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array[index] = index;
+    release_fence();
+    *(volatile unsigned*) sq_tail = tail + 1;
+    ++to_submit;
+    return sqe;
+}
+
+int logwriter::ring::enter(unsigned min_complete) {
+    unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+    while (1) {
+        int r = syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, 0, 0);
+        if (r >= 0) {
+            to_submit -= std::min(unsigned(r), to_submit);
+            if (!to_submit || min_complete)
+                return r;
+        } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            return r;
+        // a raw syscall is not a cancellation point
+        pthread_testcancel();
+    }
+}
+#else
+struct logwriter::ring {
+};
+#endif
+
+
+logwriter::logwriter(int fd, size_t buflen, int nbuf)
+    : fd_(fd), can_allocate_(true), batches_(nbuf), head_(0), tail_(0),
+      nbytes_(0), ring_(0) {
+    always_assert(nbuf >= 2);
+    for (int i = 1; i != nbuf; ++i) {
+        char* buf = (char*) malloc(buflen);
+        always_assert(buf);
+        free_.push_back(buf);
+    }
+
+    off_ = lseek(fd, 0, SEEK_END);
+    always_assert(off_ >= 0);
+    alloc_end_ = off_;
+
+#if HAVE_LINUX_IO_URING_H
+    // Two entries (write and fdatasync) per buffer in flight.
+    unsigned entries = 1;
+    while (entries < 2 * unsigned(nbuf))
+        entries *= 2;
+    ring_ = ring::make(entries);
+#endif
+}
+
+void logwriter::reopen(int fd) {
+    assert(!busy());
+    close(fd_);
+    fd_ = fd;
+    off_ = lseek(fd, 0, SEEK_END);
+    always_assert(off_ >= 0);
+    alloc_end_ = off_;
+    can_allocate_ = true;
+}
+
+logwriter::~logwriter() {
+    // NB buffers still in flight are leaked
+    for (auto buf : free_)
+        free(buf);
+    delete ring_;
+}
+
+void logwriter::preallocate(uint32_t len) {
+#if HAVE_FALLOCATE
+    if (can_allocate_ && off_ + off_t(len) > alloc_end_) {
+        off_t n = std::max(log_allocation_chunk, off_t(len));
+        if (fallocate(fd_, FALLOC_FL_KEEP_SIZE, alloc_end_, n) == 0)
+            alloc_end_ += n;
+        else
+            can_allocate_ = false;
+    }
+#else
+    (void) len;
+#endif
+}
+
+void logwriter::write(char* buf, uint32_t len, kvepoch_t epoch) {
+    assert(tail_ - head_ < batches_.size());
+    preallocate(len);
+    batch& b = batches_[tail_ % batches_.size()];
+    b.buf = buf;
+    b.len = len;
+    b.done = 0;
+    b.off = off_;
+    b.epoch = epoch;
+    uint64_t seq = tail_;
+    ++tail_;
+    off_ += len;
+    nbytes_ += len;
+
+#if HAVE_LINUX_IO_URING_H
+    if (ring_) {
+        b.pending = 0;
+        submit(seq);
+        return;
+    }
+#endif
+
+    while (b.done != len) {
+        ssize_t r = pwrite(fd_, buf + b.done, len - b.done, b.off + b.done);
+        if (r < 0 && errno != EINTR) {
+            perror("log write");
+            abort();
+        } else if (r > 0)
+            b.done += r;
+    }
+    fsync(fd_);
+    b.pending = 0;
+    (void) seq;
+}
+
+// Write the unwritten part of batch seq, linked to an fdatasync.
+void logwriter::submit(uint64_t seq) {
+#if HAVE_LINUX_IO_URING_H
+    batch& b = batches_[seq % batches_.size()];
+    b.pending += 2;
+    io_uring_sqe* sqe = ring_->next_sqe();
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->fd = fd_;
+    sqe->addr = (uintptr_t) (b.buf + b.done);
+    sqe->len = b.len - b.done;
+    sqe->off = b.off + b.done;
+    sqe->user_data = seq * 2;
+    sqe = ring_->next_sqe();
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fd = fd_;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    sqe->user_data = seq * 2 + 1;
+    int r = ring_->enter(0);
+    always_assert(r >= 0);
+#else
+    (void) seq;
+#endif
+}
+
+// A short write cancels its linked fdatasync (a failed one aborts), so
+// it resubmits the rest of the batch with a fresh fdatasync.
+void logwriter::complete(uint64_t user_data, int res) {
+    uint64_t seq = user_data / 2;
+    batch& b = batches_[seq % batches_.size()];
+    if (user_data % 2 == 0 && res < 0) {
+        fprintf(stderr, "log write: %s\n", strerror(-res));
+        abort();
+    } else if (user_data % 2 == 0 && b.done + res != b.len) {
+        b.done += res;
+        submit(seq);
+    } else if (user_data % 2 == 0)
+        b.done = b.len;
+    else if (res != 0 && res != -ECANCELED) {
+        fprintf(stderr, "log fdatasync: %s\n", strerror(-res));
+        abort();
+    }
+    --b.pending;
+}
+
+bool logwriter::reap(bool block, kvepoch_t& epoch) {
+#if HAVE_LINUX_IO_URING_H
+    if (ring_ && busy()) {
+        if (block && batches_[head_ % batches_.size()].pending) {
+            int r = ring_->enter(1);
+            always_assert(r >= 0);
+        }
+        unsigned head = *ring_->cq_head;
+        unsigned tail = *(volatile unsigned*) ring_->cq_tail;
+        acquire_fence();
+        for (; head != tail; ++head) {
+            io_uring_cqe* cqe = &ring_->cqes[head & *ring_->cq_mask];
+            complete(cqe->user_data, cqe->res);
+        }
+        release_fence();
+        *(volatile unsigned*) ring_->cq_head = head;
+    }
+#else
+    (void) block;
+#endif
+
+    bool advanced = false;
+    while (head_ != tail_ && !batches_[head_ % batches_.size()].pending) {
+        batch& b = batches_[head_ % batches_.size()];
+        free_.push_back(b.buf);
+        epoch = b.epoch;
+        advanced = true;
+        ++head_;
+    }
+    return advanced;
+}
@@ -0,0 +1,116 @@
+/* Masstree
+ * Eddie Kohler, Yandong Mao, Robert Morris
+ * Copyright (c) 2012-2014 President and Fellows of Harvard College
+ * Copyright (c) 2012-2014 Massachusetts Institute of Technology
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, subject to the conditions
+ * listed in the Masstree LICENSE file. These conditions include: you must
+ * preserve this copyright notice, and you cannot mention the copyright
+ * holders in advertising related to the Software without their permission.
+ * The Software is provided WITHOUT ANY WARRANTY, EXPRESS OR IMPLIED. This
+ * notice is a summary of the Masstree LICENSE file; the license in that file
+ * is legally binding.
+ */
+#ifndef MASSTREE_LOGWRITER_HH
+#define MASSTREE_LOGWRITER_HH
+#include "compiler.hh"
+#include "circular_int.hh"
+#include <vector>
+#include <assert.h>
+#include <sys/types.h>
+
+// Appends log batches to a file, keeping several batches in flight.
+//
+// On Linux with io_uring, each batch is an IORING_OP_WRITE at an explicit
+// offset linked to an fdatasync, and a short write resubmits the rest;
+// otherwise batches are written and synced synchronously. Either way a batch is durable only once it and every
+// earlier batch have been synced, so reap() reports the epoch of the
+// longest durable prefix. The file is preallocated in large chunks.
+class logwriter {
+  public:
+    logwriter(int fd, size_t buflen, int nbuf);
+    ~logwriter();
+
+    inline bool async() const;
+    inline bool full() const;
+    inline bool busy() const;
+
+    // Return a free buffer of buflen bytes. Requires !full().
+    inline char* take_buffer();
+    // Start writing len bytes of buf, which must have come from
+    // take_buffer() (or the caller's original buffer). epoch is the
+    // log epoch the batch ends in.
+    void write(char* buf, uint32_t len, kvepoch_t epoch);
+    // Collect finished batches, waiting for at least one if block is
+    // true and batches are in flight. Returns true and sets epoch if the
+    // durable prefix advanced.
+    bool reap(bool block, kvepoch_t& epoch);
+    // Close the file and continue at the end of fd. Requires !busy().
+    void reopen(int fd);
+
+    inline off_t offset() const;
+
+    inline uint64_t bytes() const;
+    inline uint64_t batches() const;
+
+  private:
+    struct batch {
+        char* buf;
+        uint32_t len;
+        uint32_t done;          // bytes written so far
+        off_t off;
+        int pending;
+        kvepoch_t epoch;
+    };
+    struct ring;
+
+    int fd_;
+    off_t off_;
+    off_t alloc_end_;
+    bool can_allocate_;
+    std::vector<char*> free_;
+    std::vector<batch> batches_;
+    uint64_t head_;             // oldest unsynced batch
+    uint64_t tail_;             // next batch to write
+    uint64_t nbytes_;
+    ring* ring_;
+
+    void preallocate(uint32_t len);
+    void submit(uint64_t seq);
+    void complete(uint64_t user_data, int res);
+};
+
+inline bool logwriter::async() const {
+    return ring_ != 0;
+}
+
+inline bool logwriter::full() const {
+    return free_.empty();
+}
+
+inline bool logwriter::busy() const {
+    return head_ != tail_;
+}
+
+inline char* logwriter::take_buffer() {
+    assert(!free_.empty());
+    char* buf = free_.back();
+    free_.pop_back();
+    return buf;
+}
+
+inline off_t logwriter::offset() const {
+    return off_;
+}
+
+inline uint64_t logwriter::bytes() const {
+    return nbytes_;
+}
+
+inline uint64_t logwriter::batches() const {
+    return head_;
+}
+
+#endif
@@ -0,0 +1,155 @@
+/* Masstree
+ * Eddie Kohler, Yandong Mao, Robert Morris
+ * Copyright (c) 2012-2014 President and Fellows of Harvard College
+ * Copyright (c) 2012-2014 Massachusetts Institute of Technology
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, subject to the conditions
+ * listed in the Masstree LICENSE file. These conditions include: you must
+ * preserve this copyright notice, and you cannot mention the copyright
+ * holders in advertising related to the Software without their permission.
+ * The Software is provided WITHOUT ANY WARRANTY, EXPRESS OR IMPLIED. This
+ * notice is a summary of the Masstree LICENSE file; the license in that file
+ * is legally binding.
+ */
+#include "lz.hh"
+#include <string.h>
+
+namespace {
+enum { hash_bits = 14, min_match = 4, max_offset = 65535,
+       // like LZ4, end every block with literals, so matches never
+       // reach the last few bytes
+       last_literals = 5, match_limit = 12 };
+
+inline uint32_t read32(const unsigned char* p) {
+    uint32_t x;
+    memcpy(&x, p, 4);
+    return x;
+}
+
+inline unsigned hash(uint32_t x) {
+    return (x * 2654435761U) >> (32 - hash_bits);
+}
+
+inline unsigned char* store_length(unsigned char* op, size_t len) {
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = len;
+    return op;
+}
+
+unsigned char* store_sequence(unsigned char* op, const unsigned char* lit,
+                              size_t nlit, size_t offset, size_t mlen) {
+    unsigned char* token = op++;
+    *token = (nlit < 15 ? nlit : 15) << 4;
+    if (nlit >= 15)
+        op = store_length(op, nlit - 15);
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (mlen) {
+        *op++ = offset;
+        *op++ = offset >> 8;
+        mlen -= min_match;
+        *token |= mlen < 15 ? mlen : 15;
+        if (mlen >= 15)
+            op = store_length(op, mlen - 15);
+    }
+    return op;
+}
+
+inline const unsigned char* parse_length(const unsigned char* ip,
+                                         const unsigned char* end,
+                                         size_t& len) {
+    unsigned char c;
+    do {
+        if (ip == end)
+            return 0;
+        c = *ip++;
+        len += c;
+    } while (c == 255);
+    return ip;
+}
+}
+
+size_t lz_compress(const void* src, size_t len, void* dst) {
+    const unsigned char* base = reinterpret_cast<const unsigned char*>(src);
+    const unsigned char* end = base + len;
+    const unsigned char* ip = base;
+    const unsigned char* anchor = base;
+    unsigned char* op = reinterpret_cast<unsigned char*>(dst);
+
+    if (len > match_limit) {
+        uint32_t table[1 << hash_bits];
+        memset(table, 0, sizeof(table));
+        const unsigned char* mflimit = end - match_limit;
+        const unsigned char* mlimit = end - last_literals;
+        unsigned misses = 0;
+        while (ip < mflimit) {
+            uint32_t seq = read32(ip);
+            unsigned h = hash(seq);
+            const unsigned char* ref = base + table[h];
+            table[h] = ip - base;
+            if (ref >= ip || ip - ref > max_offset || read32(ref) != seq) {
+                // skip faster through incompressible data
+                ip += 1 + (misses++ >> 6);
+                continue;
+            }
+            misses = 0;
+            while (ip > anchor && ref > base && ip[-1] == ref[-1])
+                --ip, --ref;
+            const unsigned char* mp = ip + min_match;
+            const unsigned char* mr = ref + min_match;
+            while (mp < mlimit && *mp == *mr)
+                ++mp, ++mr;
+            op = store_sequence(op, anchor, ip - anchor, ip - ref, mp - ip);
+            ip = anchor = mp;
+        }
+    }
+
+    op = store_sequence(op, anchor, end - anchor, 0, 0);
+    return op - reinterpret_cast<unsigned char*>(dst);
+}
+
+bool lz_decompress(const void* src, size_t len, void* dst, size_t rawlen) {
+    const unsigned char* ip = reinterpret_cast<const unsigned char*>(src);
+    const unsigned char* iend = ip + len;
+    unsigned char* obase = reinterpret_cast<unsigned char*>(dst);
+    unsigned char* op = obase;
+    unsigned char* oend = obase + rawlen;
+
+    while (ip != iend) {
+        unsigned token = *ip++;
+        size_t nlit = token >> 4;
+        if (nlit == 15 && !(ip = parse_length(ip, iend, nlit)))
+            return false;
+        if (nlit > size_t(iend - ip) || nlit > size_t(oend - op))
+            return false;
+        memcpy(op, ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if (ip == iend)             // the last sequence has no match
+            break;
+
+        if (iend - ip < 2)
+            return false;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        size_t mlen = token & 15;
+        if (mlen == 15 && !(ip = parse_length(ip, iend, mlen)))
+            return false;
+        mlen += min_match;
+        if (offset == 0 || offset > size_t(op - obase)
+            || mlen > size_t(oend - op))
+            return false;
+        const unsigned char* ref = op - offset;
+        if (offset >= mlen)
+            memcpy(op, ref, mlen);
+        else
+            // overlapping match: repeats the last offset bytes
+            for (size_t i = 0; i != mlen; ++i)
+                op[i] = ref[i];
+        op += mlen;
+    }
+    return op == oend;
+}
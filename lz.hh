@@ -0,0 +1,39 @@
+/* Masstree
+ * Eddie Kohler, Yandong Mao, Robert Morris
+ * Copyright (c) 2012-2014 President and Fellows of Harvard College
+ * Copyright (c) 2012-2014 Massachusetts Institute of Technology
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, subject to the conditions
+ * listed in the Masstree LICENSE file. These conditions include: you must
+ * preserve this copyright notice, and you cannot mention the copyright
+ * holders in advertising related to the Software without their permission.
+ * The Software is provided WITHOUT ANY WARRANTY, EXPRESS OR IMPLIED. This
+ * notice is a summary of the Masstree LICENSE file; the license in that file
+ * is legally binding.
+ */
+#ifndef MASSTREE_LZ_HH
+#define MASSTREE_LZ_HH
+#include <stddef.h>
+#include <stdint.h>
+
+// A small LZ77 block compressor in the style of LZ4: each sequence is a
+// token byte (literal count, match length), the literals, and a 16-bit
+// match offset. Blocks are independent, so separate blocks can be
+// decompressed in parallel.
+
+// Most bytes lz_compress() can produce from len bytes.
+inline size_t lz_compress_bound(size_t len) {
+    return len + len / 255 + 16;
+}
+
+// Compress len bytes at src into dst, which must hold
+// lz_compress_bound(len) bytes. Returns the compressed length.
+size_t lz_compress(const void* src, size_t len, void* dst);
+
+// Decompress len bytes at src into exactly rawlen bytes at dst. Returns
+// false if the input is malformed or doesn't expand to rawlen bytes.
+bool lz_decompress(const void* src, size_t len, void* dst, size_t rawlen);
+
+#endif
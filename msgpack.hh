@@ -154,7 +154,7 @@ inline char* write_double(char* s, double x) {
     *s++ = ffloat64;
     return write_in_net_order<double>(s, x);
 }
-inline char* write_string(char* s, const char *data, int len) {
+inline char* write_string_header(char* s, uint32_t len) {
     if (len < nfixstr)
         *s++ = 0xA0 + len;
     else if (len < 256) {
@@ -167,6 +167,10 @@ inline char* write_string(char* s, const char *data, int len) {
         *s++ = fstr32;
         s = write_in_net_order<uint32_t>(s, len);
     }
+    return s;
+}
+inline char* write_string(char* s, const char *data, int len) {
+    s = write_string_header(s, len);
     memcpy(s, data, len);
     return s + len;
 }
@@ -321,6 +325,12 @@ class unparser {
         base_.set_end(format::write_array_header(s, size));
         return *this;
     }
+    // The caller supplies the len bytes of string data itself.
+    inline unparser<T>& write_string_header(uint32_t len) {
+        char* s = base_.reserve(5);
+        base_.set_end(format::write_string_header(s, len));
+        return *this;
+    }
     inline unparser<T>& operator<<(object_t x) {
         char* s = base_.reserve(5);
         base_.set_end(format::write_map_header(s, x.size));
@@ -332,6 +342,10 @@ class unparser {
         return *this << x;
     }
 
+    inline T& base() {
+        return base_;
+    }
+
   private:
     T& base_;
 };
@@ -23,6 +23,7 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <sys/un.h>
 #include <sys/select.h>
 #include <sys/wait.h>
 #include <assert.h>
@@ -128,6 +129,7 @@ void volt1b(struct child *);
 void volt2a(struct child *);
 void volt2b(struct child *);
 void scantest(struct child *);
+void multitest(struct child *);
 
 static int children = 1;
 static uint64_t nkeys = 0;
@@ -137,6 +139,8 @@ static uint64_t limit = ~uint64_t(0);
 double duration = 10;
 double duration2 = 0;
 int udpflag = 0;
+static const char* unix_path = NULL; // connect to mtd's --unix socket
+static bool ringflag = false;        // send requests over a kvring
 int quiet = 0;
 int first_server_port = 2117;
 // Should all child processes connects to the same UDP PORT on server
@@ -380,6 +384,13 @@ struct kvtest_client {
 #define TESTRUNNER_CLIENT_TYPE kvtest_client&
 #include "testrunner.hh"
 
+// The server's Cmd_Stats reply, reported as if it were a test result.
+static void stats(kvtest_client& client) {
+    const Json& result = client.child()->conn->stats();
+    always_assert(result && result[1] == Cmd_Stats + 1);
+    client.report(result[2]);
+}
+
 MAKE_TESTRUNNER(rw1, kvtest_rw1(client));
 MAKE_TESTRUNNER(rw2, kvtest_rw2(client));
 MAKE_TESTRUNNER(rw3, kvtest_rw3(client));
@@ -421,6 +432,8 @@ MAKE_TESTRUNNER(volt1b, volt1b(client.child()));
 MAKE_TESTRUNNER(volt2a, volt2a(client.child()));
 MAKE_TESTRUNNER(volt2b, volt2b(client.child()));
 MAKE_TESTRUNNER(scantest, scantest(client.child()));
+MAKE_TESTRUNNER(multitest, multitest(client.child()));
+MAKE_TESTRUNNER(stats, stats(client));
 MAKE_TESTRUNNER(wscale, kvtest_wscale(client));
 MAKE_TESTRUNNER(ruscale_init, kvtest_ruscale_init(client));
 MAKE_TESTRUNNER(rscale, kvtest_rscale(client));
@@ -437,7 +450,8 @@ usage()
 {
   fprintf(stderr, "Usage: mtclient [-s serverip] [-w window] [--udp] "\
           "[-j nchildren] [-d duration] [--ssp] [--flp first_local_port] "\
-          "[--fsp first_server_port] [-i json_input]\nTests:\n");
+          "[--fsp first_server_port] [--unix path] [--ring] "\
+          "[-i json_input]\nTests:\n");
   testrunner::print_names(stderr, 5);
   exit(1);
 }
@@ -459,7 +473,7 @@ enum { opt_threads = 1, opt_threads_deprecated, opt_duration, opt_duration2,
        opt_first_local_port, opt_share_server_port, opt_input,
        opt_rsinit_part, opt_first_seed, opt_rscale_partsz, opt_keylen,
        opt_limit, opt_prefix_len, opt_nkeys, opt_get_ratio, opt_minkeyletter,
-       opt_maxkeyletter, opt_nofork };
+       opt_maxkeyletter, opt_nofork, opt_unix, opt_ring };
 static const Clp_Option options[] = {
     { "threads", 'j', opt_threads, Clp_ValInt, 0 },
     { 0, 'n', opt_threads_deprecated, Clp_ValInt, 0 },
@@ -487,7 +501,9 @@ static const Clp_Option options[] = {
     { "getratio", 0, opt_get_ratio, Clp_ValInt, 0 },
     { "minkeyletter", 0, opt_minkeyletter, Clp_ValString, 0 },
     { "maxkeyletter", 0, opt_maxkeyletter, Clp_ValString, 0 },
-    { "no-fork", 0, opt_nofork, 0, 0 }
+    { "no-fork", 0, opt_nofork, 0, 0 },
+    { "unix", 0, opt_unix, Clp_ValString, 0 },
+    { "ring", 0, opt_ring, 0, Clp_Negate }
 };
 
 int
@@ -577,6 +593,12 @@ main(int argc, char *argv[])
       case opt_nofork:
           dofork = !clp->negated;
           break;
+      case opt_unix:
+          unix_path = clp->vstr;
+          break;
+      case opt_ring:
+          ringflag = !clp->negated;
+          break;
       case Clp_NotOption: {
           // check for parameter setting
           if (const char* eqchr = strchr(clp->vstr, '=')) {
@@ -602,13 +624,20 @@ main(int argc, char *argv[])
           break;
       }
   }
-  if(children < 1 || (children != 1 && !dofork))
+  if(children < 1 || (children != 1 && !dofork)
+     || (udpflag && (unix_path || ringflag)))
     usage();
   if (!test)
       test = testrunner::first();
+  if (test->name() == "stats") {
+      // just print the server's statistics, not a test report
+      run_child(test, 0);
+      exit(0);
+  }
 
-  printf("%s, w %d, test %s, children %d\n",
-         udpflag ? "udp" : "tcp", window,
+  printf("%s%s, w %d, test %s, children %d\n",
+         udpflag ? "udp" : (unix_path ? "unix" : "tcp"),
+         ringflag ? " ring" : "", window,
          test->name().c_str(), children);
 
   fflush(stdout);
@@ -716,6 +745,24 @@ run_child(testrunner* test, int childno)
   bzero(&c, sizeof(c));
   c.childno = childno;
 
+  if (unix_path) {
+    struct sockaddr_un sun;
+    if (strlen(unix_path) >= sizeof(sun.sun_path)) {
+      fprintf(stderr, "%s: path too long\n", unix_path);
+      exit(1);
+    }
+    bzero(&sun, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, unix_path);
+    c.s = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(c.s >= 0);
+    ret = connect(c.s, (struct sockaddr *) &sun, sizeof(sun));
+    if (ret < 0) {
+      perror(unix_path);
+      exit(1);
+    }
+    goto connected;
+  }
   if(udpflag){
     c.udp = 1;
     c.s = socket(AF_INET, SOCK_DGRAM, 0);
@@ -749,7 +796,8 @@ run_child(testrunner* test, int childno)
     exit(1);
   }
 
-  c.conn = new KVConn(c.s, !udpflag);
+connected:
+  c.conn = new KVConn(c.s, !udpflag, ringflag);
   kvtest_client client(c);
 
   test->run(client);
@@ -772,6 +820,14 @@ void KVConn::hard_check(int tryhard) {
         inbuf_ = new char[inbufsz];
         inbufpos_ = inbuflen_ = 0;
     }
+    if (out_->ring) {
+        if (tryhard != 1)
+            kvflush(out_);
+        inbuflen_ += kvring_receive(&ring_->responses, infd_,
+                                    inbuf_ + inbufpos_, inbufsz - inbufpos_,
+                                    tryhard != 1);
+        return;
+    }
     if (tryhard == 1) {
         fd_set rfds;
         FD_ZERO(&rfds);
@@ -1722,3 +1778,84 @@ scantest(struct child *c)
   fprintf(stderr, "scantest OK\n");
   printf("0\n");
 }
+
+// Send one Cmd_MultiPut of keys[first, first + n) and check its results.
+static void
+multiput_check(struct child *c, const std::vector<String>& keys,
+               const std::vector<String>& vals, int first, int n, int wanted)
+{
+  std::vector<Str> k, v;
+  for (int i = first; i < first + n; i++) {
+      k.push_back(keys[i]);
+      v.push_back(vals[i]);
+  }
+  c->conn->sendmultiput(k, v, 1);
+  c->conn->flush();
+
+  const Json& result = c->conn->receive();
+  always_assert(result && result[0] == 1 && result[1] == Cmd_MultiPut + 1);
+  always_assert(result[2].is_a() && result[2].size() == n);
+  for (int i = 0; i < n; i++)
+      always_assert(result[2][i] == wanted
+                    || (wanted == Inserted && result[2][i] == Updated));
+}
+
+// Send one Cmd_MultiGet of every key, with a missing key after each, and
+// check it against single Gets and vals. Missing keys get null.
+static void
+multiget_check(struct child *c, const std::vector<String>& keys,
+               const std::vector<String>& vals)
+{
+  std::vector<Str> k;
+  std::vector<String> missing, single;
+  for (size_t i = 0; i < keys.size(); i++) {
+      char got[512];
+      int n = get(c, keys[i], got, sizeof(got));
+      always_assert(n >= 0 && vals[i].equals(got, n));
+      single.push_back(String(got, n));
+      missing.push_back(keys[i] + "-x");
+  }
+  for (size_t i = 0; i < keys.size(); i++) {
+      k.push_back(keys[i]);
+      k.push_back(missing[i]);
+  }
+  c->conn->sendmultiget(k, 1);
+  c->conn->flush();
+
+  const Json& result = c->conn->receive();
+  always_assert(result && result[0] == 1 && result[1] == Cmd_MultiGet + 1);
+  always_assert(result[2].is_a() && size_t(result[2].size()) == k.size());
+  for (size_t i = 0; i < keys.size(); i++) {
+      always_assert(result[2][2 * i].is_s()
+                    && result[2][2 * i].as_s() == single[i]);
+      always_assert(result[2][2 * i + 1].is_null());
+  }
+}
+
+// Batched requests: MultiPut keys in several requests, then check one
+// MultiGet of them, and of missing keys, against single Gets. Repeat
+// after overwriting half the keys.
+void
+multitest(struct child *c)
+{
+  std::vector<String> keys, vals;
+  for (int i = 0; i < 40; i++) {
+      char key[32], val[32];
+      sprintf(key, "m%d-%04d", c->childno, i);
+      sprintf(val, "v%04d", i);
+      keys.push_back(String(key));
+      vals.push_back(String(val));
+  }
+
+  for (int i = 0; i < 40; i += 10)
+      multiput_check(c, keys, vals, i, 10, Inserted);
+  multiget_check(c, keys, vals);
+
+  for (int i = 0; i < 20; i++)
+      vals[i] = vals[i] + "-2";
+  multiput_check(c, keys, vals, 0, 20, Updated);
+  multiget_check(c, keys, vals);
+
+  fprintf(stderr, "multitest OK\n");
+  printf("0\n");
+}
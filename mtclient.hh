@@ -32,7 +32,7 @@ class KVConn {
   public:
     KVConn(const char *server, int port, int target_core = -1)
         : inbuf_(new char[inbufsz]), inbufpos_(0), inbuflen_(0),
-          j_(Json::make_array()) {
+          j_(Json::make_array()), ring_() {
         struct hostent *ent = gethostbyname(server);
         always_assert(ent);
         int fd = socket(AF_INET, SOCK_STREAM, 0);
@@ -57,17 +57,24 @@ class KVConn {
         out_ = new_kvout(fd, 64*1024);
         handshake(target_core);
     }
-    KVConn(int fd, bool tcp)
+    // With ring, requests and responses go through a shared-memory
+    // kvring_region instead of fd, which must be a stream socket to an
+    // mtd on this host.
+    KVConn(int fd, bool tcp, bool ring = false)
         : inbuf_(new char[inbufsz]), inbufpos_(0), inbuflen_(0), infd_(fd),
-          j_(Json::make_array()) {
+          j_(Json::make_array()), ring_() {
         out_ = new_kvout(fd, 64*1024);
         fdtoclose_ = -1;
+        if (ring && !(ring_ = kvring_create(ringname_)))
+            exit(EXIT_FAILURE);
         if (tcp)
             handshake(-1);
     }
     ~KVConn() {
         if (fdtoclose_ >= 0)
             close(fdtoclose_);
+        if (ring_)
+            kvring_free(ring_);
         free_kvout(out_);
         delete[] inbuf_;
         for (auto x : oldinbuf_)
@@ -121,6 +128,26 @@ class KVConn {
         j_[2] = String::make_stable(key);
         send();
     }
+    void sendmultiget(const std::vector<Str>& keys, unsigned seq) {
+        j_.resize(3);
+        j_[0] = seq;
+        j_[1] = Cmd_MultiGet;
+        j_[2] = Json::make_array_reserve(keys.size());
+        for (auto& k : keys)
+            j_[2].push_back(String::make_stable(k));
+        send();
+    }
+    void sendmultiput(const std::vector<Str>& keys,
+                      const std::vector<Str>& vals, unsigned seq) {
+        assert(keys.size() == vals.size());
+        j_.resize(2);
+        j_[0] = seq;
+        j_[1] = Cmd_MultiPut;
+        for (size_t i = 0; i != keys.size(); ++i)
+            j_.push_back(String::make_stable(keys[i]))
+                .push_back(String::make_stable(vals[i]));
+        send();
+    }
 
     void sendscanwhole(Str firstkey, int numpairs, unsigned seq) {
         j_.resize(4);
@@ -154,6 +181,15 @@ class KVConn {
         (void) receive();
     }
 
+    const Json& stats() {
+        j_.resize(2);
+        j_[0] = 0;
+        j_[1] = Cmd_Stats;
+        send();
+        flush();
+        return receive();
+    }
+
     void flush() {
         kvflush(out_);
     }
@@ -191,6 +227,8 @@ class KVConn {
 
     int fdtoclose_;
     int partition_;
+    kvring_region* ring_;
+    String ringname_;
 
     void handshake(int target_core) {
         j_.resize(3);
@@ -198,10 +236,14 @@ class KVConn {
         j_[1] = Cmd_Handshake;
         j_[2] = Json::make_object().set("core", target_core)
             .set("maxkeylen", MASSTREE_MAXKEYLEN);
+        if (ring_)
+            j_[2].set("ring", ringname_);
         send();
         kvflush(out_);
 
         const Json& result = receive();
+        if (ring_)
+            kvring_unlink(ringname_);
         if (!result.is_a()
             || result[1] != Cmd_Handshake + 1
             || !result[2]) {
@@ -209,6 +251,8 @@ class KVConn {
             exit(EXIT_FAILURE);
         }
         partition_ = result[3].as_i();
+        if (ring_)
+            out_->ring = &ring_->requests;
     }
     inline void send() {
         msgpack::unparse(*out_, j_);
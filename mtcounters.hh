@@ -56,4 +56,6 @@ enum threadcounter {
     tc_max
 };
 
+extern const char* const threadcounter_names[(int) tc_max];
+
 #endif
@@ -25,9 +25,12 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <sys/un.h>
+#include <netdb.h>
 #include <sys/select.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <limits.h>
 #if HAVE_SYS_EPOLL_H
 #include <sys/epoll.h>
@@ -52,7 +55,9 @@
 #include "kvrandom.hh"
 #include "clp.h"
 #include "log.hh"
+#include "logwriter.hh"
 #include "checkpoint.hh"
+#include "lz.hh"
 #include "file.hh"
 #include "kvproto.hh"
 #include "query_masstree.hh"
@@ -90,6 +95,38 @@ static uint64_t test_limit = ~uint64_t(0);
 static int doprint = 0;
 int kvtest_first_seed = 31949;
 
+static int scan_chunk = 0;      // most pairs one Scan reply holds, 0 for no limit
+static double max_queue_delay = 0; // shed requests that waited longer
+static bool balance = true;     // move connections from busy tcp threads
+static const double balance_period = 0.05; // seconds between comparisons
+
+// Request counts and latencies of one serving thread, for Cmd_Stats.
+// Only the owning thread writes them.
+struct request_stats {
+    enum { nlatency = 32 };     // bucket i: latency < 2^i microseconds
+    threadinfo* ti;
+    uint64_t ops[Cmd_Max / 2 + 1]; // by command / 2; 0 for unknown
+    uint64_t latency[nlatency];
+    uint64_t late;              // shed: waited past the request's timeout
+    uint64_t overloaded;        // shed: waited past --max-queue-delay
+    volatile double load;       // share of the last balance period busy
+    uint64_t migrated;          // connections handed to other threads
+    char padding[CACHE_LINE_SIZE];
+
+    request_stats()
+        : ti(), ops(), latency(), late(), overloaded(), load(), migrated() {
+    }
+    void note(int command, double t) {
+        ++ops[command > 0 && command < Cmd_Max && !(command & 1)
+              ? command / 2 : 0];
+        uint64_t us = uint64_t(t * 1000000);
+        int b = us ? 64 - __builtin_clzll(us) : 0;
+        ++latency[std::min(b, int(nlatency) - 1)];
+    }
+};
+static request_stats* tcp_rstats;
+static request_stats* udp_rstats;
+
 static volatile sig_atomic_t go_quit = 0;
 static int quit_pipe[2];
 
@@ -99,13 +136,38 @@ static std::vector<const char*> ckpdirs;
 static logset* logs;
 volatile bool recovering = false; // so don't add log entries, and free old value immediately
 
+static const char* replicate_address = 0; // ship logs to followers
+static const char* follow_address = 0;    // follow this leader
+static std::vector<logfollower*> followers;
+static volatile bool following = false;   // read-only until promoted
+
 static double checkpoint_interval = 1000000;
+static bool checkpoint_compress = false;
+static unsigned checkpoint_deltas = 0; // incremental generations per full one
+static bool checkpoint_fork = false; // write checkpoints from a forked child
+static volatile bool writes_paused = false; // while forking a checkpoint
+static double ckp_fork_pause = 0; // seconds writers waited for the last fork
+static uint64_t ckp_fork_rss = 0; // the last checkpoint child's resident bytes
+static uint64_t ckp_fork_cow = 0; // ... and how many of them stopped being shared
+static double checkpoint_rows_per_sec = 0;  // scan rate limit, 0 for none
+static double checkpoint_bytes_per_sec = 0; // write rate limit, 0 for none
+static double checkpoint_latency = 0; // throttle to keep requests this fast
+static volatile double ckp_throttle = 1; // fraction of the rate limits in use
+static volatile double ckp_worst_latency = 0; // slowest request lately
+static volatile bool ckp_running = false;
+static bool lazy_recovery = false; // load checkpoint blocks on demand
+static int lazy_loaders = 0;    // checkpoint threads still loading blocks
+static uint64_t lazy_nblocks = 0; // checkpoint blocks to load
+static uint64_t lazy_loaded = 0;  // ... and how many are loaded
+static Json ckp_chain;          // committed generations: [[gen, nfiles], ...]
+static kvtimestamp_t ckp_floor = 0; // timestamp floor of the last generation
 static kvepoch_t ckp_gen = 0; // recover from checkpoint
 static ckstate *cks = NULL; // checkpoint status of all checkpointing threads
 static pthread_cond_t rec_cond;
 pthread_mutex_t rec_mu;
 static int rec_nactive;
 static int rec_state = REC_NONE;
+static std::vector<std::pair<kvepoch_t, int> > rec_ckp_files; // to recover
 
 kvtimestamp_t initial_timestamp;
 
@@ -114,6 +176,9 @@ static pthread_mutex_t checkpoint_mu;
 
 static void prepare_thread(threadinfo *ti);
 static int* tcp_thread_pipes;
+static int* tcp_listeners;
+static const char* unix_address = 0; // also accept clients on this socket
+static int unix_listener = -1;
 static void* tcp_threadfunc(void* ti);
 static void* udp_threadfunc(void* ti);
 
@@ -123,9 +188,18 @@ static kvepoch_t read_checkpoint(threadinfo*, const char *path);
 
 static void* conc_checkpointer(void* ti);
 static void recovercheckpoint(threadinfo* ti);
+static void lazy_prepare_request(int command, const Json& request,
+                                 threadinfo& ti);
 
+static Json counter_stats();
+static Json server_stats(threadinfo& ti);
 static void *canceling(void *);
 static void catchint(int);
+static void catchusr1(int);
+static int stream_socket(const char* address, bool listening);
+static void* replicate_threadfunc(void* x);
+static void start_following();
+static void promote();
 static void epochinc(int);
 
 /* running local tests */
@@ -332,7 +406,8 @@ void kvtest_client::put_col(const Str &key, int col, const Str &value) {
 
 bool kvtest_client::remove_sync(long ikey) {
     quick_istr key(ikey);
-    bool removed = q_[0].run_remove(tree->table(), key.string(), *ti_);
+    bool removed = q_[0].run_remove(tree->table(), key.string(), *ti_,
+                                    checkpoint_deltas != 0);
     if (removed && ti_->logger()) // NB may block
         ti_->logger()->record(logcmd_remove, q_[0].query_times(), key.string(), Str());
     return removed;
@@ -387,6 +462,16 @@ void kvtest_client::fail(const char *fmt, ...) {
     always_assert(0);
 }
 
+// Bytes handed to the log writers so far. (Batches in flight at the end
+// of a test are included, though not yet synced.)
+static uint64_t log_bytes_written() {
+    uint64_t n = 0;
+    for (int i = 0; logging && i < nlogger; ++i)
+        if (const logwriter* w = logs->log(i).writer())
+            n += w->bytes();
+    return n;
+}
+
 static void* testgo(void* x) {
     kvtest_client *kc = reinterpret_cast<kvtest_client*>(x);
     kc->ti_->pthread() = pthread_self();
@@ -443,6 +528,8 @@ void runtest(const char *testname, int nthreads) {
         clients[i].set_thread(threadinfo::make(threadinfo::TI_PROCESS, i));
     bzero((void *)timeout, sizeof(timeout));
     signal(SIGALRM, test_timeout);
+    uint64_t log_bytes = log_bytes_written();
+    double t0 = now();
     if (duration[0])
         xalarm(duration[0]);
     for (int i = 0; i < nthreads; ++i) {
@@ -451,6 +538,8 @@ void runtest(const char *testname, int nthreads) {
     }
     for (int i = 0; i < nthreads; ++i)
         pthread_join(clients[i].ti_->pthread(), 0);
+    double t1 = now();
+    log_bytes = log_bytes_written() - log_bytes;
 
     kvstats kvs[arraysize(kvstats_name)];
     for (int i = 0; i < nthreads; ++i)
@@ -459,26 +548,258 @@ void runtest(const char *testname, int nthreads) {
                 kvs[j].add(x);
     for (int j = 0; j < (int) arraysize(kvstats_name); ++j)
         kvs[j].print_report(kvstats_name[j]);
+    if (logging)
+        printf("log: %" PRIu64 " bytes, %.1f MB/s\n",
+               log_bytes, log_bytes / (t1 - t0) / (1 << 20));
+}
+
+
+// A request in one of the fixed shapes that tcp threads decode straight
+// from the input buffer, skipping Json: Get, Put, Replace, Remove, and
+// Scan, with integer field numbers. Strings point into the buffer.
+struct fast_request {
+    enum { max_fields = 16 };
+    uint64_t seq;
+    int command;
+    Str key;
+    Str value;                  // Cmd_Replace
+    int count;                  // Cmd_Scan
+    int nfields;
+    int fields[max_fields];     // Get and Scan fields, Put columns
+    Str values[max_fields];     // Put values
+    int64_t timeout;            // microseconds, from request options; 0 if none
+
+    // Decode a whole request from [s, end), advancing s. Returns false,
+    // leaving s alone, if the request is incomplete or has another shape.
+    bool parse(const char*& s, const char* end);
+
+  private:
+    const uint8_t* s_;
+    const uint8_t* end_;
+
+    bool read_array_header(unsigned& n);
+    bool read_int(int64_t& x);
+    bool read_small_int(int& x) {
+        int64_t y;
+        if (!read_int(y) || y < INT_MIN || y > INT_MAX)
+            return false;
+        x = y;
+        return true;
+    }
+    bool read_str(Str& x);
+    bool at_map() const {
+        return s_ != end_ && msgpack::format::is_fixmap(*s_);
+    }
+    bool read_options();
+};
+
+bool fast_request::read_array_header(unsigned& n) {
+    using namespace msgpack;
+    if (s_ == end_)
+        return false;
+    else if (format::is_fixarray(*s_)) {
+        n = *s_ - format::ffixarray;
+        s_ += 1;
+        return true;
+    } else if (*s_ == format::farray16 && end_ - s_ >= 3) {
+        n = read_in_net_order<uint16_t>(s_ + 1);
+        s_ += 3;
+        return true;
+    } else
+        return false;
+}
+
+bool fast_request::read_int(int64_t& x) {
+    using namespace msgpack;
+    if (s_ == end_)
+        return false;
+    uint8_t f = *s_;
+    if (format::is_fixint(f)) {
+        x = (int8_t) f;
+        s_ += 1;
+        return true;
+    }
+    int len;
+    if (f >= format::fuint8 && f <= format::fint64)
+        len = 1 << ((f - format::fuint8) & 3);
+    else
+        return false;
+    if (end_ - s_ < len + 1)
+        return false;
+    switch (f) {
+    case format::fuint8:  x = s_[1]; break;
+    case format::fuint16: x = read_in_net_order<uint16_t>(s_ + 1); break;
+    case format::fuint32: x = read_in_net_order<uint32_t>(s_ + 1); break;
+    case format::fuint64: x = read_in_net_order<uint64_t>(s_ + 1); break;
+    case format::fint8:   x = (int8_t) s_[1]; break;
+    case format::fint16:  x = read_in_net_order<int16_t>(s_ + 1); break;
+    case format::fint32:  x = read_in_net_order<int32_t>(s_ + 1); break;
+    default:              x = read_in_net_order<int64_t>(s_ + 1); break;
+    }
+    s_ += len + 1;
+    return true;
+}
+
+bool fast_request::read_str(Str& x) {
+    using namespace msgpack;
+    if (s_ == end_)
+        return false;
+    uint8_t f = *s_;
+    uint32_t len;
+    int hlen;
+    if (format::is_fixstr(f)) {
+        len = f - format::ffixstr;
+        hlen = 1;
+    } else if ((f == format::fstr8 || f == format::fbin8) && end_ - s_ >= 2) {
+        len = s_[1];
+        hlen = 2;
+    } else if ((f == format::fstr16 || f == format::fbin16) && end_ - s_ >= 3) {
+        len = read_in_net_order<uint16_t>(s_ + 1);
+        hlen = 3;
+    } else if ((f == format::fstr32 || f == format::fbin32) && end_ - s_ >= 5) {
+        len = read_in_net_order<uint32_t>(s_ + 1);
+        hlen = 5;
+    } else
+        return false;
+    if (uint64_t(end_ - s_) < hlen + uint64_t(len))
+        return false;
+    x.assign(reinterpret_cast<const char*>(s_ + hlen), len);
+    s_ += hlen + len;
+    return true;
 }
 
+// {"timeout": N, ...}; other keys with integer values are ignored
+bool fast_request::read_options() {
+    unsigned n = *s_ - msgpack::format::ffixmap;
+    ++s_;
+    for (; n; --n) {
+        Str k;
+        int64_t v;
+        if (!read_str(k) || !read_int(v))
+            return false;
+        if (k == "timeout")
+            timeout = v;
+    }
+    return true;
+}
+
+bool fast_request::parse(const char*& s, const char* end) {
+    s_ = reinterpret_cast<const uint8_t*>(s);
+    end_ = reinterpret_cast<const uint8_t*>(end);
+    unsigned n;
+    int64_t x;
+    if (!read_array_header(n) || n < 3 || !read_int(x) || x < 0
+        || !read_small_int(command) || !read_str(key))
+        return false;
+    seq = x;
+    nfields = 0;
+    timeout = 0;
+    unsigned left = n - 3;
+    switch (command) {
+    case Cmd_Get:               // [seq, Cmd_Get, key, field...]
+        for (; left && !at_map(); --left, ++nfields)
+            if (nfields == max_fields || !read_small_int(fields[nfields])
+                || fields[nfields] < 0)
+                return false;
+        break;
+    case Cmd_Put:               // [seq, Cmd_Put, key, col, value, ...]
+        for (; left >= 2 && !at_map(); left -= 2, ++nfields)
+            if (nfields == max_fields || !read_small_int(fields[nfields])
+                || fields[nfields] < 0 || !read_str(values[nfields]))
+                return false;
+        if (!nfields)
+            return false;
+        break;
+    case Cmd_Replace:           // [seq, Cmd_Replace, key, value]
+        if (!left || !read_str(value))
+            return false;
+        --left;
+        break;
+    case Cmd_Remove:            // [seq, Cmd_Remove, key]
+        break;
+    case Cmd_Scan:              // [seq, Cmd_Scan, firstkey, count, field...]
+        if (!left || !read_small_int(count) || count <= 0)
+            return false;
+        for (--left; left && !at_map(); --left, ++nfields)
+            if (nfields == max_fields || !read_small_int(fields[nfields])
+                || fields[nfields] < 0)
+                return false;
+        break;
+    default:
+        return false;
+    }
+    // any of these may end with a map of request options
+    if (left > 1 || (left == 1 && (!at_map() || !read_options())))
+        return false;
+    s = reinterpret_cast<const char*>(s_);
+    return true;
+}
 
 struct conn {
     int fd;
     enum { inbufsz = 20 * 1024, inbufrefill = 16 * 1024 };
 
     conn(int s)
-        : fd(s), inbuf_(new char[inbufsz]),
+        : fd(s), handshaken(false), ring(), pinned(false), period(0),
+          busy(0), arrival(0), polled(false), inbuf_(new char[inbufsz]),
           inbufpos_(0), inbuflen_(0), kvout(new_kvout(s, 20 * 1024)),
           inbuftotal_(0) {
     }
     ~conn() {
         close(fd);
+        if (ring)
+            kvring_free(ring);
         free_kvout(kvout);
         delete[] inbuf_;
         for (char* x : oldinbuf_)
             delete[] x;
     }
 
+    bool handshaken;
+    // Requests and responses of a kvring connection travel through ring;
+    // the socket only carries the handshake and doorbells.
+    kvring_region* ring;
+    // For load balancing: the client chose its thread, so never move it;
+    // and seconds spent on its requests in balance period period.
+    bool pinned;
+    unsigned period;
+    double busy;
+    // When the thread learned of the requests now waiting (see
+    // shed_request): when it polled them, or else when it read them.
+    double arrival;
+    bool polled;
+
+    void note_poll(double t) {
+        arrival = t;
+        polled = true;
+    }
+
+    // Has the client asked for work (or gone away)? For ring connections,
+    // consume the doorbell and return false if the client has closed.
+    bool doorbell() {
+        char buf[64];
+        ssize_t r;
+        while ((r = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+            /* do nothing */;
+        return r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    }
+
+    // Read the handshake without blocking, since the client may be slow.
+    // Returns 1 with the handshake in hs, 0 if more must arrive, or -1.
+    int receive_handshake(Json& hs);
+
+    // Decode the next request into r if it has fully arrived and has a
+    // shape fast_request handles; otherwise leave it for receive().
+    bool receive_fast(fast_request& r) {
+        if (!parser_.empty() || !check(2))
+            return false;
+        const char* s = inbuf_ + inbufpos_;
+        if (!r.parse(s, inbuf_ + inbuflen_))
+            return false;
+        inbufpos_ = s - inbuf_;
+        return true;
+    }
+
     Json& receive() {
         while (!parser_.done() && check(2))
             inbufpos_ += parser_.consume(inbuf_ + inbufpos_,
@@ -536,23 +857,57 @@ void conn::hard_check(int tryhard) {
         inbuftotal_ += inbufpos_;
         inbufpos_ = inbuflen_ = 0;
     }
-    if (tryhard == 1) {
-        fd_set rfds;
-        FD_ZERO(&rfds);
-        FD_SET(fd, &rfds);
-        struct timeval tv = {0, 0};
-        if (select(fd + 1, &rfds, NULL, NULL, &tv) <= 0)
-            return;
-    } else
-        kvflush(kvout);
+    ssize_t r;
+    if (ring) {
+        if (tryhard != 1)
+            kvflush(kvout);
+        r = kvring_receive(&ring->requests, fd, inbuf_ + inbufpos_,
+                           inbufsz - inbufpos_, tryhard != 1);
+    } else {
+        if (tryhard == 1) {
+            fd_set rfds;
+            FD_ZERO(&rfds);
+            FD_SET(fd, &rfds);
+            struct timeval tv = {0, 0};
+            if (select(fd + 1, &rfds, NULL, NULL, &tv) <= 0)
+                return;
+        } else
+            kvflush(kvout);
+        r = read(fd, inbuf_ + inbufpos_, inbufsz - inbufpos_);
+    }
+    if (r > 0) {
+        inbuflen_ += r;
+        if (!polled)
+            arrival = now();
+        polled = false;
+    }
+}
 
-    ssize_t r = read(fd, inbuf_ + inbufpos_, inbufsz - inbufpos_);
-    if (r != -1)
+int conn::receive_handshake(Json& hs) {
+    ssize_t r = recv(fd, inbuf_ + inbuflen_, inbufsz - inbuflen_,
+                     MSG_DONTWAIT);
+    if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR))
+        return -1;
+    if (r > 0)
         inbuflen_ += r;
+    inbufpos_ += parser_.consume(inbuf_ + inbufpos_, inbuflen_ - inbufpos_,
+                                 String::make_stable(inbuf_, inbufsz));
+    if (!parser_.done())
+        return inbuflen_ == inbufsz ? -1 : 0;
+    else if (!parser_.success())
+        return -1;
+    hs.swap(parser_.result());
+    parser_.reset();
+    if (!hs.is_a() || hs.size() < 2 || !hs[1].is_i()
+        || hs[1].as_i() != Cmd_Handshake || (hs.size() > 2 && !hs[2].is_o()))
+        return -1;
+    return 1;
 }
 
+// A connection handed to another tcp thread, with the handshake it is
+// waiting for an answer to, or null if it is being moved for balance.
 struct conninfo {
-    int s;
+    conn* c;
     Json handshake;
 };
 
@@ -562,7 +917,13 @@ struct conninfo {
 enum { clp_val_suffixdouble = Clp_ValFirstUser };
 enum { opt_nolog = 1, opt_pin, opt_logdir, opt_port, opt_ckpdir, opt_duration,
        opt_test, opt_test_name, opt_threads, opt_cores,
-       opt_print, opt_norun, opt_checkpoint, opt_limit, opt_epoch_interval };
+       opt_print, opt_norun, opt_checkpoint, opt_limit, opt_epoch_interval,
+       opt_counters, opt_flush_interval, opt_log_buffers, opt_replay_threads,
+       opt_segment_size, opt_segment_epochs, opt_compress, opt_replicate,
+       opt_follow, opt_checkpoint_deltas, opt_checkpoint_fork,
+       opt_lazy_recovery, opt_checkpoint_rows, opt_checkpoint_bytes,
+       opt_checkpoint_latency, opt_scan_chunk, opt_unix, opt_balance,
+       opt_max_queue_delay };
 static const Clp_Option options[] = {
     { "no-log", 0, opt_nolog, 0, 0 },
     { 0, 'n', opt_nolog, 0, 0 },
@@ -591,14 +952,33 @@ static const Clp_Option options[] = {
     { "threads", 'j', opt_threads, Clp_ValInt, 0 },
     { "cores", 0, opt_cores, Clp_ValString, 0 },
     { "print", 0, opt_print, 0, Clp_Negate },
-    { "epoch-interval", 0, opt_epoch_interval, Clp_ValDouble, 0 }
+    { "epoch-interval", 0, opt_epoch_interval, Clp_ValDouble, 0 },
+    { "counters", 0, opt_counters, 0, Clp_Negate },
+    { "log-flush-interval", 0, opt_flush_interval, Clp_ValDouble, 0 },
+    { "log-buffers", 0, opt_log_buffers, Clp_ValInt, 0 },
+    { "replay-threads", 0, opt_replay_threads, Clp_ValInt, 0 },
+    { "log-segment-size", 0, opt_segment_size, Clp_ValDouble, 0 },
+    { "log-segment-epochs", 0, opt_segment_epochs, Clp_ValUnsigned, 0 },
+    { "compress", 0, opt_compress, 0, Clp_Negate },
+    { "replicate", 0, opt_replicate, Clp_ValString, 0 },
+    { "follow", 0, opt_follow, Clp_ValString, 0 },
+    { "checkpoint-deltas", 0, opt_checkpoint_deltas, Clp_ValUnsigned, 0 },
+    { "checkpoint-fork", 0, opt_checkpoint_fork, 0, Clp_Negate },
+    { "lazy-recovery", 0, opt_lazy_recovery, 0, Clp_Negate },
+    { "checkpoint-rows", 0, opt_checkpoint_rows, clp_val_suffixdouble, 0 },
+    { "checkpoint-bytes", 0, opt_checkpoint_bytes, clp_val_suffixdouble, 0 },
+    { "checkpoint-latency", 0, opt_checkpoint_latency, Clp_ValDouble, 0 },
+    { "scan-chunk", 0, opt_scan_chunk, Clp_ValInt, 0 },
+    { "unix", 0, opt_unix, Clp_ValString, 0 },
+    { "balance", 0, opt_balance, 0, Clp_Negate },
+    { "max-queue-delay", 0, opt_max_queue_delay, Clp_ValDouble, 0 }
 };
 
 int
 main(int argc, char *argv[])
 {
   using std::swap;
-  int s, ret, yes = 1, i = 1, firstcore = -1, corestride = 1;
+  int s, ret, yes = 1, i = 1, firstcore = -1, corestride = 1, replay_threads = 0;
   const char *dotest = 0;
   nlogger = tcpthreads = udpthreads = nckthreads = sysconf(_SC_NPROCESSORS_ONLN);
   Clp_Parser *clp = Clp_NewParser(argc, argv, (int) arraysize(options), options);
@@ -686,12 +1066,99 @@ main(int argc, char *argv[])
       case opt_epoch_interval:
 	epoch_interval_ms = clp->val.d;
 	break;
+      case opt_counters:
+          if (!clp->negated && !threadinfo::has_counters()) {
+              Clp_OptionError(clp, "%<%O%> requires a build configured with %<--enable-counters%>");
+              exit(EXIT_FAILURE);
+          }
+          threadinfo::set_counters_enabled(!clp->negated);
+          break;
+      case opt_flush_interval:
+          if (clp->val.d < 0 || clp->val.d >= 1000) {
+              Clp_OptionError(clp, "%<%O%> must be between 0 and 1000 ms");
+              exit(EXIT_FAILURE);
+          }
+          log_flush_interval.tv_sec = 0;
+          log_flush_interval.tv_usec = (long) (clp->val.d * 1000);
+          break;
+      case opt_log_buffers:
+          if (clp->val.i < 2 || clp->val.i > 64) {
+              Clp_OptionError(clp, "%<%O%> must be between 2 and 64");
+              exit(EXIT_FAILURE);
+          }
+          log_buffers = clp->val.i;
+          break;
+      case opt_replay_threads:
+          if (clp->val.i < 1 || clp->val.i > 64) {
+              Clp_OptionError(clp, "%<%O%> must be between 1 and 64");
+              exit(EXIT_FAILURE);
+          }
+          replay_threads = clp->val.i;
+          break;
+      case opt_segment_size:
+          if (clp->val.d < 1) {
+              Clp_OptionError(clp, "%<%O%> must be at least 1 MB");
+              exit(EXIT_FAILURE);
+          }
+          log_segment_size = (uint64_t) (clp->val.d * (1 << 20));
+          break;
+      case opt_segment_epochs:
+          log_segment_epochs = clp->val.u;
+          break;
+      case opt_compress:
+          log_compress = checkpoint_compress = !clp->negated;
+          break;
+      case opt_replicate:
+          replicate_address = clp->vstr;
+          break;
+      case opt_follow:
+          follow_address = clp->vstr;
+          break;
+      case opt_unix:
+          if (!strchr(clp->vstr, '/')) {
+              Clp_OptionError(clp, "%<%O%> takes a path");
+              exit(EXIT_FAILURE);
+          }
+          unix_address = clp->vstr;
+          break;
+      case opt_balance:
+          balance = !clp->negated;
+          break;
+      case opt_max_queue_delay:
+          max_queue_delay = std::max(clp->val.d, 0.0) / 1000;
+          break;
+      case opt_checkpoint_deltas:
+          checkpoint_deltas = clp->val.u;
+          break;
+      case opt_checkpoint_fork:
+          checkpoint_fork = !clp->negated;
+          break;
+      case opt_lazy_recovery:
+          lazy_recovery = !clp->negated;
+          break;
+      case opt_checkpoint_rows:
+          checkpoint_rows_per_sec = std::max(clp->val.d, 0.0);
+          break;
+      case opt_checkpoint_bytes:
+          checkpoint_bytes_per_sec = std::max(clp->val.d, 0.0);
+          break;
+      case opt_checkpoint_latency:
+          checkpoint_latency = std::max(clp->val.d, 0.0) / 1000;
+          break;
+      case opt_scan_chunk:
+          scan_chunk = std::max(clp->val.i, 0);
+          break;
       default:
           fprintf(stderr, "Usage: mtd [-np] [--ld dir1[,dir2,...]] [--cd dir1[,dir2,...]]\n");
           exit(EXIT_FAILURE);
       }
   }
   Clp_DeleteParser(clp);
+  // by default, replay with every core even if there are fewer logs
+  if (replay_threads)
+      log_replay_threads = replay_threads;
+  else if (nlogger > 0)
+      log_replay_threads = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN) / nlogger);
   if (logdirs.empty())
       logdirs.push_back(".");
   if (ckpdirs.empty())
@@ -754,6 +1221,20 @@ main(int argc, char *argv[])
     printf("logging disabled\n");
   }
 
+  // log shipping
+  if (replicate_address && !logging) {
+      fprintf(stderr, "--replicate requires logging\n");
+      exit(EXIT_FAILURE);
+  } else if (replicate_address) {
+      pthread_t tid;
+      int rs = stream_socket(replicate_address, true);
+      ret = pthread_create(&tid, 0, replicate_threadfunc, (void*) (intptr_t) rs);
+      always_assert(ret == 0);
+      printf("replicating logs on %s\n", replicate_address);
+  }
+  if (follow_address)
+      start_following();
+
   // UDP threads, each with its own port.
   if (udpthreads == 0)
       printf("0 udp threads\n");
@@ -761,6 +1242,7 @@ main(int argc, char *argv[])
       printf("1 udp thread (port %d)\n", port);
   else
       printf("%d udp threads (ports %d-%d)\n", udpthreads, port, port + udpthreads - 1);
+  udp_rstats = new request_stats[udpthreads];
   for(i = 0; i < udpthreads; i++){
     threadinfo *ti = threadinfo::make(threadinfo::TI_PROCESS, i);
     ret = pthread_create(&ti->pthread(), 0, udp_threadfunc, ti);
@@ -779,32 +1261,65 @@ main(int argc, char *argv[])
       exit(0);
   }
 
-  // TCP socket and threads
+  // TCP sockets and threads. Each thread accepts connections and reads
+  // their handshakes itself, on its own listener if SO_REUSEPORT lets the
+  // kernel spread connections among them, or else on a shared one.
 
-  s = socket(AF_INET, SOCK_STREAM, 0);
-  always_assert(s >= 0);
-  setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
-  setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+  tcp_listeners = new int[tcpthreads];
+  bool reuseport = true;
+  for (i = 0; i < tcpthreads; i++) {
+    if (i && !reuseport) {
+      tcp_listeners[i] = tcp_listeners[0];
+      continue;
+    }
+    s = socket(AF_INET, SOCK_STREAM, 0);
+    always_assert(s >= 0);
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+#ifdef SO_REUSEPORT
+    if (tcpthreads > 1 && i == 0)
+        reuseport = setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) == 0;
+    else if (tcpthreads > 1) {
+        ret = setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
+        always_assert(ret == 0);
+    }
+#else
+    reuseport = false;
+#endif
 
-  struct sockaddr_in sin;
-  sin.sin_family = AF_INET;
-  sin.sin_addr.s_addr = INADDR_ANY;
-  sin.sin_port = htons(port);
-  ret = bind(s, (struct sockaddr *) &sin, sizeof(sin));
-  if (ret < 0) {
-      perror("bind");
-      exit(EXIT_FAILURE);
-  }
+    struct sockaddr_in sin;
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = INADDR_ANY;
+    sin.sin_port = htons(port);
+    ret = bind(s, (struct sockaddr *) &sin, sizeof(sin));
+    if (ret < 0) {
+        perror("bind");
+        exit(EXIT_FAILURE);
+    }
 
-  ret = listen(s, 100);
-  if (ret < 0) {
-      perror("listen");
-      exit(EXIT_FAILURE);
+    ret = listen(s, 1024);
+    if (ret < 0) {
+        perror("listen");
+        exit(EXIT_FAILURE);
+    }
+    ret = fcntl(s, F_SETFL, O_NONBLOCK);
+    always_assert(ret == 0);
+    tcp_listeners[i] = s;
+  }
+  // Co-located clients may connect to a Unix socket instead, shared by
+  // all threads. Over it (or TCP) they can also ask for kvring transport.
+  if (unix_address) {
+    unix_listener = stream_socket(unix_address, true);
+    ret = fcntl(unix_listener, F_SETFL, O_NONBLOCK);
+    always_assert(ret == 0);
   }
 
   threadinfo **tcpti = new threadinfo *[tcpthreads];
+  tcp_rstats = new request_stats[tcpthreads];
   tcp_thread_pipes = new int[tcpthreads * 2];
-  printf("%d tcp threads (port %d)\n", tcpthreads, port);
+  printf("%d tcp threads (port %d%s%s%s)\n", tcpthreads, port,
+         reuseport && tcpthreads > 1 ? ", reuseport" : "",
+         unix_address ? ", " : "", unix_address ? unix_address : "");
   for(i = 0; i < tcpthreads; i++){
     threadinfo *ti = threadinfo::make(threadinfo::TI_PROCESS, i);
     ret = pipe(&tcp_thread_pipes[i * 2]);
@@ -819,52 +1334,12 @@ main(int argc, char *argv[])
   pthread_t canceling_tid;
   ret = pthread_create(&canceling_tid, NULL, canceling, NULL);
   always_assert(ret == 0);
+  if (following)
+      signal(SIGUSR1, catchusr1);
 
-  static int next = 0;
-  while(1){
-    int s1;
-    struct sockaddr_in sin1;
-    socklen_t sinlen = sizeof(sin1);
-
-    bzero(&sin1, sizeof(sin1));
-    s1 = accept(s, (struct sockaddr *) &sin1, &sinlen);
-    always_assert(s1 >= 0);
-    setsockopt(s1, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
-
-    // Complete handshake.
-    char buf[BUFSIZ];
-    ssize_t nr = read(s1, buf, BUFSIZ);
-    if (nr == -1) {
-        perror("read");
-    kill_connection:
-        close(s1);
-        continue;
-    }
-
-    msgpack::streaming_parser sp;
-    if (nr == 0 || sp.consume(buf, nr) != (size_t) nr
-        || !sp.result().is_a() || sp.result().size() < 2
-        || !sp.result()[1].is_i() || sp.result()[1].as_i() != Cmd_Handshake) {
-        fprintf(stderr, "failed handshake\n");
-        goto kill_connection;
-    }
-
-    int target_core = -1;
-    if (sp.result().size() >= 3 && sp.result()[2].is_o()
-        && sp.result()[2]["core"].is_i())
-        target_core = sp.result()[2]["core"].as_i();
-    if (target_core < 0 || target_core >= tcpthreads) {
-        target_core = next % tcpthreads;
-        ++next;
-    }
-
-    conninfo* ci = new conninfo;
-    ci->s = s1;
-    swap(ci->handshake, sp.result());
-
-    ssize_t w = write(tcp_thread_pipes[2*target_core + 1], &ci, sizeof(ci));
-    always_assert((size_t) w == sizeof(ci));
-  }
+  // the canceling thread exits the process
+  while (1)
+    pause();
 }
 
 void
@@ -877,6 +1352,132 @@ catchint(int)
     (void)r;
 }
 
+void
+catchusr1(int)
+{
+    char cmd = 1;               // promote
+    int r = write(quit_pipe[1], &cmd, sizeof(cmd));
+    (void)r;
+}
+
+// Return a socket for an address, as for --replicate, --follow or --unix:
+// a Unix socket path (anything with a '/'), or HOST:PORT. A listening
+// socket may give just PORT.
+static int stream_socket(const char* address, bool listening) {
+    int s, r;
+    if (strchr(address, '/')) {
+        struct sockaddr_un sun;
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        always_assert(strlen(address) < sizeof(sun.sun_path));
+        strcpy(sun.sun_path, address);
+        s = socket(AF_UNIX, SOCK_STREAM, 0);
+        always_assert(s >= 0);
+        if (listening) {
+            unlink(address);
+            r = bind(s, (struct sockaddr*) &sun, sizeof(sun));
+        } else
+            r = connect(s, (struct sockaddr*) &sun, sizeof(sun));
+    } else {
+        const char* colon = strrchr(address, ':');
+        String host = colon ? String(address, colon) : String();
+        String service = colon ? String(colon + 1) : String(address);
+        struct addrinfo hints, *ai;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = listening ? AI_PASSIVE : 0;
+        r = getaddrinfo(host ? host.c_str() : 0, service.c_str(), &hints, &ai);
+        if (r != 0) {
+            fprintf(stderr, "%s: %s\n", address, gai_strerror(r));
+            exit(EXIT_FAILURE);
+        }
+        s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        always_assert(s >= 0);
+        int yes = 1;
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+        if (listening) {
+            setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+            r = bind(s, ai->ai_addr, ai->ai_addrlen);
+        } else
+            r = connect(s, ai->ai_addr, ai->ai_addrlen);
+        freeaddrinfo(ai);
+    }
+    if (r == 0 && listening)
+        r = listen(s, 1024);
+    if (r != 0) {
+        perror(address);
+        exit(EXIT_FAILURE);
+    }
+    return s;
+}
+
+// Accept followers. Each connection asks for one of our logs by index;
+// that log's logger streams it from there.
+static void* replicate_threadfunc(void* x) {
+    int s = (int) (intptr_t) x;
+    while (1) {
+        int fd = accept(s, 0, 0);
+        if (fd < 0) {
+            perror("replicate accept");
+            continue;
+        }
+        // a follower that stops reading for a second is dropped
+        struct timeval tv = {1, 0};
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        int sobuflen = 4 << 20;
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sobuflen, sizeof(sobuflen));
+        uint32_t which;
+        if (safe_read(fd, &which, sizeof(which)) != sizeof(which)
+            || which >= uint32_t(nlogger)) {
+            close(fd);
+            continue;
+        }
+        logs->log(which).add_follower(fd);
+    }
+    return 0;
+}
+
+// Connect to the leader, one connection per leader log, and start
+// applying what it ships.
+static void start_following() {
+    int nlogs = 1;
+    for (int i = 0; i < nlogs; ++i) {
+        logfollower* f = new logfollower(stream_socket(follow_address, false), i);
+        int n = f->handshake();
+        if (n <= 0 || (i && n != nlogs)) {
+            fprintf(stderr, "%s: bad leader handshake\n", follow_address);
+            exit(EXIT_FAILURE);
+        }
+        nlogs = n;
+        followers.push_back(f);
+    }
+    following = true;
+    for (auto f : followers)
+        f->start(threadinfo::make(threadinfo::TI_FOLLOW, f->logindex()));
+    printf("following %s (%d logs)\n", follow_address, nlogs);
+}
+
+// Stop following and accept writes, checkpointing what we have.
+static void promote() {
+    if (!following)
+        return;
+    kvepoch_t applied = 0;
+    for (auto f : followers) {
+        f->stop();
+        if (!applied || f->applied_epoch() < applied)
+            applied = f->applied_epoch();
+    }
+    release_fence();
+    following = false;
+    fprintf(stderr, "promoted: applied leader epochs through %" PRIu64 "\n",
+            applied.value());
+    pthread_mutex_lock(&checkpoint_mu);
+    pthread_cond_broadcast(&checkpoint_cond);
+    pthread_mutex_unlock(&checkpoint_mu);
+}
+
 inline const char *threadtype(int type) {
   switch (type) {
     case threadinfo::TI_MAIN:
@@ -887,6 +1488,10 @@ inline const char *threadtype(int type) {
       return "log";
     case threadinfo::TI_CHECKPOINT:
       return "checkpoint";
+    case threadinfo::TI_REPLAY:
+      return "replay";
+    case threadinfo::TI_FOLLOW:
+      return "follow";
     default:
       always_assert(0 && "Unknown threadtype");
       break;
@@ -897,9 +1502,12 @@ void *
 canceling(void *)
 {
     char cmd;
-    int r = read(quit_pipe[0], &cmd, sizeof(cmd));
-    (void) r;
+    int r;
+    while ((r = read(quit_pipe[0], &cmd, sizeof(cmd))) == sizeof(cmd)
+           && cmd == 1)
+        promote();
     assert(r == sizeof(cmd) && cmd == 0);
+    promote();
     // Cancel wake up checkpointing threads
     pthread_mutex_lock(&checkpoint_mu);
     pthread_cond_signal(&checkpoint_cond);
@@ -907,23 +1515,31 @@ canceling(void *)
 
     fprintf(stderr, "\n");
     // cancel outstanding threads. Checkpointing threads will exit safely
-    // when the checkpointing thread 0 sees go_quit, and don't need cancel
+    // when the checkpointing thread 0 sees go_quit, and don't need cancel.
+    // Replay threads were joined at the end of recovery, and follow
+    // threads by promote().
     for (threadinfo *ti = threadinfo::allthreads; ti; ti = ti->next())
         if (ti->purpose() != threadinfo::TI_MAIN
-            && ti->purpose() != threadinfo::TI_CHECKPOINT) {
+            && ti->purpose() != threadinfo::TI_CHECKPOINT
+            && ti->purpose() != threadinfo::TI_REPLAY
+            && ti->purpose() != threadinfo::TI_FOLLOW) {
             int r = pthread_cancel(ti->pthread());
             always_assert(r == 0);
         }
 
     // join canceled threads
     for (threadinfo *ti = threadinfo::allthreads; ti; ti = ti->next())
-        if (ti->purpose() != threadinfo::TI_MAIN) {
+        if (ti->purpose() != threadinfo::TI_MAIN
+            && ti->purpose() != threadinfo::TI_REPLAY
+            && ti->purpose() != threadinfo::TI_FOLLOW) {
             fprintf(stderr, "joining thread %s:%d\n",
                     threadtype(ti->purpose()), ti->index());
             int r = pthread_join(ti->pthread(), 0);
             always_assert(r == 0);
         }
     tree->stats(stderr);
+    if (threadinfo::counters_enabled())
+        fprintf(stderr, "counters: %s\n", counter_stats().unparse().c_str());
     exit(0);
 }
 
@@ -955,10 +1571,329 @@ int handshake(Json& request, threadinfo& ti) {
     return request[2].as_b() ? 1 : -1;
 }
 
+// A Scan reply with more pairs than --scan-chunk holds only that many,
+// then the key to continue from: [seq, Cmd_Scan + 1, k, v, ..., resume].
+// (The odd length distinguishes it.) Clients send another Scan starting
+// at resume for the rest; meanwhile the thread serves other connections.
+static String scan_resume_key(Str lastkey) {
+    StringAccum sa(lastkey.length() + 1);
+    sa.append(lastkey.data(), lastkey.length());
+    sa.append('\0');
+    return sa.take_string();
+}
+
+static const char* const command_names[] = {
+    "other", "get", "scan", "put", "replace", "remove", "checkpoint",
+    "handshake", "stats", "multiget", "multiput"
+};
+static_assert(arraysize(command_names) == Cmd_Max / 2 + 1,
+              "command_names must cover every command");
+
+static Json request_stats_json(const request_stats& rs) {
+    Json ops = Json::make_object();
+    for (int i = 0; i < Cmd_Max / 2 + 1; ++i)
+        if (rs.ops[i])
+            ops.set(command_names[i], rs.ops[i]);
+    // [[bound, count], ...]: count requests took less than bound usec
+    Json lat = Json::make_array();
+    for (int i = 0; i < request_stats::nlatency; ++i)
+        if (rs.latency[i])
+            lat.push_back(Json::array(uint64_t(1) << i, rs.latency[i]));
+    return Json().set("ops", ops).set("latency_us", lat)
+        .set("shed", Json().set("late", rs.late)
+             .set("overloaded", rs.overloaded));
+}
+
+// Cmd_Stats reports the tree's shape from a walk that each request
+// advances for at most tree_walk_time seconds, so no one request pays for
+// a full traversal. The report covers the last complete walk.
+struct tree_summary {
+    uint64_t keys = 0;
+    uint64_t leaves = 0;
+    uint64_t key_bytes = 0;
+    int max_keylen = 0;
+};
+
+class tree_summary_scanner {
+  public:
+    tree_summary_scanner(tree_summary& s, const void*& leaf, int count)
+        : s_(s), leaf_(leaf), nleft_(count) {
+    }
+    template <typename SS, typename K>
+    void visit_leaf(const SS& scanstack, const K&, threadinfo&) {
+        // a resumed walk starts in the leaf the last one stopped in
+        if (scanstack.node() != leaf_) {
+            leaf_ = scanstack.node();
+            ++s_.leaves;
+        }
+    }
+    bool visit_value(Str key, row_type* value, threadinfo&) {
+        if (!row_is_marker(value)) {
+            ++s_.keys;
+            s_.key_bytes += key.length();
+            s_.max_keylen = std::max(s_.max_keylen, key.length());
+        }
+        if (--nleft_ != 0)
+            return true;
+        lastkey = String(key.data(), key.length());
+        return false;
+    }
+    String lastkey;
+  private:
+    tree_summary& s_;
+    const void*& leaf_;
+    int nleft_;
+};
+
+static const double tree_walk_time = 0.005;
+static pthread_mutex_t tree_walk_mu = PTHREAD_MUTEX_INITIALIZER;
+static tree_summary tree_walk_partial;
+static tree_summary tree_walk_last;
+static String tree_walk_key;    // where the walk resumes
+static const void* tree_walk_leaf;
+static uint64_t tree_walk_passes;
+
+static Json tree_stats(threadinfo& ti) {
+    // one walker at a time; the others just report; scans would wait
+    // for lazy recovery, so don't walk until it's done
+    if (lazy_loaders || pthread_mutex_trylock(&tree_walk_mu) != 0)
+        return Json();
+    double t0 = now();
+    do {
+        tree_summary_scanner scanner(tree_walk_partial, tree_walk_leaf, 1024);
+        tree->table().scan(tree_walk_key, true, scanner, ti);
+        if (!scanner.lastkey) {
+            tree_walk_last = tree_walk_partial;
+            tree_walk_partial = tree_summary();
+            tree_walk_key = String();
+            tree_walk_leaf = nullptr;
+            ++tree_walk_passes;
+            break;
+        }
+        tree_walk_key = scan_resume_key(scanner.lastkey);
+    } while (now() - t0 < tree_walk_time);
+    Json j = Json().set("walks", tree_walk_passes);
+    if (tree_walk_passes) {
+        const tree_summary& s = tree_walk_last;
+        j.set("keys", s.keys).set("leaves", s.leaves)
+            .set("keys_per_leaf", s.leaves ? double(s.keys) / s.leaves : 0.)
+            .set("key_bytes", s.key_bytes).set("max_keylen", s.max_keylen);
+    }
+    j.set("walking", tree_walk_partial.keys);
+    pthread_mutex_unlock(&tree_walk_mu);
+    return j;
+}
+
+static Json counter_stats() {
+    Json counters = Json::make_object();
+    for (int i = 0; i < tc_max; ++i)
+        if (uint64_t c = threadinfo::counter_sum(threadcounter(i)))
+            counters.set(threadcounter_names[i], c);
+    return counters;
+}
+
+// collect server statistics for Cmd_Stats.
+static Json server_stats(threadinfo& ti) {
+    Json j = Json().set("counters_enabled", threadinfo::counters_enabled())
+        .set("counters", counter_stats());
+
+    // requests, per serving thread and in total
+    Json tj = Json::make_array();
+    request_stats total;
+    for (int udp = 0; udp < 2; ++udp) {
+        request_stats* rs = udp ? udp_rstats : tcp_rstats;
+        for (int i = 0; rs && i < (udp ? udpthreads : tcpthreads); ++i) {
+            for (int k = 0; k < Cmd_Max / 2 + 1; ++k)
+                total.ops[k] += rs[i].ops[k];
+            for (int k = 0; k < request_stats::nlatency; ++k)
+                total.latency[k] += rs[i].latency[k];
+            total.late += rs[i].late;
+            total.overloaded += rs[i].overloaded;
+            Json rj = request_stats_json(rs[i]);
+            rj.set("thread", String(udp ? "udp" : "tcp") + String(i));
+            if (rs[i].ti)
+                rj.set("limbo", rs[i].ti->limbo_count());
+            if (!udp)
+                rj.set("load", rs[i].load).set("migrated", rs[i].migrated);
+            tj.push_back(rj);
+        }
+    }
+    j.set("requests", request_stats_json(total)).set("threads", tj);
+
+    uint64_t limbo = 0;
+    for (threadinfo* t = threadinfo::allthreads; t; t = t->next())
+        limbo += t->limbo_count();
+    j.set("rcu", Json().set("global_epoch", uint64_t(globalepoch))
+          .set("active_epoch", uint64_t(active_epoch)).set("limbo", limbo));
+
+    static const struct {
+        memtag tag;
+        const char* name;
+    } memtags[] = {
+        { memtag_value, "value" }, { memtag_masstree_leaf, "leaf" },
+        { memtag_masstree_internode, "internode" },
+        { memtag_masstree_ksuffixes, "ksuffixes" },
+        { memtag_masstree_gc, "gc" }, { memtag_limbo, "limbo" },
+        { memtag_none, "other" }
+    };
+    Json mj = Json::make_object();
+    for (auto& m : memtags)
+        mj.set(m.name, threadinfo::memory_in_use_sum(m.tag));
+    j.set("memory", mj);
+
+    if (Json tree_j = tree_stats(ti))
+        j.set("tree", tree_j);
+
+    if (logs) {
+        // how many epochs each log's fsynced data trails the current one
+        kvepoch_t e = global_log_epoch;
+        Json lj = Json::make_array();
+        for (int i = 0; i < nlogger; ++i) {
+            kvepoch_t f = logs->log(i).flushed_epoch();
+            lj.push_back(Json().set("flushed_epoch", f.value())
+                         .set("lag", f && e > f ? e.value() - f.value() : 0));
+        }
+        j.set("log", Json().set("epoch", e.value()).set("logs", lj));
+    }
+    if (lazy_recovery)
+        j.set("recovery", Json().set("blocks", lazy_nblocks)
+              .set("loaded", lazy_loaded));
+    if (cks && checkpoint_interval > 0) {
+        // progress of the running (or last) checkpoint
+        uint64_t scanned = 0, rows = 0, bytes = 0;
+        for (int i = 0; i < nckthreads; ++i) {
+            scanned += cks[i].scanned;
+            rows += cks[i].count;
+            bytes += cks[i].bytes;
+        }
+        Json cj = Json().set("generation", ckp_gen.value())
+            .set("running", bool(ckp_running)).set("scanned", scanned)
+            .set("rows", rows).set("bytes", bytes)
+            .set("throttle", double(ckp_throttle));
+        if (checkpoint_fork)
+            cj.set("fork_pause", ckp_fork_pause)
+                .set("child_rss", ckp_fork_rss).set("child_cow", ckp_fork_cow);
+        j.set("checkpoint", cj);
+    }
+    if (replicate_address && logs) {
+        Json lj = Json::make_array();
+        for (int i = 0; i < nlogger; ++i)
+            lj.push_back(Json().set("followers", logs->log(i).followers())
+                         .set("shipped", logs->log(i).shipped_bytes()));
+        j.set("replication", Json().set("logs", lj));
+    } else if (!followers.empty()) {
+        // lag: how many epochs the leader is ahead of what we've applied
+        Json lj = Json::make_array();
+        uint64_t lag = 0;
+        for (auto f : followers) {
+            kvepoch_t le = f->leader_epoch(), ae = f->applied_epoch();
+            uint64_t l = ae && le > ae ? le.value() - ae.value() : 0;
+            lag = std::max(lag, l);
+            lj.push_back(Json().set("applied_epoch", ae.value())
+                         .set("leader_epoch", le.value())
+                         .set("lag", l)
+                         .set("bytes", f->bytes()));
+        }
+        j.set("replication", Json().set("following", bool(following))
+              .set("lag", lag).set("logs", lj));
+    }
+    return j;
+}
+
+// Writers hold off while a checkpoint forks, so the child's copy of the
+// tree is consistent with one point in time. The fence pairs with the one
+// in fork_checkpoint(): either it sees our RCU section or we see the pause.
+static inline void wait_for_checkpoint_fork(threadinfo& ti) {
+    memory_fence();
+    if (unlikely(writes_paused)) {
+        ti.rcu_stop();
+        while (writes_paused)
+            usleep(50);
+        ti.rcu_start();
+    }
+}
+
+// Admission control. A data request may end with a map of options,
+// {"timeout": MICROSECONDS}; mtd answers [seq, command + 1, Overloaded],
+// without running it, if the request waited longer than that, or longer
+// than --max-queue-delay, before its turn came. Waits count from when
+// the thread learned of the request (its poll, for TCP and rings), which
+// misses time in the socket buffer while the thread was busy. Shedding
+// makes a backlog cheap to drain, so the thread catches up.
+static inline bool sheddable(int command) {
+    return command == Cmd_Get || command == Cmd_Scan || command == Cmd_Put
+        || command == Cmd_Replace || command == Cmd_Remove
+        || command == Cmd_MultiGet || command == Cmd_MultiPut;
+}
+
+// Remove a data request's options map, returning its timeout.
+static int64_t take_request_options(Json& request, int command) {
+    if (!sheddable(command) || request.size() < 4 || !request.back().is_o())
+        return 0;
+    int64_t timeout = request.back().get("timeout").to_i();
+    request.pop_back();
+    return timeout;
+}
+
+// Should a request that has waited wait seconds be refused? Counts it.
+static inline bool shed_request(request_stats& rs, int command,
+                                int64_t timeout, double wait) {
+    if (!sheddable(command))
+        return false;
+    else if (timeout > 0 && wait * 1000000 > timeout) {
+        ++rs.late;
+        return true;
+    } else if (max_queue_delay && wait > max_queue_delay) {
+        ++rs.overloaded;
+        return true;
+    } else
+        return false;
+}
+
+static void shed_reply(Json& request, int command) {
+    request[1] = command + 1;
+    request[2] = Overloaded;
+    request.resize(3);
+}
+
+// Note how long a request took, for Cmd_Stats and for adaptive
+// checkpoint throttling.
+static inline double note_request(request_stats& rs, int command,
+                                  double t0) {
+    double t = now() - t0;
+    rs.note(command, t);
+    if (checkpoint_latency && t > ckp_worst_latency)
+        ckp_worst_latency = t;
+    return t;
+}
+
+// Updates too large for a log record are refused with TooLarge, without
+// being applied.
+static bool loggable(threadinfo& ti, Str key, Str value) {
+    return !ti.logger() || logbuffer::fits(key, value);
+}
+
+static bool loggable(threadinfo& ti, Str key, const Json* req,
+                     const Json* end_req) {
+    return !ti.logger() || logbuffer::fits(key, req, end_req);
+}
+
 // execute command, return result.
-int onego(query<row_type>& q, Json& request, Str request_str, threadinfo& ti) {
+int onego(query<row_type>& q, Json& request, threadinfo& ti) {
     int command = request[1].as_i();
-    if (command == Cmd_Checkpoint) {
+    if (checkpoint_fork && (command == Cmd_Put || command == Cmd_Replace
+                            || command == Cmd_Remove
+                            || command == Cmd_MultiPut))
+        wait_for_checkpoint_fork(ti);
+    if (unlikely(lazy_loaders))
+        lazy_prepare_request(command, request, ti);
+    if (following && (command == Cmd_Put || command == Cmd_Replace
+                      || command == Cmd_Remove
+                      || command == Cmd_MultiPut)) {
+        // read-only until promoted
+        request[2] = Retry;
+        request.resize(3);
+    } else if (command == Cmd_Checkpoint) {
         // force checkpoint
         pthread_mutex_lock(&checkpoint_mu);
         pthread_cond_broadcast(&checkpoint_cond);
@@ -971,31 +1906,83 @@ int onego(query<row_type>& q, Json& request, Str request_str, threadinfo& ti) {
         Str key(request[2].as_s());
         const Json* req = request.array_data() + 3;
         const Json* end_req = request.end_array_data();
-        request[2] = q.run_put(tree->table(), request[2].as_s(),
-                               req, end_req, ti);
-        if (ti.logger() && request_str) {
-            // use the client's parsed version of the request
-            msgpack::parser mp(request_str.data());
-            mp.skip_array_size().skip_primitives(3);
-            ti.logger()->record(logcmd_put, q.query_times(), key, Str(mp.position(), request_str.end()));
-        } else if (ti.logger())
-            ti.logger()->record(logcmd_put, q.query_times(), key, req, end_req);
+        if (!loggable(ti, key, req, end_req))
+            request[2] = TooLarge;
+        else {
+            request[2] = q.run_put(tree->table(), request[2].as_s(),
+                                   req, end_req, ti);
+            if (ti.logger()) // NB may block
+                ti.logger()->record(logcmd_put, q.query_times(), key,
+                                    req, end_req);
+        }
         request.resize(3);
     } else if (command == Cmd_Replace) { // insert or update
         Str key(request[2].as_s()), value(request[3].as_s());
-        request[2] = q.run_replace(tree->table(), key, value, ti);
-        if (ti.logger()) // NB may block
-            ti.logger()->record(logcmd_replace, q.query_times(), key, value);
+        if (!loggable(ti, key, value))
+            request[2] = TooLarge;
+        else {
+            request[2] = q.run_replace(tree->table(), key, value, ti);
+            if (ti.logger()) // NB may block
+                ti.logger()->record(logcmd_replace, q.query_times(),
+                                    key, value);
+        }
         request.resize(3);
     } else if (command == Cmd_Remove) { // remove
         Str key(request[2].as_s());
-        bool removed = q.run_remove(tree->table(), key, ti);
+        bool removed = q.run_remove(tree->table(), key, ti,
+                                    checkpoint_deltas != 0);
         if (removed && ti.logger()) // NB may block
             ti.logger()->record(logcmd_remove, q.query_times(), key, Str());
         request[2] = removed;
         request.resize(3);
     } else if (command == Cmd_Scan) {
+        bool capped = scan_chunk && request[3].as_i() > scan_chunk;
+        if (capped)
+            request[3] = scan_chunk;
         q.run_scan(tree->table(), request, ti);
+        if (capped && request.size() == 2 + 2 * scan_chunk)
+            request.push_back(scan_resume_key(request[request.size() - 2].as_s()));
+    } else if (command == Cmd_MultiGet && request.size() > 2
+               && request[2].is_a()) {
+        // [seq, Cmd_MultiGet, [key, ...], field, ...]
+        Json results = Json::make_array_reserve(request[2].size());
+        const Json& keys = request.at(2);
+        q.run_get_batch(tree->table(), keys.array_data(),
+                        keys.end_array_data(),
+                        request.array_data() + 3, request.end_array_data(),
+                        results, ti);
+        request[2] = std::move(results);
+        request.resize(3);
+    } else if (command == Cmd_MultiPut && request.size() > 3
+               && (request.size() % 2) == 0) {
+        // [seq, Cmd_MultiPut, key, value, ...]: one Cmd_Replace per pair,
+        // logged under a single epoch; refused whole if any pair is too
+        // large
+        const Json* req = request.array_data() + 2;
+        const Json* end_req = request.end_array_data();
+        const Json* r = req;
+        while (r != end_req && loggable(ti, r[0].as_s(), r[1].as_s()))
+            r += 2;
+        if (r != end_req)
+            request[2] = TooLarge;
+        else {
+            Json results = Json::make_array_reserve((end_req - req) / 2);
+            q.run_replace_batch(tree->table(), req, end_req, results, ti);
+            if (ti.logger()) // NB may block
+                ti.logger()->record_batch(logcmd_replace,
+                                          q.batch_times().data(),
+                                          req, end_req);
+            request[2] = std::move(results);
+        }
+        request.resize(3);
+    } else if (command == Cmd_Stats) {
+        // [seq, Cmd_Stats, {"counters": BOOL}?] optionally toggles
+        // counter collection before reporting
+        if (request.size() >= 3 && request[2].is_o()
+            && request[2]["counters"].is_b())
+            threadinfo::set_counters_enabled(request[2]["counters"].as_b());
+        request[2] = server_stats(ti);
+        request.resize(3);
     } else {
         request[1] = -1;
         request.resize(2);
@@ -1005,6 +1992,82 @@ int onego(query<row_type>& q, Json& request, Str request_str, threadinfo& ti) {
     return 1;
 }
 
+// Execute a fast_request, encoding the same response onego() would
+// straight into kvout. scratch (a buffer kvout) collects Get fields and
+// Scan pairs, whose count goes first. Long values stay in their rows,
+// referenced from kvout, so the caller unpins kvout before rcu_stop().
+static void onego_fast(query<row_type>& q, const fast_request& r,
+                       struct kvout* scratch, struct kvout* kvout,
+                       threadinfo& ti) {
+    int command = r.command;
+    if (checkpoint_fork && command != Cmd_Get && command != Cmd_Scan)
+        wait_for_checkpoint_fork(ti);
+    msgpack::unparser<struct kvout> out(*kvout);
+    msgpack::unparser<struct kvout> fields(*scratch);
+    kvout_reset(scratch);
+    if (command == Cmd_Get) {
+        int n = q.run_get(tree->table(), r.key, r.fields, r.fields + r.nfields,
+                          fields, ti);
+        if (n < 0) {
+            // onego() sends back a missed request as it was
+            out.write_array_header(3 + r.nfields) << r.seq
+                << int(Cmd_Get + 1) << r.key;
+            for (int i = 0; i != r.nfields; ++i)
+                out << r.fields[i];
+            return;
+        }
+        out.write_array_header(2 + n);
+    } else if (command == Cmd_Put) {
+        Json req[2 * fast_request::max_fields];
+        for (int i = 0; i != r.nfields; ++i) {
+            req[2 * i] = r.fields[i];
+            req[2 * i + 1] = String::make_stable(r.values[i]);
+        }
+        const Json* end_req = req + 2 * r.nfields;
+        result_t result = TooLarge;
+        if (loggable(ti, r.key, req, end_req)) {
+            result = q.run_put(tree->table(), r.key, req, end_req, ti);
+            if (ti.logger()) // NB may block
+                ti.logger()->record(logcmd_put, q.query_times(), r.key,
+                                    req, end_req);
+        }
+        out.write_array_header(3) << r.seq << int(Cmd_Put + 1) << int(result);
+        return;
+    } else if (command == Cmd_Replace) {
+        result_t result = TooLarge;
+        if (loggable(ti, r.key, r.value)) {
+            result = q.run_replace(tree->table(), r.key, r.value, ti);
+            if (ti.logger()) // NB may block
+                ti.logger()->record(logcmd_replace, q.query_times(), r.key,
+                                    r.value);
+        }
+        out.write_array_header(3) << r.seq << int(Cmd_Replace + 1)
+            << int(result);
+        return;
+    } else if (command == Cmd_Remove) {
+        bool removed = q.run_remove(tree->table(), r.key, ti,
+                                    checkpoint_deltas != 0);
+        if (removed && ti.logger()) // NB may block
+            ti.logger()->record(logcmd_remove, q.query_times(), r.key, Str());
+        out.write_array_header(3) << r.seq << int(Cmd_Remove + 1)
+            << Json(removed);
+        return;
+    } else {
+        bool capped = scan_chunk && r.count > scan_chunk;
+        String lastkey;
+        int n = q.run_scan(tree->table(), r.key, capped ? scan_chunk : r.count,
+                           r.fields, r.fields + r.nfields, fields, ti,
+                           capped ? &lastkey : nullptr);
+        if (capped && n == scan_chunk) {
+            fields << scan_resume_key(lastkey);
+            out.write_array_header(3 + 2 * n);
+        } else
+            out.write_array_header(2 + 2 * n);
+    }
+    out << r.seq << int(command + 1);
+    kvwrite(kvout, scratch);
+}
+
 #if HAVE_SYS_EPOLL_H
 struct tcpfds {
     int epollfd;
@@ -1024,8 +2087,8 @@ struct tcpfds {
 
     enum { max_events = 100 };
     typedef struct epoll_event eventset[max_events];
-    int wait(eventset &es) {
-        return epoll_wait(epollfd, es, max_events, -1);
+    int wait(eventset &es, int timeout_ms = -1) {
+        return epoll_wait(epollfd, es, max_events, timeout_ms);
     }
 
     conn *event_conn(eventset &es, int i) const {
@@ -1062,9 +2125,10 @@ class tcpfds {
     }
 
     typedef fd_set eventset;
-    int wait(eventset &es) {
+    int wait(eventset &es, int timeout_ms = -1) {
         es = rfds_;
-        int r = select(nfds_, &es, 0, 0, 0);
+        struct timeval tv = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+        int r = select(nfds_, &es, 0, 0, timeout_ms < 0 ? 0 : &tv);
         return r > 0 ? nfds_ : r;
     }
 
@@ -1105,7 +2169,91 @@ void prepare_thread(threadinfo *ti) {
     always_assert(!pinthreads && "pinthreads not supported\n");
 #endif
     if (logging)
-        ti->set_logger(&logs->log(ti->index() % nlogger));
+        ti->set_logger(logs->log(ti->index() % nlogger).make_buffer());
+}
+
+// Start serving a connection that is ready for requests.
+static void adopt_conn(conn* c, std::deque<conn*>& ready,
+                       std::vector<conn*>& rings) {
+    if (c->ring)
+        rings.push_back(c);
+    // requests may have arrived with the handshake, or before a move
+    if (c->check(0))
+        ready.push_back(c);
+    else if (c->ring && c->ring->requests.readable()) {
+        c->note_poll(now());
+        ready.push_back(c);
+    }
+}
+
+// Answer a connection's handshake; it is ours from now on.
+static void finish_handshake(conn* c, Json& hs, tcpfds& sloop,
+                             std::deque<conn*>& ready,
+                             std::vector<conn*>& rings, threadinfo& ti) {
+    String ringname;
+    if (hs.size() > 2 && hs[2]["ring"].is_s())
+        ringname = hs[2]["ring"].as_s();
+    int ret = handshake(hs, ti);
+    if (ret > 0 && ringname && !(c->ring = kvring_attach(ringname.c_str()))) {
+        hs[2] = false;
+        hs[3] = "bad ring";
+        hs.resize(4);
+        ret = -1;
+    }
+    msgpack::unparse(*c->kvout, hs);
+    kvflush(c->kvout);
+    if (ret < 0) {
+        sloop.remove(c->fd);
+        delete c;
+        return;
+    }
+    c->handshaken = true;
+    if (c->ring)
+        c->kvout->ring = &c->ring->responses;
+    adopt_conn(c, ready, rings);
+}
+
+// Hand the busiest connection that can usefully move to the least loaded
+// tcp thread, if this one is much busier. Moving c helps when its share
+// of our load is less than the gap between the two threads; the best
+// choice is about half the gap. Connections move whole, between
+// requests, so each one's replies stay in order.
+static void balance_conns(std::vector<conn*>& active, double busy,
+                          double elapsed, tcpfds& sloop,
+                          std::deque<conn*>& ready,
+                          std::vector<conn*>& rings, threadinfo& ti) {
+    request_stats& rs = tcp_rstats[ti.index()];
+    rs.load = busy / elapsed;
+    int to = -1;
+    for (int i = 0; i < tcpthreads; ++i)
+        if (i != ti.index() && (to < 0 || tcp_rstats[i].load
+                                < tcp_rstats[to].load))
+            to = i;
+    double gap = (rs.load - tcp_rstats[to].load) * elapsed;
+    if (rs.load < 0.5 || gap < 0.2 * elapsed)
+        return;
+    conn* best = nullptr;
+    for (conn* c : active)
+        if (!c->pinned && c->busy < gap
+            && (!best || fabs(c->busy - gap / 2) < fabs(best->busy - gap / 2)))
+            best = c;
+    if (!best)
+        return;
+    kvflush(best->kvout);
+    sloop.remove(best->fd);
+    auto it = std::find(ready.begin(), ready.end(), best);
+    if (it != ready.end())
+        ready.erase(it);
+    if (best->ring)
+        rings.erase(std::find(rings.begin(), rings.end(), best));
+    best->period = 0;
+    conninfo* ci = new conninfo;
+    ci->c = best;
+    ssize_t w = write(tcp_thread_pipes[2 * to + 1], &ci, sizeof(ci));
+    always_assert((size_t) w == sizeof(ci));
+    // count it against the target until it reports its own load
+    tcp_rstats[to].load = tcp_rstats[to].load + best->busy / elapsed;
+    ++rs.migrated;
 }
 
 void* tcp_threadfunc(void* x) {
@@ -1114,51 +2262,202 @@ void* tcp_threadfunc(void* x) {
     prepare_thread(ti);
 
     int myfd = tcp_thread_pipes[2 * ti->index()];
+    int listenfd = tcp_listeners[ti->index()];
     tcpfds sloop(myfd);
+    sloop.add(listenfd, (conn *) 2);
+    if (unix_listener >= 0)
+        sloop.add(unix_listener, (conn *) 3);
     tcpfds::eventset events;
     std::deque<conn*> ready;
+    std::vector<conn*> rings;
+    request_stats& rs = tcp_rstats[ti->index()];
+    rs.ti = ti;
     query<row_type> q;
+    Json hs;
+    fast_request fr;
+    struct kvout* fastout = new_bufkvout();
+    // Connections served this balance period, and the time they took.
+    // Idle threads wake once a period to report their load.
+    bool balancing = balance && tcpthreads > 1;
+    unsigned period = 1;
+    double period_start = now(), period_busy = 0;
+    std::vector<conn*> active;
+    auto end_period = [&](double t) {
+        balance_conns(active, period_busy, t - period_start, sloop, ready,
+                      rings, *ti);
+        active.clear();
+        ++period;
+        period_start = t;
+        period_busy = 0;
+    };
 
     while (1) {
-        int nev = sloop.wait(events);
+        double t;
+        if (balancing && (t = now()) - period_start >= balance_period)
+            end_period(t);
+
+        // Ring connections have no socket events for their requests.
+        // Poll them if any has work; otherwise ask their clients to ring
+        // the doorbell, each connection's socket, before we sleep.
+        bool rings_ready = false;
+        for (conn* c : rings)
+            if (c->ring->requests.readable())
+                rings_ready = true;
+        if (!rings_ready && !rings.empty()) {
+            for (conn* c : rings)
+                c->ring->requests.waiting = kvring::wait_socket;
+            memory_fence();
+            for (conn* c : rings)
+                if (c->ring->requests.readable())
+                    rings_ready = true;
+        }
+        int timeout = balancing ? int(balance_period * 1000) : -1;
+        int nev = sloop.wait(events, rings_ready ? 0 : timeout);
+        double arrival = now();
+        for (conn* c : rings)
+            c->ring->requests.waiting = 0;
         for (int i = 0; i < nev; i++)
-            if (conn *c = sloop.event_conn(events, i))
+            if (conn *c = sloop.event_conn(events, i)) {
+                if (c > (conn *) 3 && c->ring) {
+                    if (!c->doorbell()) {
+                        rings.erase(std::find(rings.begin(), rings.end(), c));
+                        if (c->period == period)
+                            active.erase(std::find(active.begin(),
+                                                   active.end(), c));
+                        sloop.remove(c->fd);
+                        delete c;
+                    }
+                } else {
+                    // data buffered earlier arrived earlier
+                    if (c > (conn *) 3 && !c->check(0))
+                        c->note_poll(arrival);
+                    ready.push_back(c);
+                }
+            }
+        for (conn* c : rings)
+            if (c->check(0))
                 ready.push_back(c);
+            else if (c->ring->requests.readable()) {
+                c->note_poll(arrival);
+                ready.push_back(c);
+            }
 
         while (!ready.empty()) {
+            if (balancing && (t = now()) - period_start >= balance_period) {
+                end_period(t);
+                if (ready.empty())
+                    break;
+            }
             conn* c = ready.front();
             ready.pop_front();
 
-            if (c == (conn *) 1) {
-                // new connections
+            if (c == (conn *) 2 || c == (conn *) 3) {
+                // new connections; another thread may have taken them
+                int fd = c == (conn *) 2 ? listenfd : unix_listener;
+                int s, yes = 1;
+                while ((s = accept(fd, 0, 0)) >= 0) {
+                    fcntl(s, F_SETFL, 0);
+                    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+                    struct conn *c = new conn(s);
+                    sloop.add(c->fd, c);
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK
+                    && errno != ECONNABORTED && errno != EINTR)
+                    perror("accept");
+            } else if (c == (conn *) 1) {
+                // connections handed over by other threads
 #define MAX_NEWCONN 100
                 conninfo* ci[MAX_NEWCONN];
                 ssize_t len = read(myfd, ci, sizeof(ci));
-                always_assert(len > 0 && len % sizeof(int) == 0);
+                always_assert(len > 0 && len % sizeof(*ci) == 0);
                 for (int j = 0; j * sizeof(*ci) < (size_t) len; ++j) {
-                    struct conn *c = new conn(ci[j]->s);
-                    sloop.add(c->fd, c);
-                    int ret = handshake(ci[j]->handshake, *ti);
-                    msgpack::unparse(*c->kvout, ci[j]->handshake);
-                    kvflush(c->kvout);
-                    if (ret < 0) {
-                        sloop.remove(c->fd);
-                        delete c;
-                    }
+                    sloop.add(ci[j]->c->fd, ci[j]->c);
+                    if (ci[j]->handshake)
+                        finish_handshake(ci[j]->c, ci[j]->handshake, sloop,
+                                         ready, rings, *ti);
+                    else
+                        adopt_conn(ci[j]->c, ready, rings);
                     delete ci[j];
                 }
+            } else if (c && !c->handshaken) {
+                int r = c->receive_handshake(hs);
+                if (r == 0)
+                    continue;
+                else if (r < 0) {
+                    fprintf(stderr, "failed handshake\n");
+                    sloop.remove(c->fd);
+                    delete c;
+                    continue;
+                }
+                // hand the connection to the thread it asks for
+                int core = ti->index();
+                if (hs.size() > 2 && hs[2]["core"].is_i()) {
+                    core = hs[2]["core"].as_i();
+                    c->pinned = core >= 0 && core < tcpthreads;
+                }
+                if (core >= 0 && core < tcpthreads && core != ti->index()) {
+                    sloop.remove(c->fd);
+                    conninfo* ci = new conninfo;
+                    ci->c = c;
+                    ci->handshake.swap(hs);
+                    ssize_t w = write(tcp_thread_pipes[2 * core + 1],
+                                      &ci, sizeof(ci));
+                    always_assert((size_t) w == sizeof(ci));
+                } else
+                    finish_handshake(c, hs, sloop, ready, rings, *ti);
+                hs = Json();
             } else if (c) {
                 // Should not block as suggested by epoll
-                uint64_t xposition = c->xposition();
-                Json& request = c->receive();
-                int ret;
-                if (unlikely(!request))
-                    goto closed;
-                ti->rcu_start();
-                ret = onego(q, request, c->recent_string(xposition), *ti);
-                ti->rcu_stop();
-                msgpack::unparse(*c->kvout, request);
-                request.clear();
+                int ret = 1;
+                double t0;
+                if (!following && !lazy_loaders && c->receive_fast(fr)) {
+                    t0 = now();
+                    if (shed_request(rs, fr.command, fr.timeout,
+                                     t0 - c->arrival)) {
+                        msgpack::unparser<struct kvout> out(*c->kvout);
+                        out.write_array_header(3) << fr.seq
+                            << int(fr.command + 1) << int(Overloaded);
+                        t = now() - t0;
+                    } else {
+                        ti->rcu_start();
+                        onego_fast(q, fr, fastout, c->kvout, *ti);
+                        t = note_request(rs, fr.command, t0);
+                        // the reply may point into rows: send what goes
+                        // now and copy the rest before they can be freed,
+                        // so a slow reader can't hold up reclamation
+                        kvout_unpin(c->kvout);
+                        ti->rcu_stop();
+                    }
+                } else {
+                    Json& request = c->receive();
+                    if (unlikely(!request))
+                        goto closed;
+                    ti->rcu_start();
+                    t0 = now();
+                    int command = request[1].as_i();
+                    int64_t timeout = take_request_options(request, command);
+                    if (shed_request(rs, command, timeout,
+                                     t0 - c->arrival)) {
+                        shed_reply(request, command);
+                        t = now() - t0;
+                    } else {
+                        ret = onego(q, request, *ti);
+                        t = note_request(rs, command, t0);
+                    }
+                    // copy out values while their rows are still pinned
+                    msgpack::unparse(*c->kvout, request);
+                    ti->rcu_stop();
+                    request.clear();
+                }
+                if (balancing) {
+                    if (c->period != period) {
+                        c->period = period;
+                        c->busy = 0;
+                        active.push_back(c);
+                    }
+                    c->busy += t;
+                    period_busy += t;
+                }
                 if (likely(ret >= 0)) {
                     if (c->check(0))
                         ready.push_back(c);
@@ -1169,6 +2468,10 @@ void* tcp_threadfunc(void* x) {
                 printf("socket read error\n");
             closed:
                 kvflush(c->kvout);
+                if (c->ring)
+                    rings.erase(std::find(rings.begin(), rings.end(), c));
+                if (c->period == period)
+                    active.erase(std::find(active.begin(), active.end(), c));
                 sloop.remove(c->fd);
                 delete c;
             }
@@ -1195,40 +2498,114 @@ void* udp_threadfunc(void* x) {
   int sobuflen = 512*1024;
   setsockopt(s, SOL_SOCKET, SO_RCVBUF, &sobuflen, sizeof(sobuflen));
 
-  String buf = String::make_uninitialized(4096);
-  struct kvout *kvout = new_bufkvout();
+  // Requests are received, and their replies sent, up to nslots at a
+  // time, which saves system calls when clients keep many outstanding.
+#if HAVE_RECVMMSG && HAVE_SENDMMSG
+  enum { nslots = 32 };
+  struct mmsghdr inmsg[nslots], outmsg[nslots];
+  memset(inmsg, 0, sizeof(inmsg));
+  memset(outmsg, 0, sizeof(outmsg));
+#else
+  enum { nslots = 1 };
+#endif
+  struct udp_slot {
+      String buf;
+      struct iovec iov;
+      struct sockaddr_in sin;
+      StringAccum sa;
+  } slot[nslots];
+  struct iovec outiov[nslots];
+  for (int i = 0; i < nslots; ++i) {
+      slot[i].buf = String::make_uninitialized(4096);
+      slot[i].iov.iov_base = const_cast<char*>(slot[i].buf.data());
+      slot[i].iov.iov_len = slot[i].buf.length();
+  }
   msgpack::streaming_parser parser;
-  StringAccum sa;
+  request_stats& rs = udp_rstats[ti->index()];
+  rs.ti = ti;
 
   query<row_type> q;
   while(1){
-    struct sockaddr_in sin;
-    socklen_t sinlen = sizeof(sin);
-    ssize_t cc = recvfrom(s, const_cast<char*>(buf.data()), buf.length(),
-                          0, (struct sockaddr *) &sin, &sinlen);
-    if(cc < 0){
+    int n;
+    ssize_t cc;
+#if HAVE_RECVMMSG && HAVE_SENDMMSG
+    for (int i = 0; i < nslots; ++i) {
+        inmsg[i].msg_hdr.msg_name = &slot[i].sin;
+        inmsg[i].msg_hdr.msg_namelen = sizeof(slot[i].sin);
+        inmsg[i].msg_hdr.msg_iov = &slot[i].iov;
+        inmsg[i].msg_hdr.msg_iovlen = 1;
+    }
+    n = recvmmsg(s, inmsg, nslots, MSG_WAITFORONE, 0);
+#else
+    socklen_t sinlen = sizeof(slot[0].sin);
+    cc = recvfrom(s, slot[0].iov.iov_base, slot[0].iov.iov_len,
+                  0, (struct sockaddr *) &slot[0].sin, &sinlen);
+    n = cc < 0 ? -1 : 1;
+#endif
+    if (n < 0 && errno == EINTR)
+      continue;
+    if(n < 0){
       perror("udpgo read");
       exit(EXIT_FAILURE);
     }
-    kvout_reset(kvout);
+    double arrival = now();
 
-    parser.reset();
-    unsigned consumed = parser.consume(buf.data(), buf.length(), buf);
+    int nout = 0;
+    for (int i = 0; i < n; ++i) {
+#if HAVE_RECVMMSG && HAVE_SENDMMSG
+        cc = inmsg[i].msg_len;
+#endif
+        parser.reset();
+        parser.consume(slot[i].buf.data(), cc, slot[i].buf);
+
+        // Fail if we received a partial request
+        if (parser.success() && parser.result().is_a()) {
+            ti->rcu_start();
+            double t0 = now();
+            Json& request = parser.result();
+            int command = request[1].as_i();
+            int64_t timeout = take_request_options(request, command);
+            int r = 1;
+            if (shed_request(rs, command, timeout, t0 - arrival))
+                shed_reply(request, command);
+            else {
+                r = onego(q, request, *ti);
+                note_request(rs, command, t0);
+            }
+            if (r >= 0) {
+                StringAccum& sa = slot[i].sa;
+                sa.clear();
+                msgpack::unparser<StringAccum> cu(sa);
+                cu << parser.result();
+                outiov[nout].iov_base = sa.data();
+                outiov[nout].iov_len = sa.length();
+#if HAVE_RECVMMSG && HAVE_SENDMMSG
+                outmsg[nout].msg_hdr.msg_name = &slot[i].sin;
+                outmsg[nout].msg_hdr.msg_namelen = inmsg[i].msg_hdr.msg_namelen;
+                outmsg[nout].msg_hdr.msg_iov = &outiov[nout];
+                outmsg[nout].msg_hdr.msg_iovlen = 1;
+#endif
+                ++nout;
+            }
+            ti->rcu_stop();
+        } else
+          printf("onego failed\n");
+    }
 
-    // Fail if we received a partial request
-    if (parser.success() && parser.result().is_a()) {
-        ti->rcu_start();
-        if (onego(q, parser.result(), Str(buf.data(), consumed), *ti) >= 0) {
-            sa.clear();
-            msgpack::unparser<StringAccum> cu(sa);
-            cu << parser.result();
-            cc = sendto(s, sa.data(), sa.length(), 0,
-                        (struct sockaddr*) &sin, sinlen);
-            always_assert(cc == (ssize_t) sa.length());
-        }
-        ti->rcu_stop();
-    } else
-      printf("onego failed\n");
+#if HAVE_RECVMMSG && HAVE_SENDMMSG
+    for (int i = 0; i < nout; ) {
+        int r = sendmmsg(s, outmsg + i, nout - i, 0);
+        always_assert(r > 0 || (r < 0 && errno == EINTR));
+        if (r > 0)
+            i += r;
+    }
+#else
+    if (nout) {
+        cc = sendto(s, outiov[0].iov_base, outiov[0].iov_len, 0,
+                    (struct sockaddr*) &slot[0].sin, sinlen);
+        always_assert(cc == (ssize_t) outiov[0].iov_len);
+    }
+#endif
   }
   return 0;
 }
@@ -1256,7 +2633,7 @@ void log_init() {
   for (i = 0; i < nlogger; i++)
       logs->log(i).initialize(log_filename(logdirs[i % logdirs.size()], i));
 
-  cks = (ckstate *)malloc(sizeof(ckstate) * nckthreads);
+  cks = new ckstate[nckthreads];
   for (i = 0; i < nckthreads; i++) {
     threadinfo *ti = threadinfo::make(threadinfo::TI_CHECKPOINT, i);
     cks[i].state = CKState_Uninit;
@@ -1266,49 +2643,309 @@ void log_init() {
   }
 }
 
+// A mapped checkpoint file.
+struct ckp_file {
+    char *p;
+    size_t size;
+    Json j;                     // header and block index
+    Json blocks;                // [[count, rawlen, len], ...]
+    std::vector<const char *> pos; // where each block starts
+};
+
+// Map a checkpoint file and read its header and block index. Returns
+// false if there is no such file.
+static bool open_checkpoint(const char *path, ckp_file &f) {
+    int fd = open(path, 0);
+    if (fd < 0)
+        return false;
+    struct stat sb;
+    int ret = fstat(fd, &sb);
+    always_assert(ret == 0);
+    f.size = sb.st_size;
+    f.p = (char *) mmap(0, f.size, PROT_READ, MAP_FILE|MAP_PRIVATE, fd, 0);
+    always_assert(f.p != MAP_FAILED);
+    close(fd);
+
+    msgpack::parser par(String::make_stable(f.p, f.size));
+    par >> f.j;
+    if (!f.j.count("size")) {
+        // the block index is at the end (see writecheckpoint)
+        always_assert(f.size >= 8);
+        uint64_t index_offset = 0;
+        for (int i = 0; i != 8; ++i)
+            index_offset |= uint64_t((unsigned char) f.p[f.size - 8 + i]) << (8 * i);
+        always_assert(index_offset <= uint64_t(f.size - 8));
+        msgpack::parser ipar(String::make_stable(f.p + index_offset, f.size - 8 - index_offset));
+        Json index;
+        ipar >> index;
+        f.j.merge(index);
+    }
+    always_assert(f.j["generation"].is_i() && f.j["size"].is_i());
+    f.blocks = f.j["blocks"];
+    f.j.erase("blocks");
+
+    // files without a block index hold one block running to the end
+    if (!f.blocks.is_a()) {
+        size_t len = f.p + f.size - par.position();
+        f.blocks = Json::array(Json::array(f.j["size"].to_u64(), len, len));
+    }
+    uint64_t count = 0;
+    const char *zp = par.position();
+    for (int i = 0; i != f.blocks.size(); ++i) {
+        f.pos.push_back(zp);
+        zp += f.blocks[i][2].to_u64();
+        always_assert(zp <= f.p + f.size);
+        count += f.blocks[i][0].to_u64();
+    }
+    always_assert(count == f.j["size"].to_u64());
+    return true;
+}
+
+// Insert the count entries of a block of rawlen bytes stored in len.
+// raw is a buffer for decompressing, grown as needed.
+static void insert_checkpoint_block(const char *bp, uint64_t count,
+                                    size_t rawlen, size_t len,
+                                    char *&raw, size_t &rawcap,
+                                    threadinfo &ti) {
+    if (len != rawlen) {
+        if (rawlen > rawcap) {
+            rawcap = rawlen;
+            raw = (char *) realloc(raw, rawcap);
+            always_assert(raw);
+        }
+        always_assert(lz_decompress(bp, len, raw, rawlen));
+        bp = raw;
+    }
+    msgpack::parser par(bp);
+    for (uint64_t k = 0; k != count; ++k)
+        ckstate::insert(tree->table(), par, ti);
+}
+
+// A run of checkpoint blocks for one thread to insert.
+struct ckp_part {
+    const Json *blocks;         // [[count, rawlen, len], ...]
+    const char * const *pos;    // where each block starts
+    unsigned first;
+    unsigned last;
+    threadinfo *ti;
+};
+
+// Quiesces between blocks, so rows the inserts replace can be freed.
+static void insert_checkpoint_blocks(const ckp_part &cp) {
+    char *raw = 0;
+    size_t rawcap = 0;
+    cp.ti->rcu_start();
+    for (unsigned i = cp.first; i != cp.last; ++i) {
+        const Json &b = (*cp.blocks)[i];
+        insert_checkpoint_block(cp.pos[i], b[0].to_u64(), b[1].to_u64(),
+                                b[2].to_u64(), raw, rawcap, *cp.ti);
+        cp.ti->rcu_quiesce();
+    }
+    cp.ti->rcu_stop();
+    free(raw);
+}
+
+static void *read_checkpoint_part(void *x) {
+    ckp_part *cp = reinterpret_cast<ckp_part *>(x);
+    cp->ti->pthread() = pthread_self();
+    insert_checkpoint_blocks(*cp);
+    replay_helper_finish(cp->ti);
+    return 0;
+}
+
 // read a checkpoint, insert key/value pairs into tree.
 // must be followed by a read of the log!
 // since checkpoint is not consistent
-// with any one point in time.
+// with any one point in time (unless written by --checkpoint-fork).
 // returns the timestamp of the first log record that needs
 // to come from the log.
 kvepoch_t read_checkpoint(threadinfo *ti, const char *path) {
     double t0 = now();
 
-    int fd = open(path, 0);
-    if(fd < 0){
+    ckp_file f;
+    if (!open_checkpoint(path, f)) {
         printf("no %s\n", path);
         return 0;
     }
-    struct stat sb;
-    int ret = fstat(fd, &sb);
-    always_assert(ret == 0);
-    char *p = (char *) mmap(0, sb.st_size, PROT_READ, MAP_FILE|MAP_PRIVATE, fd, 0);
-    always_assert(p != MAP_FAILED);
-    close(fd);
+    uint64_t gen = f.j["generation"].as_i();
+    uint64_t n = f.j["size"].as_i();
+    Json blocks = f.blocks;
+    f.j.erase("keys");
+    std::cerr << f.j << "\n";
+
+    // Split the blocks into runs of about equal size. Keys are sorted, so
+    // each run is a disjoint key range and the threads inserting them
+    // mostly touch different parts of the tree.
+    uint64_t rawlen = 0;
+    for (int i = 0; i != blocks.size(); ++i)
+        rawlen += blocks[i][1].to_u64();
+    // The checkpoint threads read their files at once; together they use
+    // as many threads as log replay, log_replay_threads per log.
+    unsigned nblocks = blocks.size();
+    int nreaders = std::min(nckthreads, int(rec_ckp_files.size()));
+    int nthreads = std::max(log_replay_threads, 1) * std::max(nlogger, 1)
+        / std::max(nreaders, 1);
+    unsigned nparts = std::min(unsigned(std::max(nthreads, 1)), nblocks);
+    printf("reading checkpoint with %" PRIu64 " nodes, %u threads\n", n, nparts);
+    std::vector<ckp_part> parts(nparts);
+    uint64_t sofar = 0;
+    for (unsigned i = 0, bi = 0; i != nparts; ++i) {
+        ckp_part &cp = parts[i];
+        cp.blocks = &blocks;
+        cp.pos = f.pos.data();
+        cp.first = bi;
+        // at least one block per run
+        uint64_t target = rawlen * (i + 1) / nparts;
+        do {
+            sofar += blocks[bi][1].to_u64();
+            ++bi;
+        } while (bi + (nparts - i - 1) < nblocks && sofar < target);
+        if (i + 1 == nparts)
+            bi = nblocks;
+        cp.last = bi;
+        cp.ti = i ? replay_helper_get() : ti;
+        if (i) {
+            int r = pthread_create(&cp.ti->pthread(), 0, read_checkpoint_part, &cp);
+            always_assert(r == 0);
+        }
+    }
+    if (nparts)
+        insert_checkpoint_blocks(parts[0]);
+    for (unsigned i = 1; i < nparts; ++i) {
+        int r = pthread_join(parts[i].ti->pthread(), 0);
+        always_assert(r == 0);
+        replay_helper_put(parts[i].ti);
+    }
 
-    msgpack::parser par(String::make_stable(p, sb.st_size));
-    Json j;
-    par >> j;
-    std::cerr << j << "\n";
-    always_assert(j["generation"].is_i() && j["size"].is_i());
-    uint64_t gen = j["generation"].as_i();
-    uint64_t n = j["size"].as_i();
-    printf("reading checkpoint with %" PRIu64 " nodes\n", n);
-
-    // read data
-    for (uint64_t i = 0; i != n; ++i)
-        ckstate::insert(tree->table(), par, *ti);
-
-    munmap(p, sb.st_size);
+    munmap(f.p, f.size);
     double t1 = now();
     printf("%.1f MB, %.2f sec, %.1f MB/sec\n",
-           sb.st_size / 1000000.0,
+           f.size / 1000000.0,
            t1 - t0,
-           (sb.st_size / 1000000.0) / (t1 - t0));
+           (f.size / 1000000.0) / (t1 - t0));
     return gen;
 }
 
+// With --lazy-recovery, recovery only maps the checkpoint files. Log
+// replay and client requests load the block holding each key they touch
+// (lazy_fault_in), the checkpoint threads load the rest once the server
+// is up, and scans wait until they are done.
+struct ckp_lazy_block {
+    lcdf::String firstkey;
+    const char *pos;            // in the mapped file
+    uint64_t count;
+    size_t rawlen;
+    size_t len;
+    volatile int state;         // 0 not loaded, 1 loading, 2 loaded
+};
+
+static std::vector<ckp_file> lazy_files; // parallel to rec_ckp_files
+// the blocks of each generation, in key order
+static std::vector<std::vector<ckp_lazy_block> > lazy_gens;
+static double lazy_t0;
+
+static void lazy_load_block(ckp_lazy_block &b, threadinfo &ti) {
+    if (b.state != 2 && bool_cmpxchg(const_cast<int *>(&b.state), 0, 1)) {
+        char *raw = 0;
+        size_t rawcap = 0;
+        insert_checkpoint_block(b.pos, b.count, b.rawlen, b.len,
+                                raw, rawcap, ti);
+        free(raw);
+        fetch_and_add(&lazy_loaded, uint64_t(1));
+        release_fence();
+        b.state = 2;
+    }
+    while (b.state != 2)
+        relax_fence();
+    acquire_fence();
+}
+
+// Load the blocks that may hold key.
+static void lazy_fault_in(Str key, threadinfo &ti) {
+    for (auto &g : lazy_gens) {
+        auto it = std::upper_bound(g.begin(), g.end(), key,
+                                   [](Str k, const ckp_lazy_block &b) {
+                                       return k < Str(b.firstkey);
+                                   });
+        if (it != g.begin())
+            lazy_load_block(*--it, ti);
+    }
+}
+
+// Called in recover() after the checkpoint phase: index the blocks of
+// the files that were mapped.
+static void lazy_index_blocks() {
+    lazy_nblocks = lazy_loaded = 0;
+    for (size_t i = 0; i != lazy_files.size(); ++i) {
+        ckp_file &f = lazy_files[i];
+        if (!f.p)
+            continue;
+        if (i == 0 || rec_ckp_files[i].first != rec_ckp_files[i - 1].first)
+            lazy_gens.push_back(std::vector<ckp_lazy_block>());
+        // parts cover consecutive key ranges, so appending keeps key order
+        for (int bi = 0; bi != f.blocks.size(); ++bi) {
+            const Json &b = f.blocks[bi];
+            lazy_gens.back().push_back(ckp_lazy_block{
+                    f.j["keys"][bi].to_s(), f.pos[bi], b[0].to_u64(),
+                    size_t(b[1].to_u64()), size_t(b[2].to_u64()), 0});
+            ++lazy_nblocks;
+        }
+    }
+    if (lazy_nblocks)
+        logreplay_fault_in = lazy_fault_in;
+}
+
+// Checkpoint thread ti's share of loading the blocks no request has
+// touched. The last thread to finish unmaps the files.
+static void lazy_load_rest(threadinfo *ti) {
+    for (auto &g : lazy_gens)
+        for (size_t n = g.size(), i = 0; i != n; ++i) {
+            // start at different places so threads mostly load
+            // different blocks
+            ckp_lazy_block &b = g[(i + ti->index() * n / nckthreads) % n];
+            ti->rcu_start();
+            lazy_load_block(b, *ti);
+            ti->rcu_stop();
+        }
+    if (fetch_and_add(&lazy_loaders, -1) == 1) {
+        logreplay_fault_in = 0;
+        printf("loaded %" PRIu64 " checkpoint blocks in the background, %.2f sec\n",
+               lazy_nblocks, now() - lazy_t0);
+        // Requests that saw lazy_loaders > 0 may still look at the block
+        // index, so it stays, but every block is loaded and the files
+        // themselves won't be read again.
+        for (auto &f : lazy_files)
+            if (f.p)
+                munmap(f.p, f.size);
+        lazy_files.clear();
+    }
+}
+
+// Before a request touches the tree: load its key's blocks, or, for a
+// scan, wait until everything is loaded.
+static void lazy_prepare_request(int command, const Json &request,
+                                 threadinfo &ti) {
+    if (command == Cmd_Scan) {
+        ti.rcu_stop();
+        while (lazy_loaders)
+            usleep(1000);
+        ti.rcu_start();
+    } else if ((command == Cmd_Get || command == Cmd_Put
+                || command == Cmd_Replace || command == Cmd_Remove)
+               && request.size() > 2 && request[2].is_s())
+        lazy_fault_in(request[2].as_s(), ti);
+    else if (command == Cmd_MultiGet && request.size() > 2
+             && request[2].is_a()) {
+        for (const Json* k = request[2].array_data();
+             k != request[2].end_array_data(); ++k)
+            if (k->is_s())
+                lazy_fault_in(k->as_s(), ti);
+    } else if (command == Cmd_MultiPut)
+        for (int i = 2; i < request.size(); i += 2)
+            if (request[i].is_s())
+                lazy_fault_in(request[i].as_s(), ti);
+}
+
 void
 waituntilphase(int phase)
 {
@@ -1329,12 +2966,26 @@ inactive(void)
 
 void recovercheckpoint(threadinfo *ti) {
     waituntilphase(REC_CKP);
-    char path[256];
-    sprintf(path, "%s/kvd-ckp-%" PRId64 "-%d",
-            ckpdirs[ti->index() % ckpdirs.size()],
-            ckp_gen.value(), ti->index());
-    kvepoch_t gen = read_checkpoint(ti, path);
-    always_assert(ckp_gen == gen);
+    // the checkpoint may have been written by more threads than we have,
+    // and may include several generations
+    for (size_t i = ti->index(); i < rec_ckp_files.size(); i += nckthreads) {
+        kvepoch_t want = rec_ckp_files[i].first;
+        int part = rec_ckp_files[i].second;
+        char path[256];
+        sprintf(path, "%s/kvd-ckp-%" PRId64 "-%d",
+                ckpdirs[part % ckpdirs.size()], want.value(), part);
+        // files written before the index had keys are read in full
+        if (lazy_recovery && want && open_checkpoint(path, lazy_files[i])) {
+            ckp_file &f = lazy_files[i];
+            always_assert(want == f.j["generation"].to_u64());
+            if (f.j["keys"].size() == f.blocks.size())
+                continue;
+            munmap(f.p, f.size);
+            f = ckp_file();
+        }
+        kvepoch_t gen = read_checkpoint(ti, path);
+        always_assert(want == gen);
+    }
     inactive();
 }
 
@@ -1364,6 +3015,7 @@ recover(threadinfo *)
   sprintf(path, "%s/kvd-ckp-gen", ckpdirs[0]);
   ckp_gen = 0;
   rec_ckp_min_epoch = rec_ckp_max_epoch = 0;
+  ckp_chain = Json::make_array();
   int fd = open(path, O_RDONLY);
   if (fd >= 0) {
       Json ckpj = Json::parse(read_file_contents(fd));
@@ -1372,15 +3024,39 @@ recover(threadinfo *)
           ckp_gen = ckpj["generation"].to_u64();
           rec_ckp_min_epoch = ckpj["min_epoch"].to_u64();
           rec_ckp_max_epoch = ckpj["max_epoch"].to_u64();
-          printf("recover from checkpoint %" PRIu64 " [%" PRIu64 ", %" PRIu64 "]\n", ckp_gen.value(), rec_ckp_min_epoch.value(), rec_ckp_max_epoch.value());
+          if (ckpj["chain"].is_a())
+              ckp_chain = ckpj["chain"];
+          else {
+              int nfiles = ckpj["nckthreads"].is_i() ? ckpj["nckthreads"].to_i() : nckthreads;
+              ckp_chain.push_back(Json::array(ckp_gen.value(), nfiles));
+          }
+          ckp_floor = ckpj["ts_floor"].to_u64();
+          threadinfo::set_timestamp_floor(ckp_floor);
+          printf("recover from %scheckpoint %" PRIu64 " [%" PRIu64 ", %" PRIu64 "]\n", ckpj["consistent"] ? "consistent " : "", ckp_gen.value(), rec_ckp_min_epoch.value(), rec_ckp_max_epoch.value());
+          if (ckp_chain.size() > 1)
+              printf("  base %" PRIu64 " + %d deltas\n", ckp_chain[0][0].to_u64(), ckp_chain.size() - 1);
       }
   } else {
     printf("no %s\n", path);
   }
+
+  // every file of every generation in the chain (or, to report that there
+  // is no checkpoint, of generation 0)
+  rec_ckp_files.clear();
+  for (int i = 0; i != ckp_chain.size(); ++i)
+      for (int part = 0; part != ckp_chain[i][1].to_i(); ++part)
+          rec_ckp_files.push_back(std::make_pair(kvepoch_t(ckp_chain[i][0].to_u64()), part));
+  if (ckp_chain.empty())
+      for (int part = 0; part != nckthreads; ++part)
+          rec_ckp_files.push_back(std::make_pair(kvepoch_t(0), part));
   always_assert(pthread_mutex_lock(&rec_mu) == 0);
 
   // recover from checkpoint, and set timestamp of the checkpoint
+  double t0 = now();
+  lazy_files.assign(rec_ckp_files.size(), ckp_file());
   recphase(nckthreads, REC_CKP);
+  if (lazy_recovery)
+      lazy_index_blocks();
 
   // find minimum maximum timestamp of entries in each log
   rec_log_infos = new logreplay::info_type[nlogger];
@@ -1491,71 +3167,333 @@ recover(threadinfo *)
 
   global_log_epoch = rec_replay_max_epoch.next_nonzero();
 
+  if (lazy_nblocks) {
+      lazy_t0 = t0;
+      printf("serving after %.2f sec; %" PRIu64 " of %" PRIu64 " checkpoint blocks loaded\n",
+             now() - t0, lazy_loaded, lazy_nblocks);
+      lazy_loaders = nckthreads;
+  }
   always_assert(pthread_mutex_unlock(&rec_mu) == 0);
   recovering = false;
   if (recovery_only)
       exit(0);
 }
 
-void
-writecheckpoint(const char *path, ckstate *c, double t0)
+static String
+checkpoint_filename(kvepoch_t gen, int index)
 {
-  double t1 = now();
-  printf("memory phase: %" PRIu64 " nodes, %.2f sec\n", c->count, t1 - t0);
-
-  int fd = creat(path, 0666);
-  always_assert(fd >= 0);
-
-  // checkpoint file format, all msgpack:
-  //   {"generation": generation, "size": size, ...}
-  //   then `size` triples of key (string), timestmap (int), value (whatever)
-  Json j = Json().set("generation", ckp_gen.value())
-      .set("size", c->count)
-      .set("firstkey", c->startkey);
-  StringAccum sa;
-  msgpack::unparse(sa, j);
-  checked_write(fd, sa.data(), sa.length());
-  checked_write(fd, c->vals->buf, c->vals->n);
+    char path[256];
+    sprintf(path, "%s/kvd-ckp-%" PRId64 "-%d",
+            ckpdirs[index % ckpdirs.size()], gen.value(), index);
+    return String(path);
+}
 
-  int ret = fsync(fd);
+// checkpoint file format, all msgpack:
+//   {"generation": generation, "firstkey": firstkey}
+//   then blocks of triples of key (string), timestamp (int), value (whatever)
+//   then {"size": size, "blocks": [[count, rawlen, len], ...],
+//         "keys": [first key of each block, ...]}
+//   then the offset of that index, as 8 little-endian bytes.
+// A block holds count triples taking rawlen bytes, stored in len bytes.
+// If len < rawlen, the block is lz-compressed. The index comes last so
+// blocks can be written as the scan produces them. The keys let lazy
+// recovery find the block holding a key without reading the others.
+
+// finish a checkpoint file; returns its uncompressed size
+static uint64_t
+writecheckpoint(ckstate *c)
+{
+  c->write_block();
+  uint64_t rawbytes = 0;
+  Json bj = Json::make_array(), kj = Json::make_array();
+  for (auto& b : c->blocks) {
+      bj.push_back(Json::array(b.count, b.rawlen, b.len));
+      kj.push_back(b.firstkey);
+      rawbytes += b.rawlen;
+  }
+  StringAccum sa;
+  msgpack::unparse(sa, Json().set("size", c->count).set("blocks", bj)
+                   .set("keys", kj));
+  uint64_t index_offset = c->written;
+  for (int i = 0; i != 8; ++i)
+      sa << char(index_offset >> (8 * i));
+  checked_write(c->fd, sa.data(), sa.length());
+
+  int ret = fsync(c->fd);
   always_assert(ret == 0);
-  ret = close(fd);
+  ret = close(c->fd);
   always_assert(ret == 0);
+  c->fd = -1;
+  return rawbytes;
+}
+
+static void
+printcheckpoint(const String &path, const ckstate *c, uint64_t rawbytes,
+                double t)
+{
+  printf("checkpoint (%s): %" PRIu64 " nodes, %" PRIu64 " bytes (%" PRIu64 " raw), %.2f sec, %.1f MB/sec\n",
+         path.c_str(), c->count, c->bytes, rawbytes, t,
+         (c->bytes / 1000000.0) / t);
+}
+
+// Every so often, halve the checkpoint rate if a request took longer
+// than --checkpoint-latency since the last look, and otherwise raise it
+// by a quarter (up to the configured limits).
+static void
+adjust_checkpoint_throttle()
+{
+    static double last_adjust;
+    double t = now();
+    if (t - last_adjust < 0.1)
+        return;
+    last_adjust = t;
+    double worst = ckp_worst_latency;
+    ckp_worst_latency = 0;
+    if (worst > checkpoint_latency)
+        ckp_throttle = std::max(ckp_throttle / 2, 1.0 / 64);
+    else
+        ckp_throttle = std::min(ckp_throttle * 1.25, 1.0);
+}
+
+// Called between pieces of a checkpoint scan, outside any RCU section.
+// Sleep long enough that this thread's share of the rate limits isn't
+// exceeded. With no limits, --checkpoint-latency alone sleeps in
+// proportion to the time spent scanning.
+static void
+throttle_checkpoint(threadinfo *ti, ckstate *c, double &t, uint64_t &scanned,
+                    uint64_t &bytes)
+{
+    if (checkpoint_latency && ti->index() == 0)
+        adjust_checkpoint_throttle();
+    double share = ckp_throttle / nckthreads, want;
+    if (checkpoint_rows_per_sec || checkpoint_bytes_per_sec) {
+        want = 0;
+        if (checkpoint_rows_per_sec)
+            want = (c->scanned - scanned) / (checkpoint_rows_per_sec * share);
+        if (checkpoint_bytes_per_sec)
+            want = std::max(want, (c->bytes - bytes)
+                            / (checkpoint_bytes_per_sec * share));
+    } else
+        want = (now() - t) / ckp_throttle;
+    double delay = t + want - now();
+    if (delay > 0)
+        usleep(delay * 1000000);
+    t = now();
+    scanned = c->scanned;
+    bytes = c->bytes;
+}
 
-  double t2 = now();
-  c->bytes = c->vals->n;
-  printf("file phase (%s): %" PRIu64 " bytes, %.2f sec, %.1f MB/sec\n",
-         path,
-         c->bytes,
-         t2 - t1,
-         (c->bytes / 1000000.0) / (t2 - t1));
+// write this thread's part of the checkpoint; returns its uncompressed size
+static uint64_t
+filecheckpoint(threadinfo *ti, const String &path)
+{
+    ckstate *c = &cks[ti->index()];
+    int fd = creat(path.c_str(), 0666);
+    always_assert(fd >= 0);
+    StringAccum sa;
+    msgpack::unparse(sa, Json().set("generation", ckp_gen.value())
+                     .set("firstkey", c->startkey));
+    checked_write(fd, sa.data(), sa.length());
+
+    bool throttled = checkpoint_rows_per_sec || checkpoint_bytes_per_sec
+        || checkpoint_latency;
+    c->pause_interval = throttled ? 256 : 0;
+    c->start(fd, checkpoint_compress);
+    double t = now();
+    uint64_t scanned = 0, bytes = 0;
+    tree->table().scan(c->startkey, true, *c, *ti);
+    while (c->paused) {
+        ti->rcu_stop();
+        throttle_checkpoint(ti, c, t, scanned, bytes);
+        ti->rcu_start();
+        c->paused = false;
+        tree->table().scan(c->resume_key, true, *c, *ti);
+    }
+    return writecheckpoint(c);
 }
 
 void
 conc_filecheckpoint(threadinfo *ti)
 {
-    ckstate *c = &cks[ti->index()];
-    c->vals = new_bufkvout();
+    String path = checkpoint_filename(ckp_gen, ti->index());
     double t0 = now();
-    tree->table().scan(c->startkey, true, *c, *ti);
-    char path[256];
-    sprintf(path, "%s/kvd-ckp-%" PRId64 "-%d",
-            ckpdirs[ti->index() % ckpdirs.size()],
-            ckp_gen.value(), ti->index());
-    writecheckpoint(path, c, t0);
-    c->count = 0;
-    free(c->vals);
+    uint64_t rawbytes = filecheckpoint(ti, path);
+    printcheckpoint(path, &cks[ti->index()], rawbytes, now() - t0);
+}
+
+// Wait until every thread that was in an RCU section when we were called
+// has left it. Advancing the epoch ourselves means we needn't wait for
+// the timer.
+static void
+wait_for_rcu_quiescence()
+{
+    mrcu_epoch_type e = fetch_and_add(const_cast<uint64_t *>(&globalepoch),
+                                      uint64_t(2));
+    while (mrcu_signed_epoch_type(threadinfo::min_active_epoch() - e) <= 0)
+        usleep(1000);
+}
+
+// Resident bytes of this process, and how many of them are private (not
+// shared with another process, such as the parent of a fork). Linux only.
+static bool
+memory_usage(uint64_t &rss, uint64_t &private_bytes)
+{
+    rss = private_bytes = 0;
+#if __linux__
+    String s = read_file_contents("/proc/self/smaps_rollup");
+    const char *fields[] = { "Rss:", "Private_Clean:", "Private_Dirty:" };
+    for (int i = 0; i != 3; ++i) {
+        const char *p = strstr(s.c_str(), fields[i]);
+        if (!p)
+            return false;
+        uint64_t kb = strtoull(p + strlen(fields[i]), 0, 10);
+        (i == 0 ? rss : private_bytes) += kb << 10;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+struct ckp_fork_part {
+    threadinfo *ti;
+    pthread_t pthread;
+    uint64_t rawbytes;
+    double t;
+};
+
+static void *
+fork_checkpoint_part(void *x)
+{
+    ckp_fork_part *p = reinterpret_cast<ckp_fork_part *>(x);
+    double t0 = now();
+    p->ti->rcu_start();
+    p->rawbytes = filecheckpoint(p->ti, checkpoint_filename(ckp_gen, p->ti->index()));
+    p->ti->rcu_stop();
+    p->t = now() - t0;
+    return 0;
+}
+
+// The child of a forked checkpoint: write every part from our frozen copy
+// of the tree, one thread per part (using the checkpoint threads'
+// threadinfos, whose threads weren't copied), then report to the parent
+// over fd. Avoids stdio, whose locks may have been held at the fork.
+static void
+fork_checkpoint_child(threadinfo *ti, int fd)
+{
+    // a Ctrl-C to the process group abandons the checkpoint
+    signal(SIGINT, SIG_DFL);
+    signal(SIGUSR1, SIG_IGN);
+    uint64_t rss, private0, private1;
+    memory_usage(rss, private0);
+
+    std::vector<ckp_fork_part> parts(nckthreads);
+    for (threadinfo *t = threadinfo::allthreads; t; t = t->next())
+        if (t->purpose() == threadinfo::TI_CHECKPOINT)
+            parts[t->index()].ti = t;
+    parts[0].ti = ti;
+    for (int i = 1; i < nckthreads; ++i) {
+        int r = pthread_create(&parts[i].pthread, 0, fork_checkpoint_part, &parts[i]);
+        always_assert(r == 0);
+    }
+    fork_checkpoint_part(&parts[0]);
+    for (int i = 1; i < nckthreads; ++i)
+        pthread_join(parts[i].pthread, 0);
+    memory_usage(rss, private1);
+
+    Json pj = Json::make_array();
+    for (int i = 0; i < nckthreads; ++i) {
+        Json mj = Json::make_array();
+        for (auto& m : cks[i].markers)
+            mj.push_back(Json::array(m.first, m.second));
+        pj.push_back(Json::array(cks[i].count, cks[i].bytes,
+                                 parts[i].rawbytes, parts[i].t, mj));
+    }
+    StringAccum sa;
+    msgpack::unparse(sa, Json().set("parts", pj).set("rss", rss)
+                     .set("cow", private1 - private0));
+    ssize_t w = safe_write(fd, sa.data(), sa.length());
+    _exit(w == sa.length() ? 0 : 1);
+}
+
+// Write a checkpoint consistent with one point in time: hold off writers
+// until the updates in progress finish, fork, and let the child write the
+// files from its copy-on-write snapshot while we keep serving. Returns
+// the log epoch at the fork, or 0 if the checkpoint failed.
+static kvepoch_t
+fork_checkpoint(threadinfo *ti)
+{
+    int p[2];
+    always_assert(pipe(p) == 0);
+    double t0 = now();
+    writes_paused = true;
+    memory_fence();
+    wait_for_rcu_quiescence();
+    kvepoch_t epoch = global_log_epoch;
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(p[0]);
+        fork_checkpoint_child(ti, p[1]);
+    }
+    writes_paused = false;
+    ckp_fork_pause = now() - t0;
+    close(p[1]);
+    if (pid < 0) {
+        perror("fork");
+        close(p[0]);
+        return 0;
+    }
+
+    String result = read_file_contents(p[0]);
+    close(p[0]);
+    int status;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+        /* do nothing */;
+    Json j = msgpack::parse(result);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 || !j) {
+        fprintf(stderr, "kvd-ckp-%" PRIu64 ": checkpoint child failed\n",
+                ckp_gen.value());
+        for (int i = 0; i < nckthreads; ++i)
+            unlink(checkpoint_filename(ckp_gen, i).c_str());
+        return 0;
+    }
+
+    for (int i = 0; i < nckthreads; ++i) {
+        Json pj = j["parts"][i];
+        cks[i].count = pj[0].to_u64();
+        cks[i].bytes = pj[1].to_u64();
+        for (auto it = pj[4].abegin(); it != pj[4].aend(); ++it)
+            cks[i].markers.push_back(std::make_pair((*it)[0].to_s(),
+                                                    (*it)[1].to_u64()));
+        printcheckpoint(checkpoint_filename(ckp_gen, i), &cks[i],
+                        pj[2].to_u64(), pj[3].to_d());
+    }
+    ckp_fork_rss = j["rss"].to_u64();
+    ckp_fork_cow = j["cow"].to_u64();
+    fprintf(stderr, "kvd-ckp-%" PRIu64 ": writers paused %.2f ms, child %" PRIu64 " MB resident, %" PRIu64 " MB copied\n",
+            ckp_gen.value(), ckp_fork_pause * 1000, ckp_fork_rss >> 20,
+            ckp_fork_cow >> 20);
+    return epoch;
 }
 
 static Json
-prepare_checkpoint(kvepoch_t min_epoch, int nckthreads, const Str *pv)
+prepare_checkpoint(kvepoch_t min_epoch, int nckthreads, const Str *pv,
+                   kvtimestamp_t floor, bool delta, bool consistent)
 {
+    // chain lists the generations recovery loads: a full one, then deltas
+    Json chain = delta ? ckp_chain : Json::make_array();
+    chain.push_back(Json::array(ckp_gen.value(), nckthreads));
     Json j;
     j.set("kvdb_checkpoint", true)
         .set("min_epoch", min_epoch.value())
-        .set("max_epoch", global_log_epoch.value())
+        .set("max_epoch", consistent ? min_epoch.value()
+             : global_log_epoch.value())
         .set("generation", ckp_gen.value())
-        .set("nckthreads", nckthreads);
+        .set("nckthreads", nckthreads)
+        .set("ts_floor", floor)
+        .set("chain", chain);
+    if (consistent)
+        j.set("consistent", true);
 
     Json pvj;
     for (int i = 1; i < nckthreads; ++i)
@@ -1566,7 +3504,7 @@ prepare_checkpoint(kvepoch_t min_epoch, int nckthreads, const Str *pv)
 }
 
 static void
-commit_checkpoint(Json ckpj)
+commit_checkpoint(Json ckpj, threadinfo *ti)
 {
     // atomically commit a set of checkpoint files by incrementing
     // the checkpoint generation on disk
@@ -1578,13 +3516,35 @@ commit_checkpoint(Json ckpj)
             ckp_gen.value(), ckpj["min_epoch"].to_s().c_str(),
             ckpj["max_epoch"].to_s().c_str());
 
-    // delete old checkpoint files
-    for (int i = 0; i < nckthreads; i++) {
-        char path[256];
-        sprintf(path, "%s/kvd-ckp-%" PRId64 "-%d",
-                ckpdirs[i % ckpdirs.size()],
-                ckp_gen.value() - 1, i);
-        unlink(path);
+    // drop log segments the new checkpoint makes redundant
+    for (int i = 0; logs && i < nlogger; ++i)
+        logs->log(i).trim(ckpj["min_epoch"].to_u64());
+
+    // delete checkpoint files no longer in the chain
+    Json chain = ckpj["chain"];
+    for (int g = 0; g != ckp_chain.size(); ++g) {
+        uint64_t gen = ckp_chain[g][0].to_u64();
+        if (chain[0][0].to_u64() <= gen)
+            continue;
+        for (int i = 0; i < ckp_chain[g][1].to_i(); i++) {
+            char path[256];
+            sprintf(path, "%s/kvd-ckp-%" PRId64 "-%d",
+                    ckpdirs[i % ckpdirs.size()], gen, i);
+            unlink(path);
+        }
+    }
+    ckp_chain = chain;
+    ckp_floor = ckpj["ts_floor"].to_u64();
+
+    // a full checkpoint makes older remove markers unnecessary
+    if (chain.size() == 1) {
+        ti->rcu_start();
+        for (int i = 0; i < nckthreads; ++i) {
+            for (auto& m : cks[i].markers)
+                ckstate::remove_marker(tree->table(), m.first, m.second, *ti);
+            cks[i].markers.clear();
+        }
+        ti->rcu_stop();
     }
 }
 
@@ -1612,12 +3572,17 @@ void* conc_checkpointer(void* x) {
   c->state = CKState_Ready;
   while (recovering)
     sleep(1);
+  if (lazy_loaders)
+      lazy_load_rest(ti);
   if (checkpoint_interval <= 0)
       return 0;
   if (ti->index() == 0) {
     for (int i = 1; i < nckthreads; i++)
       while (cks[i].state != CKState_Ready)
         ;
+    // a checkpoint needs the whole tree
+    while (lazy_loaders)
+      usleep(1000);
     Str *pv = new Str[nckthreads + 1];
     Json uncommitted_ckp;
 
@@ -1641,53 +3606,84 @@ void* conc_checkpointer(void* x) {
       if (uncommitted_ckp) {
           kvepoch_t mfe = max_flushed_epoch();
           if (!mfe || mfe > uncommitted_ckp["max_epoch"].to_u64()) {
-              commit_checkpoint(uncommitted_ckp);
+              commit_checkpoint(uncommitted_ckp, ti);
               uncommitted_ckp = Json();
           }
           continue;
       }
 
       double t0 = now();
+      ckp_running = true;
       ti->rcu_start();
       for (int i = 0; i < nckthreads + 1; i++)
         pv[i].assign(NULL, 0);
       tree->findpivots(pv, nckthreads + 1);
       ti->rcu_stop();
 
+      // A delta holds the rows with timestamps >= the last generation's
+      // floor. Once we raise the floor and wait out updates that might
+      // have missed it, every later update is at or above the new floor.
+      bool delta = checkpoint_deltas && ckp_floor
+          && ckp_chain.size() <= int(checkpoint_deltas);
+      kvtimestamp_t floor = 0;
+      if (checkpoint_deltas) {
+          floor = threadinfo::raise_timestamp_floor();
+          if (!checkpoint_fork) // fork_checkpoint() waits anyway
+              wait_for_rcu_quiescence();
+      }
+
       kvepoch_t min_epoch = global_log_epoch;
       pthread_mutex_lock(&checkpoint_mu);
       ckp_gen = ckp_gen.next_nonzero();
       for (int i = 0; i < nckthreads; i++) {
+          cks[i].since = delta ? ckp_floor : 0;
+          cks[i].floor = floor;
           cks[i].startkey = pv[i];
           cks[i].endkey = (i == nckthreads - 1 ? Str() : pv[i + 1]);
-          cks[i].state = CKState_Go;
-          pthread_cond_signal(&cks[i].state_cond);
+          if (!checkpoint_fork) {
+              cks[i].state = CKState_Go;
+              pthread_cond_signal(&cks[i].state_cond);
+          }
       }
       pthread_mutex_unlock(&checkpoint_mu);
 
-      ti->rcu_start();
-      conc_filecheckpoint(ti);
-      ti->rcu_stop();
-
-      cks[0].state = CKState_Ready;
-      uint64_t bytes = cks[0].bytes;
-      pthread_mutex_lock(&checkpoint_mu);
-      for (int i = 1; i < nckthreads; i++) {
-        while (cks[i].state != CKState_Ready)
-          pthread_cond_wait(&cks[i].state_cond, &checkpoint_mu);
-        bytes += cks[i].bytes;
+      uint64_t bytes = 0;
+      if (checkpoint_fork) {
+          min_epoch = fork_checkpoint(ti);
+          for (int i = 0; i < nckthreads; i++)
+              bytes += cks[i].bytes;
+      } else {
+          ti->rcu_start();
+          conc_filecheckpoint(ti);
+          ti->rcu_stop();
+
+          cks[0].state = CKState_Ready;
+          bytes = cks[0].bytes;
+          pthread_mutex_lock(&checkpoint_mu);
+          for (int i = 1; i < nckthreads; i++) {
+            while (cks[i].state != CKState_Ready)
+              pthread_cond_wait(&cks[i].state_cond, &checkpoint_mu);
+            bytes += cks[i].bytes;
+          }
+          pthread_mutex_unlock(&checkpoint_mu);
       }
-      pthread_mutex_unlock(&checkpoint_mu);
 
-      uncommitted_ckp = prepare_checkpoint(min_epoch, nckthreads, pv);
+      ckp_running = false;
+      if (min_epoch)
+          uncommitted_ckp = prepare_checkpoint(min_epoch, nckthreads, pv,
+                                               floor, delta,
+                                               checkpoint_fork && !following);
 
       for (int i = 0; i < nckthreads + 1; i++)
         if (pv[i].s)
           free((void *)pv[i].s);
+      if (!min_epoch)
+          continue;
       double t = now() - t0;
-      fprintf(stderr, "kvd-ckp-%" PRIu64 " [%s,%s]: prepared (%.2f sec, %" PRIu64 " MB, %" PRIu64 " MB/sec)\n",
+      fprintf(stderr, "kvd-ckp-%" PRIu64 " [%s,%s]: prepared%s (%.2f sec, %" PRIu64 " MB, %" PRIu64 " MB/sec)\n",
               ckp_gen.value(), uncommitted_ckp["min_epoch"].to_s().c_str(),
               uncommitted_ckp["max_epoch"].to_s().c_str(),
+              delta ? " delta" : "",
               t, bytes / (1 << 20), (uint64_t)(bytes / t) >> 20);
     }
   } else {
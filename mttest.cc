@@ -107,8 +107,6 @@ std::vector<mttest_numainfo> numa;
 volatile bool recovering = false; // so don't add log entries, and free old value immediately
 kvtimestamp_t initial_timestamp;
 
-static const char *threadcounter_names[(int) tc_max];
-
 /* running local tests */
 void test_timeout(int) {
     size_t n;
@@ -686,6 +684,14 @@ struct test_thread {
         if (at == 1 && print_table) {
             kvtest_print(*table_, stdout, tt.client_.ti_);
         }
+        if (at == 1 && threadinfo::counters_enabled()) {
+            Json counters;
+            for (int i = 0; i < tc_max; ++i)
+                if (uint64_t c = threadinfo::counter_sum(threadcounter(i)))
+                    counters.set(threadcounter_names[i], c);
+            if (counters && !quiet)
+                fprintf(stderr, "counters: %s\n", counters.unparse().c_str());
+        }
         if (at == 1 && json_stats) {
             Json j;
             kvtest_json_stats(*table_, j, *tt.client_.ti_);
@@ -773,7 +779,7 @@ enum { opt_pin = 1, opt_port, opt_duration,
        opt_test, opt_test_name, opt_threads, opt_trials, opt_quiet, opt_print,
        opt_normalize, opt_limit, opt_notebook, opt_compare, opt_no_run,
        opt_gid, opt_tree_stats, opt_rscale_ncores, opt_cores,
-       opt_stats, opt_help, opt_yrange };
+       opt_stats, opt_counters, opt_help, opt_yrange };
 static const Clp_Option options[] = {
     { "pin", 'p', opt_pin, 0, Clp_Negate },
     { "port", 0, opt_port, Clp_ValInt, 0 },
@@ -795,6 +801,7 @@ static const Clp_Option options[] = {
     { "gid", 'g', opt_gid, Clp_ValString, 0 },
     { "tree-stats", 0, opt_tree_stats, 0, 0 },
     { "stats", 0, opt_stats, 0, 0 },
+    { "counters", 0, opt_counters, 0, Clp_Negate },
     { "compare", 'c', opt_compare, Clp_ValString, 0 },
     { "cores", 0, opt_cores, Clp_ValString, 0 },
     { "yrange", 0, opt_yrange, Clp_ValString, 0 },
@@ -817,6 +824,8 @@ Options:\n\
   -b, --notebook=FILE      Record JSON results in FILE (notebook-mttest.json).\n\
       --no-notebook        Do not record JSON results.\n\
       --print              Print table after test.\n\
+      --counters           Collect per-thread event counters (requires\n\
+                           --enable-counters at configure time).\n\
 \n\
   -n, --no-run             Do not run new tests.\n\
   -c, --compare=EXPERIMENT Generated plot compares to EXPERIMENT.\n\
@@ -858,17 +867,6 @@ static void abortable_signal_handler(int) {
 int
 main(int argc, char *argv[])
 {
-    threadcounter_names[(int) tc_root_retry] = "root_retry";
-    threadcounter_names[(int) tc_internode_retry] = "internode_retry";
-    threadcounter_names[(int) tc_leaf_retry] = "leaf_retry";
-    threadcounter_names[(int) tc_leaf_walk] = "leaf_walk";
-    threadcounter_names[(int) tc_stable_internode_insert] = "stable_internode_insert";
-    threadcounter_names[(int) tc_stable_internode_split] = "stable_internode_split";
-    threadcounter_names[(int) tc_stable_leaf_insert] = "stable_leaf_insert";
-    threadcounter_names[(int) tc_stable_leaf_split] = "stable_leaf_split";
-    threadcounter_names[(int) tc_internode_lock] = "internode_lock_retry";
-    threadcounter_names[(int) tc_leaf_lock] = "leaf_lock_retry";
-
     int ret, ntrials = 1, normtype = normtype_pertest, firstcore = -1, corestride = 1;
     std::vector<const char *> tests, treetypes;
     std::vector<String> comparisons;
@@ -931,6 +929,13 @@ main(int argc, char *argv[])
         case opt_stats:
             json_stats = true;
             break;
+        case opt_counters:
+            if (!clp->negated && !threadinfo::has_counters()) {
+                Clp_OptionError(clp, "%<%O%> requires a build configured with %<--enable-counters%>");
+                exit(EXIT_FAILURE);
+            }
+            threadinfo::set_counters_enabled(!clp->negated);
+            break;
         case opt_yrange:
             gnuplot_yrange = clp->vstr;
             break;
@@ -30,6 +30,8 @@
 #include "value_bag.hh"
 #include "value_string.hh"
 #include "json.hh"
+#include "crc32c.hh"
+#include "lz.hh"
 using namespace lcdf;
 
 uint8_t xb[100];
@@ -448,6 +450,42 @@ void test_value_updates() {
     strb->deallocate(ti);
 }
 
+void test_crc32c() {
+    // RFC 3720 check value
+    assert(crc32c("123456789", 9) == 0xE3069283);
+    assert(crc32c("", 0) == 0);
+    char buf[200];
+    for (int i = 0; i != 200; ++i)
+        buf[i] = i * 7;
+    for (int i = 0; i <= 200; i += 13)
+        assert(crc32c(buf + i, 200 - i, crc32c(buf, i)) == crc32c(buf, 200));
+}
+
+void test_lz() {
+    char raw[5000], z[5100], out[5000];
+    kvrandom_lcg_nr r;
+    for (int i = 0; i != 5000; ++i)
+        raw[i] = i < 2000 ? "key-0000"[i % 8] + (i / 64) % 3 : r();
+    for (int len : {0, 1, 12, 13, 100, 2000, 5000}) {
+        size_t zlen = lz_compress(raw, len, z);
+        assert(zlen <= lz_compress_bound(len));
+        assert(lz_decompress(z, zlen, out, len));
+        assert(memcmp(raw, out, len) == 0);
+        if (len == 2000)
+            assert(zlen < 400);
+        if (len > 0)
+            assert(!lz_decompress(z, zlen, out, len - 1));
+    }
+    // corrupt offsets must not read outside the output
+    size_t zlen = lz_compress(raw, 2000, z);
+    for (size_t i = 0; i != zlen; ++i) {
+        char c = z[i];
+        z[i] ^= 0x5A;
+        (void) lz_decompress(z, zlen, out, 2000);
+        z[i] = c;
+    }
+}
+
 int main(int, char *[])
 {
     //test_atomics();
@@ -463,6 +501,8 @@ int main(int, char *[])
     test_string_bag();
     test_json();
     test_value_updates();
+    test_crc32c();
+    test_lz();
     std::cout << "Tests complete!\n";
     return 0;
 }